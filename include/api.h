@@ -4,13 +4,30 @@
 
 #define TES_NCHANNELS 2
 
+/* Topic prefixed to each message on the PUB sockets. Subscribe to a
+ * prefix of it. */
+#define TES_TOPIC_LEN     4 // product, encoding, channel, reserved
+#define TES_TOPIC_ALLCH 0xFF // channel of products for all channels
+#define TES_TOPIC_MCA     'M' // product
+#define TES_TOPIC_MCA_SUM 'A' // product
+#define TES_TOPIC_JITTER  'J' // product
+#define TES_TOPIC_SMCA_HEIGHT 'h' // product
+#define TES_TOPIC_SMCA_AREA   'a' // product
+#define TES_TOPIC_SMCA_PULSE  'p' // product
+#define TES_TOPIC_COINC   'C' // product
+#define TES_TOPIC_SGLTR   'T' // product
+#define TES_TOPIC_RAW     'R' // encoding
+#define TES_TOPIC_SPARSE  'S' // encoding
+#define TES_TOPIC_DELTA   'D' // encoding
+#define TES_TOPIC_REPLAY  'r' // last byte, last message re-sent
+
 /* Server info */
 #define TES_INFO_LPORT "55554"
 #define TES_INFO_REQ_OK    0 // accepted, reply/action follows
 #define TES_INFO_REQ_EINV  1 // malformed request
 
 #define TES_INFO_REQ_PIC        "4"
-#define TES_INFO_REP_PIC "18888888"
+#define TES_INFO_REP_PIC "188888888"
 
 /* Capture to file */
 #define TES_CAP_LPORT "55555"
@@ -24,7 +41,7 @@
 #define TES_CAP_REQ_EFIN   7 // conversion ok, error deleting data
                              // files or writing stats
 
-#define TES_CAP_REQ_PIC  "ss88111"
+#define TES_CAP_REQ_PIC  "ss88111188118"
 #define TES_CAP_REP_PIC "18888888"
 
 #define TES_H5_OVRWT_NONE   0 // error if /<RG>/<group> exists
@@ -39,31 +56,112 @@
 #define TES_CAP_CAPONLY  1 // capture only
 #define TES_CAP_CONVONLY 2 // convert only
 
+/* Conversion mode. */
+#define TES_H5_COPY     0 // copy data into the hdf5 file
+#define TES_H5_EXTERNAL 1 // hdf5 datasets refer to the data files
+
+/* Stream a capture */
+#define TES_STREAM_LPORT "55559"
+#define TES_STREAM_DATA 0 // bytes for one of the files
+#define TES_STREAM_END  1 // last message, carries the stats
+#define TES_STREAM_MAXCREDIT 16 // batches in flight at most
+
+#define TES_STREAM_REQ_PIC    "8814"
+#define TES_STREAM_CREDIT_PIC "4"
+#define TES_STREAM_REP_PIC    "11s8b"
+
+/* Conversion progress */
+#define TES_CONV_LPORT "55558"
+#define TES_CONV_REQ_DONE    0 // converted successfully
+#define TES_CONV_REQ_EINV    1 // malformed request
+#define TES_CONV_REQ_ENOENT  2 // no such capture or conversion
+#define TES_CONV_REQ_QUEUED  3 // waiting for a worker
+#define TES_CONV_REQ_RUNNING 4 // being converted
+#define TES_CONV_REQ_ECONV   5 // error while converting
+
+#define TES_CONV_REQ_PIC  "ss"
+#define TES_CONV_REP_PIC "1488"
+
 /* Get average trace */
 #define TES_AVGTR_LPORT "55556"
 #define TES_AVGTR_REQ_OK    0 // accepted
 #define TES_AVGTR_REQ_EINV  1 // malformed request
 #define TES_AVGTR_REQ_ETOUT 2 // timeout
 #define TES_AVGTR_REQ_EERR  3 // dropped trace
-#define TES_AVGTR_REQ_PIC  "4"
-#define TES_AVGTR_REP_PIC "1b"
+#define TES_AVGTR_REQ_EBUSY 4 // too many clients waiting
+#define TES_AVGTR_REQ_PIC  "44"
+#define TES_AVGTR_REP_PIC "14b"
 // #define TES_AVGTR_MAXSIZE 65528U
 
 /* Publish MCA histogram */
 #define TES_HIST_LPORT "55565"
 #include "net/tespkt.h" // defines TES_HIST_MAXSIZE
 
-/* Publish jitter histogram */
-#define TES_JITTER_REQ_PIC "18"
-#define TES_JITTER_REP_PIC "18"
+/* Publish sums of MCA histograms */
+#define TES_HIST_ACC_REQ_PIC "48"
+#define TES_HIST_ACC_REP_PIC "48"
+#define TES_HIST_ACC_REP_LPORT "55566"
+#define TES_HIST_ACC_HDR_LEN 48 // count + MCA header
+#define TES_HIST_ACC_MAXBINS \
+	((TES_HIST_MAXSIZE - TESPKT_MCA_HDR_LEN) / TESPKT_MCA_BIN_LEN)
+#define TES_HIST_ACC_MAXSIZE (TES_HIST_ACC_HDR_LEN + \
+                 8*TES_HIST_ACC_MAXBINS) // 64-bit bins
+
+/* Publish sparse or delta encoded MCA histograms */
+#define TES_HIST_ENC_HDR_LEN 48 // encoding + MCA header
+#define TES_HIST_ENC_RUN_LEN  4 // first bin + number of bins
+#define TES_HIST_ENC_MAXSIZE (TES_HIST_ENC_HDR_LEN + \
+                 8*TES_HIST_ACC_MAXBINS) // runs of one bin
+
+/* Publish jitter histograms between pairs of channels */
+#define TES_JITTER_REQ_PIC "18821"
+#define TES_JITTER_REP_PIC "18821"
 #define TES_JITTER_REP_LPORT "55557"
 #define TES_JITTER_PUB_LPORT "55567"
 #define TES_JITTER_HDR_LEN    8 // global
 #define TES_JITTER_SUBHDR_LEN 8 // per-histogram
-#define TES_JITTER_NBINS   1022 // including under-/overflow
-#define TES_JITTER_SUBSIZE 4096 // subhdr + nbins*4 bytes
-#define TES_JITTER_NHISTS  (TES_NCHANNELS - 1)
-#define TES_JITTER_SIZE    (TES_JITTER_HDR_LEN + \
-                 TES_JITTER_SUBSIZE*TES_JITTER_NHISTS)
+#define TES_JITTER_MAXCH      8 // channels an event can be from
+#define TES_JITTER_MAXHISTS (TES_JITTER_MAXCH*(TES_JITTER_MAXCH - 1))
+#define TES_JITTER_MINBINS    3 // including under-/overflow
+#define TES_JITTER_MAXBINS 2048
+#define TES_JITTER_MAXSHIFT  16 // log2 of bin width in units of 4ns
+#define TES_JITTER_MAXSIZE (TES_JITTER_HDR_LEN + TES_JITTER_MAXHISTS* \
+                 (TES_JITTER_SUBHDR_LEN + 4*TES_JITTER_MAXBINS))
+/* Bit in the pairs mask for the histogram of ch against ref_ch */
+#define TES_JITTER_PAIR(ref_ch,ch) \
+	((uint64_t)1 << ((ref_ch)*TES_JITTER_MAXCH + (ch)))
+
+/* Software MCA: histograms of event quantities */
+#define TES_SMCA_REQ_PIC "114128"
+#define TES_SMCA_REP_PIC "114128"
+#define TES_SMCA_REP_LPORT "55560"
+#define TES_SMCA_PUB_LPORT "55561"
+#define TES_SMCA_HDR_LEN   24 // binning, ticks, total
+#define TES_SMCA_MINBINS    3 // including under-/overflow
+#define TES_SMCA_MAXBINS 4096
+#define TES_SMCA_MAXSIZE (TES_SMCA_HDR_LEN + 4*TES_SMCA_MAXBINS)
+
+/* Publish N-fold coincidences between channels */
+#define TES_COINC_REQ_PIC "114"
+#define TES_COINC_REP_PIC "114"
+#define TES_COINC_REP_LPORT "55562"
+#define TES_COINC_PUB_LPORT "55563"
+#define TES_COINC_HDR_LEN   16 // tick, number of records
+#define TES_COINC_REC_LEN    8 // time, number of channels
+#define TES_COINC_ENTRY_LEN  8 // per channel in a record
+#define TES_COINC_MAXCH      8 // channels an event can be from
+#define TES_COINC_MAXWINDOW 65535 // in units of 4ns
+#define TES_COINC_MAXSIZE 65536
+
+/* Publish averages of single traces */
+#define TES_SGLTR_REQ_PIC "14442"
+#define TES_SGLTR_REP_PIC "14442"
+#define TES_SGLTR_REP_LPORT "55564"
+#define TES_SGLTR_PUB_LPORT "55568"
+#define TES_SGLTR_HDR_LEN   16 // traces, samples, baseline, skipped
+#define TES_SGLTR_MAXSAMPLES \
+	((TES_AVGTR_MAXSIZE - TESPKT_TRACE_FULL_HDR_LEN) / 2)
+#define TES_SGLTR_MAXSIZE (TES_SGLTR_HDR_LEN + \
+                 8*TES_SGLTR_MAXSAMPLES) // samples as doubles
 
 #endif
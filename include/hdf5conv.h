@@ -14,7 +14,19 @@
  *
  * Each dataset corresponds to a file (or part of a file).
  * Measurement group and dataset files and names are given in
- * a struct hdf5_conv_req_t.
+ * a struct hdf5_conv_req_t. Dataset names may contain slashes, in
+ * which case missing intermediate groups are created.
+ *
+ * Datasets are either copied into the hdf5 file, or, if external is
+ * set in the request, created as external datasets which refer to
+ * the data files (see H5Pset_external). The latter only writes
+ * metadata, so it takes the same time regardless of the size of the
+ * data; the data files must then be kept in place.
+ *
+ * Datasets copied from a file with verify set are checked block by
+ * block against the file's checksums as they are written. A
+ * mismatch fails the conversion with TES_CAP_REQ_ECONV; a missing
+ * checksum file is not an error.
  */
 
 #ifndef __HDF5CONV_H__INCLUDED__
@@ -44,17 +56,26 @@ struct hdf5_dset_desc_t
 	ssize_t length;   /* how many bytes to copy to dataset */
 	char*   filename; /* /path/to/<datafile> */
 	void*   buffer;   /* address of mmapped data */
+	bool    verify;   /* check against the checksum sidecar of
+	                   * filename (see tescap.h) before copying,
+	                   * ignored for external datasets */
 };
 
 struct hdf5_conv_req_t
 {
-	char*   filename;  /* /path/to/<hdf5file> */
-	char*   group;     /* group name under root group /<RG> */
-	struct  hdf5_dset_desc_t* dsets; /* an array of datasets */
-	uint8_t num_dsets; /* how many elements in datasets array */
-	uint8_t ovrwtmode; /* see api.h */
-	bool    async;     /* return after opening files,
-	                    * convert in background */
+	char*    filename;  /* /path/to/<hdf5file> */
+	char*    group;     /* group name under root group /<RG> */
+	struct   hdf5_dset_desc_t* dsets; /* an array of datasets */
+	uint16_t num_dsets; /* how many elements in datasets array */
+	uint8_t  ovrwtmode; /* see api.h */
+	bool     async;     /* return after opening files,
+	                     * convert in background */
+	bool     external;  /* link to data files instead of copying,
+	                     * ignored for datasets given as buffer */
+	uint64_t* done;     /* if not NULL, bytes converted so far are
+	                     * added to it */
+	uint64_t* total;    /* if not NULL, set to the total number of
+	                     * bytes once the files are opened */
 };
 
 /*
@@ -65,4 +86,67 @@ struct hdf5_conv_req_t
  */
 int hdf5_conv (struct hdf5_conv_req_t* creq);
 
+/* -------------------------------------------------------------- */
+
+/*
+ * A queue of conversions, run in the background by a pool of worker
+ * processes.
+ *
+ * A dispatcher thread starts a worker process (a fork) for each
+ * queued job, in the order they were queued, with at most nworkers
+ * running at a time. Two jobs writing to the same hdf5 file are
+ * never run at the same time. Progress (bytes converted out of
+ * total) is kept in memory shared with the workers, and finished
+ * jobs are remembered until their slot is needed for a new job.
+ */
+
+/* State of a job. */
+#define HDF5_CONV_QUEUED  1
+#define HDF5_CONV_RUNNING 2
+#define HDF5_CONV_DONE    3
+
+struct hdf5_conv_stat_t
+{
+	uint8_t  state;  /* one of HDF5_CONV_* */
+	uint8_t  status; /* TES_CAP_REQ_* when done */
+	uint32_t ahead;  /* number of jobs queued before it */
+	uint64_t done;   /* bytes converted */
+	uint64_t total;  /* bytes to convert, 0 until started */
+};
+
+/*
+ * Start the dispatcher. At most nslots jobs can be queued or
+ * running at a time, at most nworkers of which are running.
+ * Returns 0 on success, -1 on error.
+ */
+int hdf5_conv_queue_start (int nworkers, int nslots);
+
+/*
+ * Stop the dispatcher. Jobs which have not started are discarded,
+ * running ones continue in the background.
+ */
+void hdf5_conv_queue_stop (void);
+
+/*
+ * Queue a conversion. The request is copied, including any
+ * datasets given as buffers. async, done and total are ignored.
+ * On success, sets id to the job's ID.
+ * Returns TES_CAP_REQ_*
+ */
+int hdf5_conv_queue (const struct hdf5_conv_req_t* creq,
+	uint32_t* id);
+
+/*
+ * Get the state of a job.
+ * Returns 0 on success, -1 if the job is not known (anymore).
+ */
+int hdf5_conv_stat (uint32_t id, struct hdf5_conv_stat_t* st);
+
+/*
+ * Find the most recent job converting into group of filename.
+ * Returns 0 on success, -1 if there is no such job.
+ */
+int hdf5_conv_find (const char* filename, const char* group,
+	uint32_t* id);
+
 #endif
@@ -0,0 +1,171 @@
+/*
+ * Reading the index files written by the capture task.
+ *
+ * The tick index (.tidx) contains one entry per tick, in the order
+ * they were received. Each entry records the tick's timestamp, its
+ * frame number and the offset into each data file at which the
+ * tick's payload (for .tdat), or the payloads following it (for the
+ * rest), begin. The data belonging to tick k in any data file is
+ * therefore between the offsets of entries k and k+1, or until EOF
+ * for the last tick.
+ *
+ * Frame numbers and offsets are relative to the start of the segment
+ * if the capture was split into segments.
+ */
+
+#ifndef __TESCAP_H__INCLUDED__
+#define __TESCAP_H__INCLUDED__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Data files in the tick index. If all payloads are saved to a
+ * single file, all offsets refer to it. */
+#define TESCAP_TDAT 0 /* ticks */
+#define TESCAP_EDAT 1 /* events */
+#define TESCAP_MDAT 2 /* MCA */
+#define TESCAP_BDAT 3 /* bad frames */
+#define TESCAP_NDATS 4
+
+#define TESCAP_TIDX_LEN 56
+struct tescap_tidx
+{
+	uint64_t ts;          /* timestamp of the tick */
+	uint32_t tick_frame;  /* frame number of the tick */
+	uint32_t start_frame; /* frame number of first non-tick event */
+	uint32_t stop_frame;  /* frame number of last non-tick event */
+	uint32_t reserved;
+	uint64_t offsets[TESCAP_NDATS]; /* offset into data files */
+};
+/* If no event frames follow the tick, start_frame and stop_frame
+ * are equal to tick_frame. */
+
+/*
+ * The frame index (.fidx) contains one entry per frame. The start of
+ * a frame is its offset into the data file it was saved to, which is
+ * given by the payload type (see TESCAP_FTYPE_*).
+ */
+#define TESCAP_FIDX_LEN 16
+struct tescap_fidx
+{
+	uint64_t start;   /* offset into data file */
+	uint32_t length;  /* payload length */
+	uint16_t esize;   /* event size, in FPGA byte order */
+	uint8_t  changed; /* event type or size differs from previous */
+	uint8_t  ftype;   /* payload type, and flags below */
+};
+#define TESCAP_FTYPE_PT(ftype) ((ftype) & 0x0F)
+#define TESCAP_FTYPE_HDR  0x40 /* header frame of a trace or MCA */
+#define TESCAP_FTYPE_SEQ  0x80 /* frames were lost before this one */
+/* Payload types, other than these are events. */
+#define TESCAP_FTYPE_TICK 7
+#define TESCAP_FTYPE_MCA  8
+#define TESCAP_FTYPE_BAD  9
+
+/*
+ * The compact frame index (.cidx) is written instead of .fidx if the
+ * server is built with COMPACT_FIDX. It is a sequence of records of
+ * one of two kinds:
+ *
+ *  - a frame: a header byte, which is the entry's ftype with
+ *    TESCAP_CIDX_CHANGED and TESCAP_CIDX_ESIZE possibly set, followed
+ *    by the length, the esize if TESCAP_CIDX_ESIZE is set (otherwise
+ *    it is the same as in the previous frame), and the difference
+ *    between the start and its prediction, zigzag encoded. The
+ *    prediction is the end of the last frame saved to the same data
+ *    file, or 0 for the first.
+ *
+ *  - a run: the header byte TESCAP_CIDX_RUN, followed by a count n.
+ *    The previous frame is repeated n times, with changed unset and
+ *    each start as predicted.
+ *
+ * All numbers after the header byte are unsigned LEB128 varints.
+ */
+#define TESCAP_CIDX_CHANGED 0x10
+#define TESCAP_CIDX_ESIZE   0x20
+#define TESCAP_CIDX_RUN     0x0F
+#define TESCAP_CIDX_MAXLEN  19 /* longest record */
+
+/*
+ * Decode a compact frame index of len bytes into up to nframes
+ * entries of fidx. fidx can be NULL to count the entries.
+ * Returns the total number of entries in buf, or -1 if it is
+ * corrupt (errno is set to EINVAL).
+ */
+ssize_t tescap_cidx_decode (const uint8_t* buf, size_t len,
+	struct tescap_fidx* fidx, size_t nframes);
+
+/*
+ * Read and decode a compact frame index file. Sets nframes to the
+ * number of entries.
+ * Returns an array to be freed by the caller, or NULL on error
+ * (errno is set).
+ */
+struct tescap_fidx* tescap_cidx_load (const char* filename,
+	size_t* nframes);
+
+/*
+ * Every data and index file has a sidecar (<file>.crc) with the
+ * CRC32C of each batch of bytes, in the order they were written.
+ * Batches are contiguous and cover the whole file.
+ */
+#define TESCAP_CRC_EXT ".crc"
+#define TESCAP_CRC_LEN 16
+struct tescap_crc
+{
+	uint64_t offset; /* of the batch in the file */
+	uint32_t length; /* of the batch */
+	uint32_t crc;    /* CRC32C of the batch */
+};
+
+/*
+ * Update crc with len bytes at buf. Start with a crc of 0. Uses
+ * SSE4.2 if the CPU supports it.
+ */
+uint32_t tescap_crc32c (uint32_t crc, const void* buf, size_t len);
+
+/*
+ * mmap the checksums of a file, given the name of the file (not of
+ * the sidecar). Sets nblocks to the number of entries.
+ * Returns the mapped address or NULL on error (errno is set).
+ */
+struct tescap_crc* tescap_crc_map (const char* filename,
+	size_t* nblocks);
+
+/*
+ * Unmap checksums mapped with tescap_crc_map.
+ */
+void tescap_crc_unmap (struct tescap_crc* crcs, size_t nblocks);
+
+/*
+ * mmap a tick index file read-only. Sets nticks to the number of
+ * entries in it.
+ * Returns the mapped address or NULL on error (errno is set).
+ */
+struct tescap_tidx* tescap_tidx_map (const char* filename,
+	size_t* nticks);
+
+/*
+ * Unmap a tick index mapped with tescap_tidx_map.
+ */
+void tescap_tidx_unmap (struct tescap_tidx* tidx, size_t nticks);
+
+/*
+ * Returns the number of the first tick with a timestamp greater than
+ * or equal to ts, or nticks if there is no such tick. Timestamps
+ * must not decrease along the index.
+ */
+size_t tescap_tidx_find (const struct tescap_tidx* tidx,
+	size_t nticks, uint64_t ts);
+
+/*
+ * Gets the range of bytes in data file dat (one of TESCAP_*DAT)
+ * belonging to ticks first to last (inclusive). Sets end to -1 if
+ * the range extends until EOF.
+ * Returns 0 on success, -1 if first > last or last >= nticks.
+ */
+int tescap_tidx_range (const struct tescap_tidx* tidx,
+	size_t nticks, size_t first, size_t last, int dat,
+	off_t* start, off_t* end);
+
+#endif
@@ -26,10 +26,22 @@
 typedef int (cmd_hn)(const char*, const char*, int, char*[]);
 static cmd_hn s_server_info;
 static cmd_hn s_jitter_conf;
+static cmd_hn s_hist_conf;
+static cmd_hn s_smca_conf;
+static cmd_hn s_coinc_conf;
+static cmd_hn s_sgltr_conf;
 static cmd_hn s_local_save_trace;
 static cmd_hn s_local_save_mca;
+static cmd_hn s_local_save_mca_sum;
+static cmd_hn s_local_save_mca_sparse;
+static cmd_hn s_local_save_mca_delta;
+static cmd_hn s_local_save_smca;
 static cmd_hn s_local_save_jitter;
+static cmd_hn s_local_save_coinc;
+static cmd_hn s_local_save_sgltr;
 static cmd_hn s_remote_save_all;
+static cmd_hn s_conv_status;
+static cmd_hn s_remote_stream;
 
 static char s_prog_name[PATH_MAX];
 #define OPTS_G       "Z:F:" /* processed by main */
@@ -37,10 +49,16 @@ static char s_prog_name[PATH_MAX];
  * different subcommands, i.e. if one command has 'c' with no argument,
  * another one cannot have 'c:' with an argument */
 #define OPTS_S_INFO  "w:"
-#define OPTS_J_CONF  "t:R:"
-#define OPTS_R_ALL   "m:w:t:e:rocCa"
-#define OPTS_L_TRACE "w:"
-#define OPTS_L_HIST  "n:" /* both jitter and mca */
+#define OPTS_J_CONF  "t:R:N:P:b:s:"
+#define OPTS_H_CONF  "n:w:"
+#define OPTS_M_CONF  "i:q:l:s:n:t:"
+#define OPTS_N_CONF  "m:f:w:"
+#define OPTS_A_CONF  "i:n:l:u:b:"
+#define OPTS_R_ALL   "m:w:t:e:rocCaxT:S:dkb:"
+#define OPTS_C_STAT  "m:"
+#define OPTS_R_STRM  "t:e:dn:"
+#define OPTS_L_TRACE "w:M:"
+#define OPTS_L_HIST  "n:i:q:" /* jitter, mca, smca, coinc and sgltr */
 
 static void
 s_usage (void)
@@ -58,9 +76,53 @@ s_usage (void)
 		ANSI_FG_GREEN "jitter_conf" ANSI_RESET ": Configure or query jitter histogram configuration.\n"
 		ANSI_BOLD     "  Options:\n" ANSI_RESET
 		ANSI_FG_RED   "    -t <ticks>         " ANSI_RESET "Number of ticks to accumulate for.\n"
-		              "                                     Default is 0 (query setting).\n\n"
-		ANSI_FG_RED   "    -R <channel>       " ANSI_RESET "Event channel to trigger on.\n"
+		              "                                     Default is 0 (query setting).\n"
+		ANSI_FG_RED   "    -N <channels>      " ANSI_RESET "Number of channels.\n"
+		              "                                     Default is 2.\n"
+		ANSI_FG_RED   "    -R <channel>       " ANSI_RESET "Histogram all channels against this one.\n"
+		              "                                     Can be given more than once.\n"
+		ANSI_FG_RED   "    -P <mask>          " ANSI_RESET "Histogram the pairs whose bit is set, bit\n"
+		              "                                     8*<ref channel>+<channel>.\n"
+		              "                                     Default is all pairs.\n"
+		ANSI_FG_RED   "    -b <count>         " ANSI_RESET "Number of bins. Default is 1022.\n"
+		ANSI_FG_RED   "    -s <shift>         " ANSI_RESET "Log2 of the bin width in units of 4ns.\n"
 		              "                                     Default is 0.\n\n"
+		ANSI_FG_GREEN "mca_sum_conf" ANSI_RESET ": Configure or query summing of MCA histograms.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -n <count>         " ANSI_RESET "Number of histograms to sum.\n"
+		ANSI_FG_RED   "    -w <milliseconds>  " ANSI_RESET "Time to sum histograms over.\n"
+		              "                                     Give one of them, or neither to\n"
+		              "                                     query the setting.\n\n"
+		ANSI_FG_GREEN "smca_conf" ANSI_RESET ": Configure or query software MCA histograms.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -i <channel>       " ANSI_RESET "Channel to configure or query.\n"
+		              "                                     Default is 0.\n"
+		ANSI_FG_RED   "    -q <quantity>      " ANSI_RESET "h (peak height), a (area) or p (pulse area).\n"
+		              "                                     Default is h.\n"
+		ANSI_FG_RED   "    -l <value>         " ANSI_RESET "Lowest value of first bin.\n"
+		ANSI_FG_RED   "    -s <shift>         " ANSI_RESET "Bin width is 2^shift.\n"
+		ANSI_FG_RED   "    -n <bins>          " ANSI_RESET "Number of bins, including under-/overflow.\n"
+		              "                                     Default is 0 (query setting).\n"
+		ANSI_FG_RED   "    -t <ticks>         " ANSI_RESET "Number of ticks to accumulate for.\n"
+		              "                                     Default is 0 (query setting).\n\n"
+		ANSI_FG_GREEN "coinc_conf" ANSI_RESET ": Configure or query the search for coincidences.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -m <mask>          " ANSI_RESET "Bit for each channel to look at.\n"
+		ANSI_FG_RED   "    -f <count>         " ANSI_RESET "Minimum number of channels.\n"
+		ANSI_FG_RED   "    -w <window>        " ANSI_RESET "Window in units of 4ns.\n"
+		              "                                     Default is 0 (query setting).\n\n"
+		ANSI_FG_GREEN "sgltr_conf" ANSI_RESET ": Configure or query averaging of single traces.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -i <channel>       " ANSI_RESET "Channel to configure or query.\n"
+		              "                                     Default is 0.\n"
+		ANSI_FG_RED   "    -n <count>         " ANSI_RESET "Number of traces to average.\n"
+		              "                                     Default is 0 (query setting).\n"
+		ANSI_FG_RED   "    -l <area>          " ANSI_RESET "Lowest pulse area to accept.\n"
+		              "                                     Default is 0.\n"
+		ANSI_FG_RED   "    -u <area>          " ANSI_RESET "Highest pulse area to accept.\n"
+		              "                                     Default is no limit.\n"
+		ANSI_FG_RED   "    -b <samples>       " ANSI_RESET "Subtract the mean of that many first\n"
+		              "                                     samples. Default is 0 (don't).\n\n"
 		ANSI_FG_GREEN "remote_all" ANSI_RESET ": Save frames to a remote file.\n"
 		ANSI_BOLD     "  Options:\n" ANSI_RESET
 		ANSI_FG_RED   "    -F <filename>      " ANSI_RESET "Remote filename.\n"
@@ -75,19 +137,59 @@ s_usage (void)
 		ANSI_FG_RED   "    -c                 " ANSI_RESET "Capture only, no conversion.\n"
 		ANSI_FG_RED   "    -C                 " ANSI_RESET "Convert only, no capture.\n"
 		ANSI_FG_RED   "    -a                 " ANSI_RESET "Asynchronous hdf5 conversion.\n"
+		ANSI_FG_RED   "    -x                 " ANSI_RESET "Link to the data files instead of\n"
+		              "                       "            "copying them into the hdf5 file.\n"
+		ANSI_FG_RED   "    -T <ticks>         " ANSI_RESET "Start a new segment every that many\n"
+		              "                       "            "ticks. Default is 0 (never).\n"
+		ANSI_FG_RED   "    -S <bytes>         " ANSI_RESET "Start a new segment every that many\n"
+		              "                       "            "bytes. Default is 0 (never).\n"
+		ANSI_FG_RED   "    -d                 " ANSI_RESET "Also save each event field in its\n"
+		              "                       "            "own dataset.\n"
+		ANSI_FG_RED   "    -k                 " ANSI_RESET "Keep capturing after the last tick,\n"
+		              "                       "            "for the next request to adopt.\n"
+		              "                       "            "Conversion is asynchronous.\n"
+		ANSI_FG_RED   "    -b <timestamp>     " ANSI_RESET "Start at the first tick with at least\n"
+		              "                       "            "this timestamp. Default is 0 (first\n"
+		              "                       "            "tick after the request).\n"
 		"Only one of -o and -r can be given.\n"
 		"For status requests (-s) only measurement (-m) can be specified.\n\n"
+		ANSI_FG_GREEN "conv_status" ANSI_RESET ": Get the progress of the last hdf5 conversion.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -F <filename>      " ANSI_RESET "Remote filename.\n"
+		ANSI_FG_RED   "    -m <measurement>   " ANSI_RESET "Measurement name. Default is empty.\n\n"
+		ANSI_FG_GREEN "remote_stream" ANSI_RESET ": Capture frames to local files.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -F <filename>      " ANSI_RESET "Local filename.\n"
+		ANSI_FG_RED   "    -t <ticks>         " ANSI_RESET "Save at least that many ticks.\n"
+		              "                       "            "Default is 0.\n"
+		ANSI_FG_RED   "    -e <evens>         " ANSI_RESET "Save at least that many non-tick\n"
+		              "                       "            "events. Default is 0.\n"
+		ANSI_FG_RED   "    -d                 " ANSI_RESET "Also save each event field in its\n"
+		              "                       "            "own file.\n"
+		ANSI_FG_RED   "    -n <batches>       " ANSI_RESET "Let the server send up to that many\n"
+		              "                       "            "batches ahead. Default is 4.\n\n"
 		ANSI_FG_GREEN "local_trace" ANSI_RESET ": Save average traces to a local file.\n"
 		ANSI_BOLD     "  Options:\n" ANSI_RESET
 		ANSI_FG_RED   "    -F <filename>      " ANSI_RESET "Local filename.\n"
 		ANSI_FG_RED   "    -w <timeout>       " ANSI_RESET "Timeout in seconds. Sent to the server, will\n"
 		              "                       "            "receive a timeout error if no trace arrives\n"
-		              "                       "            "in this period. Default is 5.\n\n"
-		ANSI_FG_GREEN "local_mca | local_jitter" ANSI_RESET ": Save histograms to a local file.\n"
+		              "                       "            "in this period. Default is 5.\n"
+		ANSI_FG_RED   "    -M <milliseconds>  " ANSI_RESET "Accept the last trace if it is no older\n"
+		              "                       "            "than this. Default is 0.\n\n"
+		ANSI_FG_GREEN "local_mca | local_mca_sum | local_jitter" ANSI_RESET ": Save histograms to a local file.\n"
+		ANSI_FG_GREEN "local_coinc" ANSI_RESET ": Same as local_mca, for batches of coincidences.\n"
+		ANSI_FG_GREEN "local_sgltr" ANSI_RESET ": Same as local_mca, for averages of single traces.\n"
+		ANSI_FG_GREEN "local_mca_sparse | local_mca_delta" ANSI_RESET ": Same as local_mca, but receive\n"
+		              "                       "            "them encoded and decode them.\n"
 		ANSI_BOLD     "  Options:\n" ANSI_RESET
 		ANSI_FG_RED   "    -F <filename>      " ANSI_RESET "Local filename.\n"
 		ANSI_FG_RED   "    -n <count>         " ANSI_RESET "Save up to that many histograms.\n"
-		              "                       "            "Default is 1.\n",
+		              "                       "            "Default is 1.\n"
+		ANSI_FG_RED   "    -i <channel>       " ANSI_RESET "Save only those of that channel (not jitter).\n"
+		ANSI_FG_GREEN "local_smca" ANSI_RESET ": Same as local_mca, for software MCA histograms.\n"
+		ANSI_BOLD     "  Options:\n" ANSI_RESET
+		ANSI_FG_RED   "    -q <quantity>      " ANSI_RESET "h (peak height), a (area) or p (pulse area).\n"
+		              "                       "            "Default is h.\n",
 		s_prog_name
 		);
 }
@@ -146,6 +248,17 @@ s_prompt (void)
 	} while (1);
 }
 
+/*
+ * Returns true if product is a software MCA one.
+ */
+static bool
+s_is_smca (char product)
+{
+	return (product == TES_TOPIC_SMCA_HEIGHT ||
+		product == TES_TOPIC_SMCA_AREA ||
+		product == TES_TOPIC_SMCA_PULSE);
+}
+
 /* --------------------- PACKET INFO -------------------- */
 
 static int
@@ -210,7 +323,8 @@ s_server_info (const char* server, const char* filename,
 	puts ("Waiting for reply");
 
 	uint8_t rep;
-	uint64_t processed, missed, bad, ticks, mcas, traces, events;
+	uint64_t processed, missed, bad, ticks, mcas, traces, events,
+		coincs;
 	int rc = zsock_recv (sock, TES_INFO_REP_PIC,
 		&rep,
 		&processed,
@@ -219,7 +333,8 @@ s_server_info (const char* server, const char* filename,
 		&ticks,
 		&mcas,
 		&traces,
-		&events); 
+		&events,
+		&coincs);
 	zsock_destroy (&sock);
 
 	if (rc == -1)
@@ -240,14 +355,16 @@ s_server_info (const char* server, const char* filename,
 				"ticks:             %lu\n"
 				"mcas:              %lu\n"
 				"traces:            %lu\n"
-				"other events:      %lu\n",
+				"other events:      %lu\n"
+				"coincidences:      %lu\n",
 				processed,
 				missed,
 				bad,
 				ticks,
 				mcas,
 				traces,
-				events);
+				events,
+				coincs);
 			break;
 		default:
 			assert (0);
@@ -263,7 +380,11 @@ s_jitter_conf (const char* server, const char* filename,
 	int argc, char* argv[])
 {
 	uint64_t ticks = 0;
-	uint8_t ref_ch = 0;
+	uint8_t nchannels = TES_NCHANNELS;
+	uint64_t pairs = 0;
+	uint8_t refs = 0; /* bit for each -R */
+	uint16_t nbins = 1022;
+	uint8_t shift = 0;
 
 	/* Command-line */
 	char* buf = NULL;
@@ -286,17 +407,34 @@ s_jitter_conf (const char* server, const char* filename,
 				break;
 			case 't':
 			case 'R':
-				if (opt == 't')
-					ticks = strtoul (optarg, &buf, 10);
-				else
-					ref_ch = strtoul (optarg, &buf, 10);
-
-				if (strlen (buf))
+			case 'N':
+			case 'P':
+			case 'b':
+			case 's':
+			{
+				/* -P is a mask, allow hex */
+				uint64_t val = strtoul (optarg, &buf,
+					(opt == 'P') ? 0 : 10);
+				if (strlen (buf) ||
+					(opt == 'R' && val >= TES_JITTER_MAXCH) ||
+					(opt == 'N' && val > TES_JITTER_MAXCH) ||
+					(opt == 'b' && val > UINT16_MAX) ||
+					(opt == 's' && val > UINT8_MAX))
 				{
 					s_invalid_arg (opt);
 					return -1;
 				}
+				switch (opt)
+				{
+					case 't': ticks = val; break;
+					case 'R': refs |= (1 << val); break;
+					case 'N': nchannels = val; break;
+					case 'P': pairs = val; break;
+					case 'b': nbins = val; break;
+					case 's': shift = val; break;
+				}
 				break;
+			}
 			case '?':
 				s_invalid_opt (optopt);
 				return -1;
@@ -310,11 +448,27 @@ s_jitter_conf (const char* server, const char* filename,
 		}
 	}
 
+	if (refs && pairs)
+	{
+		s_conflicting_opt ();
+		return -1;
+	}
+	for (uint8_t ref_ch = 0; ref_ch < nchannels; ref_ch++)
+	{
+		if ( ! (refs & (1 << ref_ch)) )
+			continue;
+		for (uint8_t ch = 0; ch < nchannels; ch++)
+			if (ch != ref_ch)
+				pairs |= TES_JITTER_PAIR (ref_ch, ch);
+	}
+
 	/* Proceed? */
 	if (ticks > 0)
 	{
-		printf ("Configuring jitter to accumulate over %lu ticks"
-				"and trigger on channel %hhu\n", ticks, ref_ch);
+		printf ("Configuring jitter to accumulate over %lu ticks "
+				"with %hu bins of width %u for pairs 0x%016lx "
+				"of %hhu channels\n", ticks, nbins, 1U << shift,
+				pairs, nchannels);
 		if ( s_prompt () )
 			return -1;
 	}
@@ -332,10 +486,12 @@ s_jitter_conf (const char* server, const char* filename,
 	}
 
 	/* Send the request */
-	zsock_send (sock, TES_JITTER_REQ_PIC, ref_ch, ticks);
+	zsock_send (sock, TES_JITTER_REQ_PIC,
+		nchannels, pairs, ticks, nbins, shift);
 	puts ("Waiting for reply");
 
-	int rc = zsock_recv (sock, TES_JITTER_REP_PIC, &ref_ch, &ticks);
+	int rc = zsock_recv (sock, TES_JITTER_REP_PIC,
+		&nchannels, &pairs, &ticks, &nbins, &shift);
 	zsock_destroy (&sock);
 
 	if (rc == -1)
@@ -343,19 +499,21 @@ s_jitter_conf (const char* server, const char* filename,
 
 	/* Print reply */
 	printf ("\n");
-	printf ("Set values are: ticks = %lu, ref channel = %hhu\n",
-		ticks, ref_ch);
+	printf ("Set values are: ticks = %lu, channels = %hhu, "
+		"pairs = 0x%016lx, bins = %hu, shift = %hhu\n",
+		ticks, nchannels, pairs, nbins, shift);
 
 	return 0;
 }
 
-/* -------------------- AVERAGE TRACE ------------------- */
+/* ------------------- MCA SUM CONF ------------------- */
 
 static int
-s_local_save_trace (const char* server, const char* filename,
+s_hist_conf (const char* server, const char* filename,
 	int argc, char* argv[])
 {
-	uint32_t timeout = 5;
+	uint32_t nhists = 0;
+	uint64_t window = 0;
 
 	/* Command-line */
 	char* buf = NULL;
@@ -366,7 +524,7 @@ s_local_save_trace (const char* server, const char* filename,
 #endif
 	while (optind < argc)
 	{
-		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_L_TRACE);
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_H_CONF);
 		if (opt == -1)
 		{
 			optind++;
@@ -375,10 +533,14 @@ s_local_save_trace (const char* server, const char* filename,
 		switch (opt)
 		{
 			case 'Z':
-			case 'F':
 				break;
+			case 'n':
 			case 'w':
-				timeout = strtoul (optarg, &buf, 10);
+				if (opt == 'n')
+					nhists = strtoul (optarg, &buf, 10);
+				else
+					window = strtoul (optarg, &buf, 10);
+
 				if (strlen (buf))
 				{
 					s_invalid_arg (opt);
@@ -396,13 +558,24 @@ s_local_save_trace (const char* server, const char* filename,
 				assert (0);
 		}
 	}
+	if (nhists > 0 && window > 0)
+	{
+		s_conflicting_opt ();
+		return -1;
+	}
 
 	/* Proceed? */
-	printf ("Will save an average trace to local file '%s'.\n"
-		"Timeout is %u seconds.\n",
-		filename, timeout);
-	if ( s_prompt () )
-		return -1;
+	if (nhists > 0 || window > 0)
+	{
+		if (nhists > 0)
+			printf ("Configuring to sum every %u histograms\n",
+				nhists);
+		else
+			printf ("Configuring to sum histograms every %lu ms\n",
+				window);
+		if ( s_prompt () )
+			return -1;
+	}
 
 	/* Open the socket */
 	errno = 0;
@@ -416,87 +589,36 @@ s_local_save_trace (const char* server, const char* filename,
 		return -1;
 	}
 
-	/* Open the file */
-	int fd = open (filename, O_RDWR | O_APPEND | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd == -1)
-	{
-		perror ("Could not open the file");
-		zsock_destroy (&sock);
-		return -1;
-	}
-	off_t fsize = lseek (fd, 0, SEEK_END);
-	if (fsize == (off_t)-1)
-	{
-		perror ("Could not seek to end of file");
-		close (fd);
-		zsock_destroy (&sock);
-		return -1;
-	}
-	if (fsize > 0)
-		printf ("Appending to file of size %lu\n", fsize);
-
 	/* Send the request */
-	zsock_send (sock, TES_AVGTR_REQ_PIC, timeout);
+	zsock_send (sock, TES_HIST_ACC_REQ_PIC, nhists, window);
 	puts ("Waiting for reply");
 
-	uint8_t rep;
-	zchunk_t* trace;
-	int rc = zsock_recv (sock, TES_AVGTR_REP_PIC, &rep, &trace);
+	int rc = zsock_recv (sock, TES_HIST_ACC_REP_PIC, &nhists, &window);
 	zsock_destroy (&sock);
 
 	if (rc == -1)
 		return -1;
 
-	size_t trsize = 0;
-
 	/* Print reply */
 	printf ("\n");
-	switch (rep)
-	{
-		case TES_AVGTR_REQ_EINV:
-			printf ("Request was not understood\n");
-			break;
-		case TES_AVGTR_REQ_ETOUT:
-			printf ("Request timed out\n");
-			break;
-		case TES_AVGTR_REQ_OK:
-			trsize = zchunk_size (trace);
-			printf ("Received %lu bytes of data\n",
-				trsize);
-			break;
-		default:
-			assert (0);
-	}
-
-	/* Write to file */
-	if (trsize == 0)
-	{
-		close (fd);
-		return 0;
-	}
-	
-	ssize_t wrc = write (fd, zchunk_data (trace), trsize);
-	if (wrc == -1)
-	{
-		perror ("Could not write to file");
-	}
-	else if ((size_t)wrc != trsize)
-	{
-		fprintf (stderr, "Wrote only %lu bytes\n", wrc);
-	}
+	printf ("Set values are: histograms = %u, window = %lu ms\n",
+		nhists, window);
 
-	close (fd);
 	return 0;
 }
 
-/* ---------------------- HISTOGRAM --------------------- */
+/* ------------------- SOFTWARE MCA CONF ------------------- */
 
 static int
-s_local_save_hist (const char* server, const char* filename,
-	int argc, char* argv[], size_t max_size)
+s_smca_conf (const char* server, const char* filename,
+	int argc, char* argv[])
 {
-	uint64_t num_hist = 1;
+	uint8_t ch = 0;
+	uint8_t product = TES_TOPIC_SMCA_HEIGHT;
+	uint32_t lowest = 0;
+	uint8_t shift = 0;
+	uint16_t nbins = 0;
+	uint64_t ticks = 0;
 
 	/* Command-line */
 	char* buf = NULL;
@@ -507,24 +629,52 @@ s_local_save_hist (const char* server, const char* filename,
 #endif
 	while (optind < argc)
 	{
-		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_L_HIST);
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_M_CONF);
 		if (opt == -1)
 		{
 			optind++;
 			continue;
 		}
+		unsigned long val = 0;
 		switch (opt)
 		{
 			case 'Z':
-			case 'F':
 				break;
+			case 'q':
+				if ( ! s_is_smca (optarg[0]) ||
+					strlen (optarg) != 1 )
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				product = optarg[0];
+				break;
+			case 'i':
+			case 'l':
+			case 's':
 			case 'n':
-				num_hist = strtoul (optarg, &buf, 10);
-				if (strlen (buf) || num_hist == 0)
+			case 't':
+				val = strtoul (optarg, &buf, 10);
+				if ( strlen (buf) ||
+					(opt == 'i' && val >= TES_NCHANNELS) ||
+					(opt == 'l' && val > UINT32_MAX) ||
+					(opt == 's' && val > 31) ||
+					(opt == 'n' && (val < TES_SMCA_MINBINS ||
+						val > TES_SMCA_MAXBINS)) )
 				{
 					s_invalid_arg (opt);
 					return -1;
 				}
+				if (opt == 'i')
+					ch = val;
+				else if (opt == 'l')
+					lowest = val;
+				else if (opt == 's')
+					shift = val;
+				else if (opt == 'n')
+					nbins = val;
+				else
+					ticks = val;
 				break;
 			case '?':
 				s_invalid_opt (optopt);
@@ -537,18 +687,24 @@ s_local_save_hist (const char* server, const char* filename,
 				assert (0);
 		}
 	}
-	assert (num_hist > 0);
 
 	/* Proceed? */
-	printf ("Will save %lu histogram%s to local file '%s'.\n"
-		"Maximum total size is %lu.\n",
-		num_hist, (num_hist > 1)? "s" : "", filename, num_hist*max_size);
-	if ( s_prompt () )
-		return -1;
+	if (nbins > 0 || ticks > 0)
+	{
+		if (nbins > 0)
+			printf ("Configuring channel %hhu '%c' to %hu bins "
+				"of width 2^%hhu from %u\n",
+				ch, product, nbins, shift, lowest);
+		if (ticks > 0)
+			printf ("Configuring to publish every %lu ticks\n",
+				ticks);
+		if ( s_prompt () )
+			return -1;
+	}
 
 	/* Open the socket */
 	errno = 0;
-	zsock_t* sock = zsock_new_sub (server, "");
+	zsock_t* sock = zsock_new_req (server);
 	if (sock == NULL)
 	{
 		if (errno)
@@ -558,113 +714,36 @@ s_local_save_hist (const char* server, const char* filename,
 		return -1;
 	}
 
-	/* Open the file */
-	int fd = open (filename, O_RDWR | O_APPEND | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd == -1)
-	{
-		perror ("Could not open the file");
-		zsock_destroy (&sock);
-		return -1;
-	}
-	off_t fsize = lseek (fd, 0, SEEK_END);
-	if (fsize == (off_t)-1)
-	{
-		perror ("Could not seek to end of file");
-		close (fd);
-		zsock_destroy (&sock);
-		return -1;
-	}
-	if (fsize > 0)
-		printf ("Appending to file of size %lu\n", fsize);
+	/* Send the request */
+	zsock_send (sock, TES_SMCA_REQ_PIC,
+		ch, product, lowest, shift, nbins, ticks);
+	puts ("Waiting for reply");
 
-	/* Allocate space */
-	int rc = posix_fallocate (fd, fsize, num_hist*max_size);
-	if (rc)
-	{
-		errno = rc; /* posix_fallocate does not set it */
-		perror ("Could not allocate sufficient space");
-		close (fd);
-		zsock_destroy (&sock);
-		return -1;
-	}
+	int rc = zsock_recv (sock, TES_SMCA_REP_PIC,
+		&ch, &product, &lowest, &shift, &nbins, &ticks);
+	zsock_destroy (&sock);
 
-	/* mmap it */
-	/* TO DO: map starting at the last page boundary before end of
-	 * file. */
-	unsigned char* map = (unsigned char*)mmap (NULL,
-		fsize + num_hist*max_size,
-		PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == (void*)-1)
-	{
-		perror ("Could not mmap file");
-		close (fd);
-		zsock_destroy (&sock);
+	if (rc == -1)
 		return -1;
-	}
 
-	uint64_t h = 0;
-	size_t hsize = 0;
-	void* sock_h = zsock_resolve (sock);
-	assert (sock_h != NULL);
-	for (; ! zsys_interrupted && h < num_hist; h++)
-	{
-		rc = zmq_recv (sock_h, map + fsize + hsize, max_size, 0);
-		if (rc == -1)
-		{
-			perror ("Could not write to file");
-			break;
-		}
-		else if ((size_t)rc > max_size)
-		{
-			fprintf (stderr,
-				"Frame is too large: %lu bytes", (size_t)rc);
-			break;
-		}
-		hsize += (size_t)rc;
-	}
-	if (h < num_hist - 1)
-		printf ("Saved %lu histogram%s\n",
-			h, (num_hist > 1)? "s" : "");
+	/* Print reply */
+	printf ("\n");
+	printf ("Set values are: channel %hhu '%c': lowest = %u, "
+		"bin width = 2^%hhu, bins = %hu, ticks = %lu\n",
+		ch, product, lowest, shift, nbins, ticks);
 
-	zsock_destroy (&sock);
-	munmap (map, num_hist*max_size);
-	rc = ftruncate (fd, fsize + hsize);
-	if (rc == -1)
-		perror ("Could not truncate file");
-	close (fd);
 	return 0;
 }
 
-/* -------------------- MCA HISTOGRAM ------------------- */
-
-static int
-s_local_save_mca (const char* server, const char* filename,
-	int argc, char* argv[])
-{
-	return s_local_save_hist (server, filename,
-		argc, argv, TES_HIST_MAXSIZE);
-}
-
-/* ------------------ JITTER HISTOGRAM ------------------ */
-
-static int
-s_local_save_jitter (const char* server, const char* filename,
-	int argc, char* argv[])
-{
-	return s_local_save_hist (server, filename,
-		argc, argv, TES_JITTER_SIZE);
-}
-
-/* ------------------- REMOTE CAPTURE ------------------- */
+/* -------------------- COINCIDENCE CONF ------------------- */
 
 static int
-s_remote_save_all (const char* server, const char* filename,
+s_coinc_conf (const char* server, const char* filename,
 	int argc, char* argv[])
 {
-	char measurement[1024] = {0};
-	uint64_t min_ticks = 0, min_events = 0;
-	uint8_t ovrwtmode = 0, async = 0, capmode = 0;
+	uint8_t mask = (1 << TES_NCHANNELS) - 1;
+	uint8_t nfold = 2;
+	uint32_t window = 0;
 
 	/* Command-line */
 	char* buf = NULL;
@@ -675,7 +754,7 @@ s_remote_save_all (const char* server, const char* filename,
 #endif
 	while (optind < argc)
 	{
-		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_R_ALL);
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_N_CONF);
 		if (opt == -1)
 		{
 			optind++;
@@ -684,33 +763,807 @@ s_remote_save_all (const char* server, const char* filename,
 		switch (opt)
 		{
 			case 'Z':
-			case 'F':
 				break;
 			case 'm':
-				snprintf (measurement, sizeof (measurement),
-					"%s", optarg);
-				break;
-			case 't':
-			case 'e':
-				if (opt == 't')
-					min_ticks = strtoul (optarg, &buf, 10);
-				else
-					min_events = strtoul (optarg, &buf, 10);
-
-				if (strlen (buf))
+			case 'f':
+			case 'w':
+			{
+				/* -m is a mask, allow hex */
+				uint64_t val = strtoul (optarg, &buf,
+					(opt == 'm') ? 0 : 10);
+				if (strlen (buf) ||
+					(opt != 'w' && val > UINT8_MAX) ||
+					(opt == 'w' && val > TES_COINC_MAXWINDOW))
 				{
 					s_invalid_arg (opt);
 					return -1;
 				}
+				if (opt == 'm')
+					mask = val;
+				else if (opt == 'f')
+					nfold = val;
+				else
+					window = val;
 				break;
-			case 'r':
-			case 'o':
-				if (ovrwtmode)
-				{
-					s_conflicting_opt ();
-					return -1;
-				}
-
+			}
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+
+	/* Proceed? */
+	if (window > 0)
+	{
+		printf ("Configuring to look for %hhu-fold coincidences "
+			"between channels 0x%02hhx within %u\n",
+			nfold, mask, window);
+		if ( s_prompt () )
+			return -1;
+	}
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_req (server);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+
+	/* Send the request */
+	zsock_send (sock, TES_COINC_REQ_PIC, mask, nfold, window);
+	puts ("Waiting for reply");
+
+	int rc = zsock_recv (sock, TES_COINC_REP_PIC,
+		&mask, &nfold, &window);
+	zsock_destroy (&sock);
+
+	if (rc == -1)
+		return -1;
+
+	/* Print reply */
+	printf ("\n");
+	printf ("Set values are: channels = 0x%02hhx, fold = %hhu, "
+		"window = %u\n", mask, nfold, window);
+
+	return 0;
+}
+
+/* ------------------ SINGLE TRACE AVERAGE CONF ------------------ */
+
+static int
+s_sgltr_conf (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	uint8_t ch = 0;
+	uint32_t ntraces = 0;
+	uint32_t area_min = 0;
+	uint32_t area_max = UINT32_MAX;
+	uint16_t nbase = 0;
+
+	/* Command-line */
+	char* buf = NULL;
+#ifdef GETOPT_DEBUG
+	for (int a = 0; a < argc; a++)
+		printf ("%s ", argv[a]);
+	puts ("");
+#endif
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_A_CONF);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		unsigned long val = 0;
+		switch (opt)
+		{
+			case 'Z':
+				break;
+			case 'i':
+			case 'n':
+			case 'l':
+			case 'u':
+			case 'b':
+				val = strtoul (optarg, &buf, 10);
+				if ( strlen (buf) ||
+					(opt == 'i' && val >= TES_NCHANNELS) ||
+					(opt == 'b' && val > TES_SGLTR_MAXSAMPLES) ||
+					val > UINT32_MAX )
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				if (opt == 'i')
+					ch = val;
+				else if (opt == 'n')
+					ntraces = val;
+				else if (opt == 'l')
+					area_min = val;
+				else if (opt == 'u')
+					area_max = val;
+				else
+					nbase = val;
+				break;
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+
+	/* Proceed? */
+	if (ntraces > 0)
+	{
+		if (area_min > area_max)
+		{
+			fprintf (stderr, "Lowest area is above the highest\n");
+			return -1;
+		}
+		printf ("Configuring channel %hhu to average %u traces "
+			"with area %u to %u, baseline over %hu samples\n",
+			ch, ntraces, area_min, area_max, nbase);
+		if ( s_prompt () )
+			return -1;
+	}
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_req (server);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+
+	/* Send the request */
+	zsock_send (sock, TES_SGLTR_REQ_PIC,
+		ch, ntraces, area_min, area_max, nbase);
+	puts ("Waiting for reply");
+
+	int rc = zsock_recv (sock, TES_SGLTR_REP_PIC,
+		&ch, &ntraces, &area_min, &area_max, &nbase);
+	zsock_destroy (&sock);
+
+	if (rc == -1)
+		return -1;
+
+	/* Print reply */
+	printf ("\n");
+	printf ("Set values are: channel %hhu: traces = %u, "
+		"area = %u to %u, baseline samples = %hu\n",
+		ch, ntraces, area_min, area_max, nbase);
+
+	return 0;
+}
+
+/* -------------------- AVERAGE TRACE ------------------- */
+
+static int
+s_local_save_trace (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	uint32_t timeout = 5;
+	uint32_t max_age = 0;
+
+	/* Command-line */
+	char* buf = NULL;
+#ifdef GETOPT_DEBUG
+	for (int a = 0; a < argc; a++)
+		printf ("%s ", argv[a]);
+	puts ("");
+#endif
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_L_TRACE);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		switch (opt)
+		{
+			case 'Z':
+			case 'F':
+				break;
+			case 'w':
+				timeout = strtoul (optarg, &buf, 10);
+				if (strlen (buf))
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				break;
+			case 'M':
+				max_age = strtoul (optarg, &buf, 10);
+				if (strlen (buf))
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				break;
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+
+	/* Proceed? */
+	printf ("Will save an average trace to local file '%s'.\n"
+		"Timeout is %u seconds, maximum age is %u ms.\n",
+		filename, timeout, max_age);
+	if ( s_prompt () )
+		return -1;
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_req (server);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+
+	/* Open the file */
+	int fd = open (filename, O_RDWR | O_APPEND | O_CREAT,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1)
+	{
+		perror ("Could not open the file");
+		zsock_destroy (&sock);
+		return -1;
+	}
+	off_t fsize = lseek (fd, 0, SEEK_END);
+	if (fsize == (off_t)-1)
+	{
+		perror ("Could not seek to end of file");
+		close (fd);
+		zsock_destroy (&sock);
+		return -1;
+	}
+	if (fsize > 0)
+		printf ("Appending to file of size %lu\n", fsize);
+
+	/* Send the request */
+	zsock_send (sock, TES_AVGTR_REQ_PIC, timeout, max_age);
+	puts ("Waiting for reply");
+
+	uint8_t rep;
+	uint32_t age;
+	zchunk_t* trace;
+	int rc = zsock_recv (sock, TES_AVGTR_REP_PIC, &rep, &age, &trace);
+	zsock_destroy (&sock);
+
+	if (rc == -1)
+		return -1;
+
+	size_t trsize = 0;
+
+	/* Print reply */
+	printf ("\n");
+	switch (rep)
+	{
+		case TES_AVGTR_REQ_EINV:
+			printf ("Request was not understood\n");
+			break;
+		case TES_AVGTR_REQ_ETOUT:
+			printf ("Request timed out\n");
+			break;
+		case TES_AVGTR_REQ_EERR:
+			printf ("Trace was corrupted\n");
+			break;
+		case TES_AVGTR_REQ_EBUSY:
+			printf ("Too many clients are waiting\n");
+			break;
+		case TES_AVGTR_REQ_OK:
+			trsize = zchunk_size (trace);
+			printf ("Received %lu bytes of data, %u ms old\n",
+				trsize, age);
+			break;
+		default:
+			assert (0);
+	}
+
+	/* Write to file */
+	if (trsize == 0)
+	{
+		close (fd);
+		return 0;
+	}
+	
+	ssize_t wrc = write (fd, zchunk_data (trace), trsize);
+	if (wrc == -1)
+	{
+		perror ("Could not write to file");
+	}
+	else if ((size_t)wrc != trsize)
+	{
+		fprintf (stderr, "Wrote only %lu bytes\n", wrc);
+	}
+
+	close (fd);
+	return 0;
+}
+
+/* ---------------------- HISTOGRAM --------------------- */
+
+/*
+ * Decodes a sparse or delta encoded MCA histogram into hist. prev is
+ * the previously decoded one, of size prev_size, or NULL. seq is the
+ * sequence number of prev and is updated.
+ * Returns the size of the histogram, 0 if it is a delta which does
+ * not follow prev, or -1 if it is malformed.
+ */
+static ssize_t
+s_hist_decode (const unsigned char* msg, size_t len,
+	unsigned char* hist, const unsigned char* prev,
+	size_t prev_size, uint32_t* seq)
+{
+	if (len < TES_HIST_ENC_HDR_LEN)
+		return -1;
+
+	bool key = msg[0];
+	uint16_t nbins;
+	uint32_t cur_seq;
+	memcpy (&nbins, msg + 2, 2);
+	memcpy (&cur_seq, msg + 4, 4);
+	if (nbins > TES_HIST_ACC_MAXBINS)
+		return -1;
+
+	size_t size = TESPKT_MCA_HDR_LEN + nbins*TESPKT_MCA_BIN_LEN;
+	if ( ! key && (prev == NULL || prev_size != size ||
+		cur_seq != *seq + 1) )
+		return 0; /* wait for a keyframe */
+
+	memcpy (hist, msg + 8, TESPKT_MCA_HDR_LEN);
+	unsigned char* bins = hist + TESPKT_MCA_HDR_LEN;
+	if (key)
+		memset (bins, 0, nbins*TESPKT_MCA_BIN_LEN);
+	else
+		memcpy (bins, prev + TESPKT_MCA_HDR_LEN,
+			nbins*TESPKT_MCA_BIN_LEN);
+
+	size_t pos = TES_HIST_ENC_HDR_LEN;
+	while (pos < len)
+	{
+		uint16_t first, n;
+		if (len - pos < TES_HIST_ENC_RUN_LEN)
+			return -1;
+		memcpy (&first, msg + pos, 2);
+		memcpy (&n, msg + pos + 2, 2);
+		pos += TES_HIST_ENC_RUN_LEN;
+		if (first + n > nbins ||
+			len - pos < (size_t)n*TESPKT_MCA_BIN_LEN)
+			return -1;
+
+		for (uint16_t b = first; b < first + n; b++)
+		{
+			uint32_t v, d;
+			memcpy (&v, bins + b*TESPKT_MCA_BIN_LEN, sizeof (v));
+			memcpy (&d, msg + pos, sizeof (d));
+			v += d;
+			memcpy (bins + b*TESPKT_MCA_BIN_LEN, &v, sizeof (v));
+			pos += sizeof (d);
+		}
+	}
+
+	*seq = cur_seq;
+	return size;
+}
+
+/*
+ * Saves histograms of the given product as they are published. If
+ * encoding is not raw, saves them decoded. Replays of a channel's
+ * last histogram, which the server sends whenever someone
+ * subscribes, are dropped once one of the channel has been saved.
+ */
+static int
+s_local_save_hist (const char* server, const char* filename,
+	int argc, char* argv[], size_t max_size,
+	char product, char encoding)
+{
+	uint64_t num_hist = 1;
+	char prefix[TES_TOPIC_LEN - 1] = {product, encoding};
+	size_t prefix_len = 2;
+	bool decode = (encoding != TES_TOPIC_RAW);
+
+	/* Command-line */
+	char* buf = NULL;
+#ifdef GETOPT_DEBUG
+	for (int a = 0; a < argc; a++)
+		printf ("%s ", argv[a]);
+	puts ("");
+#endif
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_L_HIST);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		switch (opt)
+		{
+			case 'Z':
+			case 'F':
+				break;
+			case 'n':
+				num_hist = strtoul (optarg, &buf, 10);
+				if (strlen (buf) || num_hist == 0)
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				break;
+			case 'i':
+				prefix[2] = strtoul (optarg, &buf, 10);
+				if (strlen (buf) || prefix[2] >= TES_NCHANNELS ||
+					product == TES_TOPIC_JITTER ||
+					product == TES_TOPIC_COINC)
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				prefix_len = 3;
+				break;
+			case 'q':
+				if ( ! s_is_smca (prefix[0]) ||
+					! s_is_smca (optarg[0]) ||
+					strlen (optarg) != 1 )
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				prefix[0] = optarg[0];
+				break;
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+	assert (num_hist > 0);
+
+	/* Proceed? */
+	printf ("Will save %lu histogram%s to local file '%s'.\n"
+		"Maximum total size is %lu.\n",
+		num_hist, (num_hist > 1)? "s" : "", filename, num_hist*max_size);
+	if ( s_prompt () )
+		return -1;
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_sub (server, NULL);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+	/* The channel may be 0, subscribe as binary. */
+	int rc = zmq_setsockopt (zsock_resolve (sock), ZMQ_SUBSCRIBE,
+		prefix, prefix_len);
+	if (rc == -1)
+	{
+		perror ("Could not subscribe");
+		zsock_destroy (&sock);
+		return -1;
+	}
+
+	/* Open the file */
+	int fd = open (filename, O_RDWR | O_APPEND | O_CREAT,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1)
+	{
+		perror ("Could not open the file");
+		zsock_destroy (&sock);
+		return -1;
+	}
+	off_t fsize = lseek (fd, 0, SEEK_END);
+	if (fsize == (off_t)-1)
+	{
+		perror ("Could not seek to end of file");
+		close (fd);
+		zsock_destroy (&sock);
+		return -1;
+	}
+	if (fsize > 0)
+		printf ("Appending to file of size %lu\n", fsize);
+
+	/* Allocate space */
+	rc = posix_fallocate (fd, fsize, num_hist*max_size);
+	if (rc)
+	{
+		errno = rc; /* posix_fallocate does not set it */
+		perror ("Could not allocate sufficient space");
+		close (fd);
+		zsock_destroy (&sock);
+		return -1;
+	}
+
+	/* mmap it */
+	/* TO DO: map starting at the last page boundary before end of
+	 * file. */
+	unsigned char* map = (unsigned char*)mmap (NULL,
+		fsize + num_hist*max_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == (void*)-1)
+	{
+		perror ("Could not mmap file");
+		close (fd);
+		zsock_destroy (&sock);
+		return -1;
+	}
+
+	size_t rsize = TES_TOPIC_LEN +
+		(decode ? TES_HIST_ENC_MAXSIZE : max_size);
+	unsigned char* msg = malloc (rsize);
+	if (msg == NULL)
+	{
+		perror ("Could not allocate a buffer");
+		munmap (map, num_hist*max_size);
+		close (fd);
+		zsock_destroy (&sock);
+		return -1;
+	}
+	unsigned char* prev = NULL;
+	size_t prev_size = 0;
+	uint32_t seq = 0;
+	bool seen[UINT8_MAX + 1] = {0}; /* by channel */
+
+	uint64_t h = 0;
+	size_t hsize = 0;
+	void* sock_h = zsock_resolve (sock);
+	assert (sock_h != NULL);
+	while ( ! zsys_interrupted && h < num_hist )
+	{
+		rc = zmq_recv (sock_h, msg, rsize, 0);
+		if (rc == -1)
+		{
+			perror ("Could not write to file");
+			break;
+		}
+		else if ((size_t)rc > rsize)
+		{
+			fprintf (stderr,
+				"Frame is too large: %lu bytes", (size_t)rc);
+			break;
+		}
+		else if (rc < TES_TOPIC_LEN)
+		{
+			fprintf (stderr,
+				"Frame is too short: %lu bytes", (size_t)rc);
+			break;
+		}
+
+		if (msg[3] == TES_TOPIC_REPLAY && seen[msg[2]])
+			continue;
+
+		/* Strip the topic. */
+		unsigned char* hist = map + fsize + hsize;
+		rc -= TES_TOPIC_LEN;
+		if (decode)
+		{
+			ssize_t dsize = s_hist_decode (msg + TES_TOPIC_LEN,
+				rc, hist, prev, prev_size, &seq);
+			if (dsize == -1)
+			{
+				fprintf (stderr, "Malformed encoded histogram\n");
+				break;
+			}
+			if (dsize == 0)
+				continue;
+			prev = hist;
+			prev_size = dsize;
+			rc = dsize;
+		}
+		else
+			memcpy (hist, msg + TES_TOPIC_LEN, rc);
+		seen[msg[2]] = 1;
+		hsize += (size_t)rc;
+		h++;
+	}
+	free (msg);
+	if (h < num_hist - 1)
+		printf ("Saved %lu histogram%s\n",
+			h, (num_hist > 1)? "s" : "");
+
+	zsock_destroy (&sock);
+	munmap (map, num_hist*max_size);
+	rc = ftruncate (fd, fsize + hsize);
+	if (rc == -1)
+		perror ("Could not truncate file");
+	close (fd);
+	return 0;
+}
+
+/* -------------------- MCA HISTOGRAM ------------------- */
+
+static int
+s_local_save_mca (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_HIST_MAXSIZE,
+		TES_TOPIC_MCA, TES_TOPIC_RAW);
+}
+
+/* -------------- ENCODED MCA HISTOGRAM -------------- */
+
+static int
+s_local_save_mca_sparse (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_HIST_MAXSIZE,
+		TES_TOPIC_MCA, TES_TOPIC_SPARSE);
+}
+
+static int
+s_local_save_mca_delta (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_HIST_MAXSIZE,
+		TES_TOPIC_MCA, TES_TOPIC_DELTA);
+}
+
+/* ------------------ SUM OF MCA HISTOGRAMS ------------------ */
+
+static int
+s_local_save_mca_sum (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_HIST_ACC_MAXSIZE,
+		TES_TOPIC_MCA_SUM, TES_TOPIC_RAW);
+}
+
+/* ---------------- SOFTWARE MCA HISTOGRAM ---------------- */
+
+static int
+s_local_save_smca (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_SMCA_MAXSIZE,
+		TES_TOPIC_SMCA_HEIGHT, TES_TOPIC_RAW);
+}
+
+/* ------------------ JITTER HISTOGRAM ------------------ */
+
+static int
+s_local_save_jitter (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_JITTER_MAXSIZE,
+		TES_TOPIC_JITTER, TES_TOPIC_RAW);
+}
+
+/* -------------------- COINCIDENCES -------------------- */
+
+static int
+s_local_save_coinc (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_COINC_MAXSIZE,
+		TES_TOPIC_COINC, TES_TOPIC_RAW);
+}
+
+/* ---------------- AVERAGE OF SINGLE TRACES ---------------- */
+
+static int
+s_local_save_sgltr (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	return s_local_save_hist (server, filename,
+		argc, argv, TES_SGLTR_MAXSIZE,
+		TES_TOPIC_SGLTR, TES_TOPIC_RAW);
+}
+
+/* ------------------- REMOTE CAPTURE ------------------- */
+
+static int
+s_remote_save_all (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	char measurement[1024] = {0};
+	uint64_t min_ticks = 0, min_events = 0;
+	uint64_t seg_ticks = 0, seg_size = 0, start_ts = 0;
+	uint8_t ovrwtmode = 0, async = 0, capmode = 0, h5mode = 0;
+	uint8_t columns = 0, cont = 0;
+
+	/* Command-line */
+	char* buf = NULL;
+#ifdef GETOPT_DEBUG
+	for (int a = 0; a < argc; a++)
+		printf ("%s ", argv[a]);
+	puts ("");
+#endif
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_R_ALL);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		switch (opt)
+		{
+			case 'Z':
+			case 'F':
+				break;
+			case 'm':
+				snprintf (measurement, sizeof (measurement),
+					"%s", optarg);
+				break;
+			case 't':
+			case 'e':
+			case 'T':
+			case 'S':
+			case 'b':
+				if (opt == 't')
+					min_ticks = strtoul (optarg, &buf, 10);
+				else if (opt == 'e')
+					min_events = strtoul (optarg, &buf, 10);
+				else if (opt == 'T')
+					seg_ticks = strtoul (optarg, &buf, 10);
+				else if (opt == 'S')
+					seg_size = strtoul (optarg, &buf, 10);
+				else
+					start_ts = strtoul (optarg, &buf, 10);
+
+				if (strlen (buf))
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				break;
+			case 'r':
+			case 'o':
+				if (ovrwtmode)
+				{
+					s_conflicting_opt ();
+					return -1;
+				}
+
 				if (opt == 'r')
 					ovrwtmode = TES_H5_OVRWT_RELINK;
 				else
@@ -732,6 +1585,15 @@ s_remote_save_all (const char* server, const char* filename,
 			case 'a':
 				async = 1;
 				break;
+			case 'x':
+				h5mode = TES_H5_EXTERNAL;
+				break;
+			case 'd':
+				columns = 1;
+				break;
+			case 'k':
+				cont = 1;
+				break;
 			case '?':
 				s_invalid_opt (optopt);
 				return -1;
@@ -756,7 +1618,7 @@ s_remote_save_all (const char* server, const char* filename,
 	{
 		printf ("Sending a%s %s request for remote filename "
 			"'%s' and measurement group '%s'.\n"
-			"%sWill terminate after at least "
+			"%s%sWill terminate after at least "
 			"%lu ticks and %lu events.\n",
 			async ? "n asynchronous" : "",
 			capmode == TES_CAP_CONVONLY ? "conversion only" :
@@ -767,7 +1629,19 @@ s_remote_save_all (const char* server, const char* filename,
 				"Will overwrite file.\n" : 
 				(ovrwtmode == TES_H5_OVRWT_RELINK) ?
 					"Will backup measurement group.\n" : "",
+			(h5mode == TES_H5_EXTERNAL) ?
+				"Will link to data files.\n" : "",
 			min_ticks, min_events);
+		if (seg_ticks || seg_size)
+			printf ("Will start a new segment every "
+				"%lu ticks or %lu bytes (0 is never).\n",
+				seg_ticks, seg_size);
+		if (cont)
+			printf ("Will continue capturing for the next "
+				"request.\n");
+		if (start_ts)
+			printf ("Will start at the first tick with a "
+				"timestamp of at least %lu.\n", start_ts);
 	}
 	if ( s_prompt () )
 		return -1;
@@ -792,7 +1666,13 @@ s_remote_save_all (const char* server, const char* filename,
 		min_events,
 		ovrwtmode,
 		async,
-		capmode);
+		capmode,
+		h5mode,
+		seg_ticks,
+		seg_size,
+		columns,
+		cont,
+		start_ts);
 	puts ("Waiting for reply");
 
 	uint8_t fstat;
@@ -856,6 +1736,297 @@ s_remote_save_all (const char* server, const char* filename,
 	return 0;
 }
 
+/* ------------------ CONVERSION STATUS ----------------- */
+
+static int
+s_conv_status (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	char measurement[1024] = {0};
+
+	/* Command-line */
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_C_STAT);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		switch (opt)
+		{
+			case 'Z':
+			case 'F':
+				break;
+			case 'm':
+				snprintf (measurement, sizeof (measurement),
+					"%s", optarg);
+				break;
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_req (server);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+
+	/* Send the request */
+	zsock_send (sock, TES_CONV_REQ_PIC, filename, measurement);
+
+	uint8_t cstat;
+	uint32_t ahead;
+	uint64_t done, total;
+	int rc = zsock_recv (sock, TES_CONV_REP_PIC,
+		&cstat, &ahead, &done, &total);
+	zsock_destroy (&sock);
+
+	if (rc == -1)
+		return -1;
+
+	/* Print reply */
+	switch (cstat)
+	{
+		case TES_CONV_REQ_EINV:
+			printf ("Request was not understood\n");
+			break;
+		case TES_CONV_REQ_ENOENT:
+			printf ("No conversion of this capture is known\n");
+			break;
+		case TES_CONV_REQ_QUEUED:
+			printf ("Conversion is queued after %u others\n", ahead);
+			break;
+		case TES_CONV_REQ_RUNNING:
+			printf ("Conversion is running: %lu of %lu bytes\n",
+				done, total);
+			break;
+		case TES_CONV_REQ_ECONV:
+			printf ("Conversion failed after %lu of %lu bytes\n",
+				done, total);
+			break;
+		case TES_CONV_REQ_DONE:
+			printf ("Conversion finished: %lu bytes\n", total);
+			break;
+		default:
+			assert (0);
+	}
+
+	return 0;
+}
+
+/* ------------------- STREAM CAPTURE ------------------- */
+
+#define STREAM_MAXFILES 16
+
+static int
+s_remote_stream (const char* server, const char* filename,
+	int argc, char* argv[])
+{
+	uint64_t min_ticks = 0, min_events = 0;
+	uint8_t columns = 0;
+	uint32_t credit = 4;
+
+	/* Command-line */
+	char* buf = NULL;
+	while (optind < argc)
+	{
+		int opt = getopt (argc, argv, "+:" OPTS_G OPTS_R_STRM);
+		if (opt == -1)
+		{
+			optind++;
+			continue;
+		}
+		switch (opt)
+		{
+			case 'Z':
+			case 'F':
+				break;
+			case 't':
+			case 'e':
+			case 'n':
+				if (opt == 't')
+					min_ticks = strtoul (optarg, &buf, 10);
+				else if (opt == 'e')
+					min_events = strtoul (optarg, &buf, 10);
+				else
+					credit = strtoul (optarg, &buf, 10);
+				if (strlen (buf))
+				{
+					s_invalid_arg (opt);
+					return -1;
+				}
+				break;
+			case 'd':
+				columns = 1;
+				break;
+			case '?':
+				s_invalid_opt (optopt);
+				return -1;
+			case ':': /* missing argument to option */
+				/* this should have been caught in main */
+				assert (0);
+			default:
+				/* we forgot to handle an option */
+				assert (0);
+		}
+	}
+
+	if ( (min_ticks == 0 && min_events == 0) || credit == 0 ||
+		credit > TES_STREAM_MAXCREDIT )
+	{
+		fprintf (stderr, "You must give a number of ticks or events "
+			"and up to %d batches.\n", TES_STREAM_MAXCREDIT);
+		return -1;
+	}
+
+	/* Proceed? */
+	printf ("Will stream %lu ticks and %lu events to local files "
+		"'%s.*'.\n", min_ticks, min_events, filename);
+	if ( s_prompt () )
+		return -1;
+
+	/* Open the socket */
+	errno = 0;
+	zsock_t* sock = zsock_new_dealer (server);
+	if (sock == NULL)
+	{
+		if (errno)
+			perror ("Could not connect to the server");
+		else
+			fprintf (stderr, "Could not connect to the server\n");
+		return -1;
+	}
+
+	/* Send the request */
+	zsock_send (sock, TES_STREAM_REQ_PIC,
+		min_ticks, min_events, columns, credit);
+	puts ("Waiting for data");
+
+	/* Files are opened as the first batch for each arrives. */
+	struct
+	{
+		char ext[8];
+		int  fd;
+	} files[STREAM_MAXFILES];
+	int nfiles = 0;
+	uint64_t received = 0;
+
+	int rc = -1;
+	while ( ! zsys_interrupted )
+	{
+		uint8_t type, status;
+		char* ext = NULL;
+		uint64_t offset;
+		byte* data = NULL;
+		size_t len;
+		if (zsock_recv (sock, TES_STREAM_REP_PIC,
+			&type, &status, &ext, &offset, &data, &len) == -1)
+			break;
+
+		if (type == TES_STREAM_END)
+		{
+			switch (status)
+			{
+				case TES_CAP_REQ_OK:
+					rc = 0;
+					break;
+				case TES_CAP_REQ_EINV:
+					printf ("Request was not understood\n");
+					break;
+				case TES_CAP_REQ_EFAIL:
+					printf ("Server is busy\n");
+					break;
+				case TES_CAP_REQ_EWRT:
+					printf ("Capture did not complete\n");
+					break;
+				default:
+					printf ("Server returned %hhu\n", status);
+			}
+		}
+		else
+		{
+			int f = 0;
+			while (f < nfiles && strcmp (files[f].ext, ext) != 0)
+				f++;
+			if (f == nfiles && nfiles < STREAM_MAXFILES)
+			{
+				char fname[PATH_MAX];
+				snprintf (fname, sizeof (fname), "%s.%s",
+					filename, ext);
+				snprintf (files[f].ext, sizeof (files[f].ext),
+					"%s", ext);
+				files[f].fd = open (fname, O_WRONLY | O_CREAT | O_TRUNC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+				if (files[f].fd == -1)
+					perror ("Could not open the file");
+				else
+					nfiles++;
+			}
+			if (f == nfiles ||
+				pwrite (files[f].fd, data, len, offset) != (ssize_t)len)
+			{
+				perror ("Could not write to file");
+				zstr_free (&ext);
+				free (data);
+				break;
+			}
+			received += len;
+
+			/* Give credit for one more batch. */
+			zsock_send (sock, TES_STREAM_CREDIT_PIC, (uint32_t)1);
+			zstr_free (&ext);
+			free (data);
+			continue;
+		}
+
+		/* Last message, data are the stats. */
+		if (len >= 7 * sizeof (uint64_t))
+		{
+			uint64_t* stats = (uint64_t*)data;
+			int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (fd == -1 || write (fd, data, len) != (ssize_t)len)
+				perror ("Could not write the stats");
+			if (fd != -1)
+				close (fd);
+
+			printf ("\nReceived %lu bytes\n"
+				"Ticks:                  %lu\n"
+				"Events:                 %lu\n"
+				"Traces:                 %lu\n"
+				"Histograms:             %lu\n"
+				"Frames:                 %lu\n"
+				"Missed frames:          %lu\n"
+				"Dropped frames:         %lu\n",
+				received, stats[0], stats[1], stats[2], stats[3],
+				stats[4], stats[5], stats[6]);
+		}
+		zstr_free (&ext);
+		free (data);
+		break;
+	}
+
+	for (int f = 0; f < nfiles; f++)
+		close (files[f].fd);
+	zsock_destroy (&sock);
+	return rc;
+}
+
 int
 main (int argc, char* argv[])
 {
@@ -879,7 +2050,9 @@ main (int argc, char* argv[])
 			printf ("Processing option at index %d\n", optind);
 #endif
 		int opt = getopt (argc, argv,
-			"+:h" OPTS_G OPTS_S_INFO OPTS_J_CONF OPTS_L_TRACE OPTS_L_HIST OPTS_R_ALL);
+			"+:h" OPTS_G OPTS_S_INFO OPTS_J_CONF OPTS_L_TRACE OPTS_L_HIST OPTS_R_ALL
+			OPTS_C_STAT OPTS_R_STRM OPTS_H_CONF OPTS_M_CONF OPTS_N_CONF
+			OPTS_A_CONF);
 		if (opt == -1)
 		{
 #ifdef GETOPT_DEBUG
@@ -946,11 +2119,45 @@ main (int argc, char* argv[])
 		defport = TES_JITTER_REP_LPORT;
 		require_filename = 0;
 	}
+	else if (strcmp (cmd, "mca_sum_conf") == 0)
+	{
+		callback = s_hist_conf;
+		defport = TES_HIST_ACC_REP_LPORT;
+		require_filename = 0;
+	}
+	else if (strcmp (cmd, "smca_conf") == 0)
+	{
+		callback = s_smca_conf;
+		defport = TES_SMCA_REP_LPORT;
+		require_filename = 0;
+	}
+	else if (strcmp (cmd, "coinc_conf") == 0)
+	{
+		callback = s_coinc_conf;
+		defport = TES_COINC_REP_LPORT;
+		require_filename = 0;
+	}
+	else if (strcmp (cmd, "sgltr_conf") == 0)
+	{
+		callback = s_sgltr_conf;
+		defport = TES_SGLTR_REP_LPORT;
+		require_filename = 0;
+	}
 	else if (strcmp (cmd, "remote_all") == 0)
 	{
 		callback = s_remote_save_all;
 		defport = TES_CAP_LPORT;
 	}
+	else if (strcmp (cmd, "conv_status") == 0)
+	{
+		callback = s_conv_status;
+		defport = TES_CONV_LPORT;
+	}
+	else if (strcmp (cmd, "remote_stream") == 0)
+	{
+		callback = s_remote_stream;
+		defport = TES_STREAM_LPORT;
+	}
 	else if (strcmp (cmd, "local_trace") == 0)
 	{
 		callback = s_local_save_trace;
@@ -961,11 +2168,41 @@ main (int argc, char* argv[])
 		callback = s_local_save_mca;
 		defport = TES_HIST_LPORT;
 	}
+	else if (strcmp (cmd, "local_mca_sum") == 0)
+	{
+		callback = s_local_save_mca_sum;
+		defport = TES_HIST_LPORT;
+	}
+	else if (strcmp (cmd, "local_mca_sparse") == 0)
+	{
+		callback = s_local_save_mca_sparse;
+		defport = TES_HIST_LPORT;
+	}
+	else if (strcmp (cmd, "local_mca_delta") == 0)
+	{
+		callback = s_local_save_mca_delta;
+		defport = TES_HIST_LPORT;
+	}
+	else if (strcmp (cmd, "local_smca") == 0)
+	{
+		callback = s_local_save_smca;
+		defport = TES_SMCA_PUB_LPORT;
+	}
 	else if (strcmp (cmd, "local_jitter") == 0)
 	{
 		callback = s_local_save_jitter;
 		defport = TES_JITTER_PUB_LPORT;
 	}
+	else if (strcmp (cmd, "local_coinc") == 0)
+	{
+		callback = s_local_save_coinc;
+		defport = TES_COINC_PUB_LPORT;
+	}
+	else if (strcmp (cmd, "local_sgltr") == 0)
+	{
+		callback = s_local_save_sgltr;
+		defport = TES_SGLTR_PUB_LPORT;
+	}
 	else
 	{
 		printf ("Unknown command %s\n", cmd);
@@ -1,43 +1,107 @@
 #include "tesd_tasks.h"
 
+/* Clients waiting for a fresh trace at the same time. */
+#define MAX_CLIENTS 32
+
+/*
+ * A client waiting for a fresh trace.
+ */
+struct s_client_t
+{
+	task_t*   self;
+	zframe_t* id;        // identity, NULL if the slot is free
+	bool      delimited; // sent an empty delimiter (e.g. REQ)
+	int       timer;     // returned by zloop_timer
+};
+
 /*
  * Data for currently built average trace.
  */
 struct s_data_t
 {
-	int           timer;     // returned by zloop_timer
 	uint16_t      size;      // size of histogram including header
 	uint16_t      cur_size;  // number of received bytes so far
 	bool          recording; // discard all frames until next header
+	uint16_t      nclients;  // number of waiting clients
+	struct s_client_t clients[MAX_CLIENTS];
+	uint16_t      last_size; // size of last, 0 if none yet
+	int64_t       last_time; // zclock_mono when last was completed
 	unsigned char buf[TES_AVGTR_MAXSIZE];
+	unsigned char last[TES_AVGTR_MAXSIZE]; // last complete trace
 };
 
 static zloop_timer_fn  s_timeout_hn;
+static void s_reply (task_t* self, struct s_client_t* client,
+	uint8_t rep);
 
 /* -------------------------------------------------------------- */
 /* --------------------------- HELPERS -------------------------- */
 /* -------------------------------------------------------------- */
 
 /*
- * Deactivates the task, enables polling on the client frontend, sends
- * timeout error to the client.
+ * Sends a reply to a client, with the last trace if rep is
+ * TES_AVGTR_REQ_OK, and frees its slot. Does not cancel its timer.
+ */
+static void
+s_reply (task_t* self, struct s_client_t* client, uint8_t rep)
+{
+	dbg_assert (self != NULL);
+	dbg_assert (client != NULL);
+	dbg_assert (client->id != NULL);
+
+	struct s_data_t* trace = (struct s_data_t*) self->data;
+	uint32_t age = 0;
+	const void* data = "";
+	size_t size = 0;
+	if (rep == TES_AVGTR_REQ_OK)
+	{
+		dbg_assert (trace->last_size > 0);
+		age = zclock_mono () - trace->last_time;
+		data = trace->last;
+		size = trace->last_size;
+	}
+
+	/* Clients may be REQ, which want the delimiter back. */
+	zsock_send (self->frontends[0].sock,
+		client->delimited ? "fz" TES_AVGTR_REP_PIC :
+		"f" TES_AVGTR_REP_PIC,
+		client->id, rep, age, data, size);
+
+	zframe_destroy (&client->id);
+	if (client->timer != -1)
+	{
+		dbg_assert (trace->nclients > 0);
+		trace->nclients--;
+		client->timer = -1;
+	}
+}
+
+/*
+ * Sends timeout error to the client. Deactivates the task, if no more
+ * clients are waiting.
  */
 static int
-s_timeout_hn (zloop_t* loop, int timer_id, void* self_)
+s_timeout_hn (zloop_t* loop, int timer_id, void* client_)
 {
-	dbg_assert (self_ != NULL);
+	dbg_assert (client_ != NULL);
 
-	task_t* self = (task_t*) self_;
+	struct s_client_t* client = (struct s_client_t*) client_;
+	task_t* self = client->self;
+	struct s_data_t* trace = (struct s_data_t*) self->data;
 
-	/* Enable polling on the frontend and deactivate packet
-	 * handler. */
-	task_deactivate (self);
-	
 	/* Send a timeout error to the client. */
 	logmsg (0, LOG_INFO,
 		"Average trace timed out");
-	zsock_send (self->frontends[0].sock, TES_AVGTR_REP_PIC,
-		TES_AVGTR_REQ_ETOUT, "", 0);
+	s_reply (self, client, TES_AVGTR_REQ_ETOUT);
+
+	if (trace->nclients == 0)
+	{
+		/* Deactivate packet handler. */
+		trace->recording = 0;
+		trace->cur_size = 0;
+		trace->size = 0;
+		task_deactivate (self);
+	}
 
 	return 0;
 }
@@ -46,29 +110,89 @@ s_timeout_hn (zloop_t* loop, int timer_id, void* self_)
 /* ----------------------------- API ---------------------------- */
 /* -------------------------------------------------------------- */
 
+/*
+ * Replies at once from the last trace if it is no older than the
+ * requested maximum age, otherwise waits for the next one.
+ */
 int
 task_avgtr_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 {
 	dbg_assert (self_ != NULL);
 
 	task_t* self = (task_t*) self_;
+	struct s_data_t* trace = (struct s_data_t*) self->data;
 
-	uint32_t timeout;    
-
-	int rc = zsock_recv (frontend, TES_AVGTR_REQ_PIC, &timeout);
-	/* Would also return -1 if picture contained a pointer (p) or a null
-	 * frame (z) but message received did not match this signature; this
-	 * is irrelevant in this case; we don't get interrupted, this should
-	 * not happen. */
+	zframe_t* id = NULL;
+	zmsg_t* msg = NULL;
+	int rc = zsock_recv (frontend, "fm", &id, &msg);
+	/* We don't get interrupted, this should not happen. */
 	assert (rc != -1);
 
+	struct s_client_t client = {
+		.self = self,
+		.id = id,
+		.timer = -1,
+	};
+
+	/* Frames are timeout and max age, see TES_AVGTR_REQ_PIC. */
+	zframe_t* frame = zmsg_first (msg);
+	if (frame != NULL && zframe_size (frame) == 0)
+	{ /* delimiter */
+		client.delimited = 1;
+		frame = zmsg_next (msg);
+	}
+	/* Numbers are sent as binary, max age is optional. */
+	uint32_t req[2] = {0};
+	bool valid = (frame != NULL);
+	for (int f = 0; f < 2 && frame != NULL; f++)
+	{
+		if (zframe_size (frame) != sizeof (req[f]))
+		{
+			valid = 0;
+			break;
+		}
+		memcpy (&req[f], zframe_data (frame), sizeof (req[f]));
+		frame = zmsg_next (msg);
+	}
+	if (frame != NULL)
+		valid = 0; /* extra frames */
+	zmsg_destroy (&msg);
+	uint32_t timeout = req[0];
+	uint32_t max_age = req[1];
+
 	/* Check timeout. */
-	if (timeout == 0)
+	if ( ! valid || timeout == 0 )
 	{
 		logmsg (0, LOG_INFO,
 			"Received a malformed request");
-		zsock_send (frontend, TES_AVGTR_REP_PIC,
-			TES_AVGTR_REQ_EINV, "", 0);
+		s_reply (self, &client, TES_AVGTR_REQ_EINV);
+		return 0;
+	}
+
+	if (max_age > 0 && trace->last_size > 0 &&
+		zclock_mono () - trace->last_time <= max_age)
+	{
+		logmsg (0, LOG_INFO,
+			"Sending the last average trace");
+		s_reply (self, &client, TES_AVGTR_REQ_OK);
+		return 0;
+	}
+
+	/* Find a free slot. */
+	struct s_client_t* slot = NULL;
+	for (int c = 0; c < MAX_CLIENTS; c++)
+	{
+		if (trace->clients[c].id == NULL)
+		{
+			slot = &trace->clients[c];
+			break;
+		}
+	}
+	if (slot == NULL)
+	{
+		logmsg (0, LOG_INFO,
+			"Too many clients waiting for a trace");
+		s_reply (self, &client, TES_AVGTR_REQ_EBUSY);
 		return 0;
 	}
 
@@ -77,29 +201,33 @@ task_avgtr_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 		timeout);
 
 	/* Register a timer */
-	int tid = zloop_timer (loop, 1000 * timeout, 1, s_timeout_hn, self);
+	*slot = client;
+	int tid = zloop_timer (loop, 1000 * timeout, 1, s_timeout_hn, slot);
 	if (tid == -1)
 	{
 		logmsg (errno, LOG_ERR,
 			"Could not set a timer");
+		zframe_destroy (&slot->id);
 		return TASK_ERROR;
 	}
-	struct s_data_t* trace = (struct s_data_t*) self->data;
-	dbg_assert ( ! trace->recording );
-	trace->timer = tid;
+	slot->timer = tid;
+	trace->nclients++;
 
-	/* Disable polling on the frontend until the job is done. Wakeup
-	 * packet handler. */
-	task_activate (self);
+	/* Wakeup packet handler, unless already waiting for a trace. */
+	if ( ! self->active )
+	{
+		dbg_assert ( ! trace->recording );
+		task_activate (self);
+	}
 
 	return 0;
 }
 
 /*
  * Accumulates average trace frames. As soon as a complete trace is
- * recorded, it is sent to the client, polling on the client frontend
- * is re-enabled and the timer is canceled. It aborts the whole
- * trace if a relevant frame is lost, and waits for the next one.
+ * recorded, it is kept as the last one and sent to all waiting
+ * clients, and their timers are canceled. It aborts the whole trace
+ * if a relevant frame is lost, and tells the clients.
  */
 int
 task_avgtr_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
@@ -132,7 +260,7 @@ task_avgtr_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		rep = TES_AVGTR_REQ_EERR;
 		goto done;
 	}
-	
+
 	/* Check protocol sequence for subsequent frames. */
 	if (trace->cur_size > 0)
 	{
@@ -165,35 +293,40 @@ task_avgtr_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	return 0;
 
 done:
-	/* Cancel the timer. */
-	zloop_timer_end (loop, trace->timer);
-
-	/* Send the trace. */
 	switch (rep)
 	{
 		case TES_AVGTR_REQ_EERR:
 			logmsg (0, LOG_INFO,
 				"Discarded average trace");
-			zsock_send (self->frontends[0].sock, TES_AVGTR_REP_PIC,
-				TES_AVGTR_REQ_EERR, "", 0);
 			break;
 		case TES_AVGTR_REQ_OK:
 			logmsg (0, LOG_INFO,
 				"Average trace complete");
-			zsock_send (self->frontends[0].sock, TES_AVGTR_REP_PIC,
-				TES_AVGTR_REQ_OK, &trace->buf, trace->size);
+			memcpy (trace->last, trace->buf, trace->size);
+			trace->last_size = trace->size;
+			trace->last_time = zclock_mono ();
 			break;
 		default:
 			assert (0);
 	}
 
+	/* Send the trace and cancel the timers. */
+	for (int c = 0; c < MAX_CLIENTS; c++)
+	{
+		struct s_client_t* client = &trace->clients[c];
+		if (client->id == NULL)
+			continue;
+		zloop_timer_end (loop, client->timer);
+		s_reply (self, client, rep);
+	}
+	dbg_assert (trace->nclients == 0);
+
 	/* Reset stats. */
 	trace->recording = 0;
 	trace->cur_size = 0;
 	trace->size = 0;
 
-	/* Enable polling on the frontend and deactivate packet
-	 * handler. */
+	/* Deactivate packet handler. */
 	return TASK_SLEEP;
 }
 
@@ -201,9 +334,13 @@ int
 task_avgtr_init (task_t* self)
 {
 	assert (self != NULL);
+	assert (self->frontends[0].type == ZMQ_ROUTER);
 
 	static struct s_data_t trace;
 
+	for (int c = 0; c < MAX_CLIENTS; c++)
+		trace.clients[c].timer = -1;
+
 	self->data = &trace;
 	return 0;
 }
@@ -212,6 +349,10 @@ int
 task_avgtr_fin (task_t* self)
 {
 	assert (self != NULL);
+	struct s_data_t* trace = (struct s_data_t*) self->data;
+
+	for (int c = 0; c < MAX_CLIENTS; c++)
+		zframe_destroy (&trace->clients[c].id);
 
 	self->data = NULL;
 	return 0;
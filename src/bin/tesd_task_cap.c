@@ -13,28 +13,71 @@
 #include "tesd_tasks.h"
 #include <aio.h>
 #include "hdf5conv.h"
+#include "tescap.h"
 
 #define FIDX_LEN 16 // frame index
-#define TIDX_LEN  8 // tick index
+#define TIDX_LEN TESCAP_TIDX_LEN // tick index, see tescap.h
 #define SIDX_LEN 16 // MCA and trace indices
 #define STAT_LEN 64 // job statistics
+#define SEG_EXT  "segs" // extension of the segment manifest
 #ifndef DATAROOT
 #define DATAROOT "/media/data/captures/" // must have a trailing slash
 #endif
+/* Further roots to stripe the payload files across, as a comma-
+ * separated list of strings, each with a trailing slash. Index and
+ * stats files stay under DATAROOT. A payload file placed on another
+ * root is linked to from DATAROOT, under the same relative path, so
+ * that conversion and readers need not know about it. */
+#ifndef DATAROOTS
+#define DATAROOTS // "/media/data2/captures/", "/media/data3/captures/"
+#endif
 
 #define REQUIRE_FILENAME // for now we don't generate filename
+#define CONV_NWORKERS 2   // conversions running at a time
+#define CONV_QLEN     16  // conversions queued or running at a time
+#define CONV_POLL     200 // in ms, how often to check on a conversion
+                          // a client is waiting for
+#define STREAM_TIMEOUT 5000 // in ms, give up on a streaming client
+                            // which sends no credit
+#define SPARE_FNAME DATAROOT ".spare" // files a continued capture
+                                      // switches to, see s_spare_open
+#define CONT_MAX_TICKS 100000 // give up waiting for the request to
+                              // adopt a continued capture
 // #define SINGLE_FILE      // save all payloads (with
 //                          // headers) to single .dat file
 // #define SAVE_HEADERS     // save headers in .*dat files
 // #define NO_BAD_FRAMES    // drop bad frames
+// #define COMPACT_FIDX     // delta-encode the frame index into
+//                          // .cidx, see tescap.h
 
 /* Employ a buffer zone for asynchronous writing. We memcpy frames
  * into the bufzone, between its head and cursor (see s_data_t below)
  * and queue batches with aio_write.
  * aio_write has significant overhead and is not worth queueing less
- * than ~2kB (it'd be much slower than synchronous write). */
-#define BUFSIZE 10485760UL // 10 MB
+ * than ~2kB (it'd be much slower than synchronous write).
+ * Bufzones are mapped for the duration of a job and BUFZONE_TOTAL is
+ * shared between the files according to their rates in the previous
+ * job. A bufzone which fills up is doubled, up to BUFZONE_MAX, and
+ * keeps that size in later jobs. Sizes are multiples of
+ * BUFZONE_MIN, which must be a multiple of the huge page size. */
+#define BUFZONE_TOTAL 83886080UL  // 80 MB
+#define BUFZONE_MIN   2097152UL   // 2 MB
+#define BUFZONE_MAX   268435456UL // 256 MB
 #define MINSIZE 512000UL   // 500 kB
+// #define BUFZONE_HUGEPAGES // map bufzones with MAP_HUGETLB, falls
+//                           // back to normal pages if none are free
+
+/* Number of batches per file which can be queued with aio_write at
+ * a time. More than one keeps the queue of fast (NVMe) drives busy,
+ * at the cost of one aiocb per batch. */
+#define AIO_DEPTH 4
+
+/* Preallocate the stream and index files in large extents, so that
+ * they don't fragment when growing in parallel. The initial size is
+ * estimated from the rates in the previous job and files are
+ * truncated to their final size when closed. */
+#define PREALLOC_STEP 67108864UL   // 64 MB
+#define PREALLOC_MAX  4294967296UL // 4 GB
 #if DEBUG_LEVEL >= VERBOSE
 #  define STAT_NBINS 11
 #endif
@@ -82,10 +125,12 @@ struct s_stats_t
  * A list of stream and index files.
  */
 #ifdef SINGLE_FILE
-#  define NUM_DSETS 5
+#  define DSET_COL_FIRST 5
 #else
-#  define NUM_DSETS 8
+#  define DSET_COL_FIRST 8
 #endif
+#define NUM_COLS 7 // decoded event fields, see s_cols_t
+#define NUM_DSETS (DSET_COL_FIRST + NUM_COLS)
 static struct s_dset_t
 {
 	char* dataset;   // name of dataset inside hdf5 file
@@ -93,8 +138,13 @@ static struct s_dset_t
 } s_dsets[] = {
 #  define DSET_FIDX 0
 	{ // frame index
+#ifdef COMPACT_FIDX
+		.dataset = "cidx",
+		.extension = "cidx",
+#else
 		.dataset = "fidx",
 		.extension = "fidx",
+#endif
 	},
 #  define DSET_MIDX 1
 	{ // MCA index
@@ -139,26 +189,119 @@ static struct s_dset_t
 		.extension = "edat",
 	},
 #endif
+	/* Decoded events, one column per field, only written if
+	 * requested. */
+#  define DSET_CCHN (DSET_COL_FIRST + 0)
+	{ // channel
+		.dataset = "columns/channel",
+		.extension = "cchn",
+	},
+#  define DSET_CTOF (DSET_COL_FIRST + 1)
+	{ // time offset
+		.dataset = "columns/toff",
+		.extension = "ctof",
+	},
+#  define DSET_CTIM (DSET_COL_FIRST + 2)
+	{ // time since first tick
+		.dataset = "columns/time",
+		.extension = "ctim",
+	},
+#  define DSET_CHGT (DSET_COL_FIRST + 3)
+	{ // peak height
+		.dataset = "columns/height",
+		.extension = "chgt",
+	},
+#  define DSET_CRST (DSET_COL_FIRST + 4)
+	{ // peak rise time
+		.dataset = "columns/rise time",
+		.extension = "crst",
+	},
+#  define DSET_CARE (DSET_COL_FIRST + 5)
+	{ // area
+		.dataset = "columns/area",
+		.extension = "care",
+	},
+#  define DSET_CPLN (DSET_COL_FIRST + 6)
+	{ // pulse length
+		.dataset = "columns/length",
+		.extension = "cpln",
+	},
+};
+
+/* Payload files, and decoded columns, can be placed on any root. */
+#define DSET_STRIPE_FIRST 4
+static const char* s_dataroots[] = { DATAROOT, DATAROOTS };
+#define NUM_ROOTS (sizeof (s_dataroots) / sizeof (s_dataroots[0]))
+
+/*
+ * Decoded fields of the events in one frame. Fields which do not
+ * apply to the event type are 0. Events are at least 8 bytes.
+ */
+#define MAX_FRAME_EVENTS (TESPKT_MTU / 8)
+struct s_cols_t
+{
+	uint64_t time[MAX_FRAME_EVENTS];
+	uint32_t area[MAX_FRAME_EVENTS];
+	uint16_t toff[MAX_FRAME_EVENTS];
+	uint16_t height[MAX_FRAME_EVENTS];
+	uint16_t riset[MAX_FRAME_EVENTS];
+	uint16_t plen[MAX_FRAME_EVENTS];
+	uint8_t  ch[MAX_FRAME_EVENTS];
+};
+
+/*
+ * Entry in the segment manifest.
+ */
+#define SEG_LEN (24 + 8*NUM_DSETS)
+struct s_seg_t
+{
+	uint64_t first_frame; // no. of frames in previous segments
+	uint64_t frames;      // no. of frames in this segment
+	uint64_t ticks;       // no. of ticks in this segment
+	uint64_t sizes[NUM_DSETS]; // size of each stream and index file
+};
+
+/*
+ * A client a capture is streamed to instead of being saved. Batches
+ * from the bufzones are sent as they would be written, one for each
+ * unit of credit the client has given.
+ */
+struct s_stream_t
+{
+	zsock_t*  sock;   // the ROUTER frontend
+	zframe_t* client; // identity of client, NULL if not streaming
+	uint32_t  credit; // no. of batches we can send
+	bool      error;  // client stopped sending credit
 };
 
 /*
  * Data related to a stream or index file, e.g. ticks or MCA frames.
+ * Batches between the tail and head of the bufzone are being
+ * written, each with its own aiocb in a ring of AIO_DEPTH.
  */
 struct s_aiobuf_t
 {
-	struct aiocb aios;
+	struct aiocb aios[AIO_DEPTH];
+	int     fd;       // the open file
+	uint8_t root;     // index into s_dataroots
+	uint8_t first;    // aiocb of the oldest batch in flight
+	uint8_t inflight; // number of batches in flight
 	struct
 	{
-		unsigned char* base; // mmapped, size of BUFSIZE
-		unsigned char* tail; // start address queued for aio_write
+		unsigned char* base; // mmapped, size of len
+		unsigned char* tail; // start of oldest batch in flight
+		unsigned char* head; // start of bytes not yet queued
 		unsigned char* cur;  // address of next packet
-		unsigned char* ceil; // base + BUFSIZE
-		size_t waiting;      // copied to buffer since last aio_write
-		size_t enqueued;     // queued for writing at last aio_write
+		unsigned char* ceil; // base + len
+		size_t len;          // 0 between jobs
+		size_t grown;        // size it last grew to, a lower limit
+		size_t waiting;      // copied to buffer but not queued
+		size_t enqueued;     // queued for writing, not yet written
 #if DEBUG_LEVEL >= VERBOSE
 		struct {
 			size_t prev_enqueued;
 			size_t prev_waiting;
+			size_t last_queued;
 			size_t last_written;
 			uint64_t batches[STAT_NBINS];
 			uint64_t failed_batches;
@@ -167,11 +310,39 @@ struct s_aiobuf_t
 		} st;
 #endif
 	} bufzone;
-	size_t size; // number of bytes written
+	size_t size;  // number of bytes written
+	size_t alloc; // number of bytes preallocated
+	bool   noalloc; // preallocation is not supported
+	struct
+	{
+		double tick;  // bytes per tick in previous job
+		double event; // bytes per event in previous job
+	} rate;
 	char   filename[PATH_MAX]; // name data/index file
 	char*  dataset;            // name of dataset inside hdf5 file
 	                           // points to one of the literal
 	                           // strings in s_dsets
+	char*  extension;          // file extension, as above
+	struct s_stream_t* stream; // sent to client instead of file
+	int    crcfd;              // checksums of batches, see tescap.h
+	int    spare_fd;           // for a continued capture
+	int    spare_crcfd;        // as above
+	struct
+	{ /* next segment's file, opened ahead by s_seg_prep */
+		int    fd;
+		int    crcfd;
+		size_t alloc;
+		bool   noalloc;
+		char   filename[PATH_MAX];
+	} next;
+	struct
+	{ /* previous segment's file, until its bytes are written */
+		int    fd;
+		int    crcfd;
+		size_t end;     // its final size
+		size_t waiting; // its bytes not yet queued
+		size_t pending; // its bytes not yet written
+	} prev;
 };
 
 /*
@@ -187,15 +358,6 @@ struct s_fidx_t
 	struct s_ftype_t ftype; // see definition of struct
 };
 
-/*
- * The tick index.
- */
-struct s_tidx_t
-{
-	uint32_t start_frame; // frame number of first non-tick event
-	uint32_t stop_frame;  // frame number of last non-tick event
-};
-
 /*
  * The MCA and trace indices. (the 's' is for 'stream')
  */
@@ -213,6 +375,7 @@ struct s_data_t
 {
 	struct s_stats_t st;
 	struct s_aiobuf_t aio[NUM_DSETS];
+	struct s_stream_t stream;
 
 	struct
 	{ /* keep track of multi-frame streams */
@@ -225,12 +388,30 @@ struct s_data_t
 
 	struct
 	{
-		struct s_tidx_t idx;
+		struct tescap_tidx idx;
 		uint32_t nframes;  // no. of event frames in this tick
 	} cur_tick;
+
+	struct
+	{ /* keep track of segments, if splitting the capture */
+		struct s_seg_t idx;
+		uint32_t num;      // segment number
+		uint64_t first_event; // no. of events in previous segments
+	} cur_seg;
+	struct s_cols_t cols; // decoded events in current frame
+	uint64_t evt_time;   // sum of time offsets since first tick
 	uint8_t  prev_esize; // event size for previous event
 	uint8_t  prev_etype; // event type for previous event,
 	                     // see s_ftype_t
+#ifdef COMPACT_FIDX
+	struct
+	{ /* encoder state for the frame index, reset for each segment */
+		struct s_fidx_t prev; // last frame written out
+		uint64_t next[TESCAP_NDATS]; // predicted start in each file
+		uint32_t run;         // repeats of prev not yet written out
+		bool     started;     // prev is set
+	} cidx;
+#endif
 
 	struct
 	{ /* given by client */
@@ -239,6 +420,16 @@ struct s_data_t
 		uint8_t  ovrwtmode;   // TES_H5_OVRT_*, see hdf5conv.h
 		uint8_t  async;       // copy data to hdf5 in the background
 		uint8_t  capmode;     // only convert a previous capture
+		uint8_t  h5mode;      // copy or link to data files
+		uint64_t seg_ticks;   // start new segment after that
+		                      // many ticks
+		uint64_t seg_size;    // start new segment after that
+		                      // many bytes
+		uint8_t  columns;     // decode events into columns
+		uint8_t  cont;        // continue into spare files at
+		                      // the last tick
+		uint64_t start_ts;    // start at the first tick with at
+		                      // least this timestamp
 		char*    basefname;   // datafiles will be
 		                      // <basefname>-<measurement>.*
 		char*    measurement; // hdf5 group
@@ -247,16 +438,27 @@ struct s_data_t
 	bool     nocapture;   // request is for status or conversion
 	bool     noconvert;   // request is for status or capture only
 	bool     nooverwrite; // overwrite data files
+	bool     segmented;   // split capture into segments
 
 	char     hdf5filename[PATH_MAX]; // full path of hdf5 file
 	char     statfilename[PATH_MAX]; // full path of stats file
+	char     segfilename[PATH_MAX];  // full path of manifest
 	int      statfd;      // fd for the statis file
+	int      segfd;       // fd for the segment manifest
+	bool     seg_ready;   // next segment's files are open
+	mode_t   fmode;       // mode the data files were opened with
+	uint64_t root_bytes[NUM_ROOTS]; // expected bytes on each root
+	uint32_t conv_id;     // conversion the client is waiting for
+	int      conv_timer;  // checks on conv_id
 	bool     recording;   // wait for a tick before starting capture
+	bool     continuing;  // capturing into the spare files until
+	                      // a request adopts them
 };
 
 /* Task initializer and finalizer. */
-static int   s_init_aiobuf (struct s_aiobuf_t* aiobuf);
+static void  s_init_aiobuf (struct s_aiobuf_t* aiobuf);
 static void  s_fin_aiobuf (struct s_aiobuf_t* aiobuf);
+static int   s_map_bufzone (struct s_aiobuf_t* aiobuf, size_t len);
 
 /*
  * s_open and s_close deal with stream and index files only. stats_*
@@ -266,17 +468,56 @@ static void  s_fin_aiobuf (struct s_aiobuf_t* aiobuf);
 /* Job initializer and finalizer. */
 static int  s_is_req_valid (struct s_data_t* sjob);
 static int  s_task_construct_filenames (struct s_data_t* sjob);
+static int  s_construct_dset_filename (char* buf,
+	const char* statfilename, long seg, const char* ext);
 static int  s_open (struct s_data_t* sjob, mode_t fmode);
+static bool s_dset_enabled (struct s_data_t* sjob, int s);
 static void s_close (struct s_data_t* sjob);
+static int  s_map_bufzones (struct s_data_t* sjob);
+static void s_unmap_bufzones (struct s_data_t* sjob);
+static void s_stripe (struct s_data_t* sjob);
 static int  s_open_aiobuf (struct s_aiobuf_t* aiobuf, mode_t fmode);
+static int  s_open_dset (const char* filename, uint8_t root,
+	mode_t fmode, int* fd, int* crcfd);
+static int  s_open_crc (const char* filename, mode_t fmode,
+	int* fd, int* crcfd);
+static int  s_rename_dset (const char* from, const char* to);
+static int  s_unlink_dset (const char* filename);
+static int  s_mkdirs (const char* path, size_t skip);
 static void s_close_aiobuf (struct s_aiobuf_t* aiobuf);
+static void s_close_prev (struct s_aiobuf_t* aiobuf);
 static int  s_conv_data (struct s_data_t* sjob);
+static int  s_conv_segments (struct s_data_t* sjob, long nsegs);
+static bool s_conv_wait (task_t* self);
+static zloop_timer_fn s_conv_timer_hn;
+static int  s_conv_lookup (const char* basefname,
+	const char* measurement, struct hdf5_conv_stat_t* st);
 static void s_send_err (struct s_data_t* sjob,
 	zsock_t* frontend, uint8_t status);
 
+/* Segment manifest for a job. */
+static int  s_seg_open (struct s_data_t* sjob);
+static void s_seg_close (struct s_data_t* sjob, uint64_t frames);
+static int  s_seg_next (struct s_data_t* sjob);
+static int  s_seg_prep (struct s_data_t* sjob);
+static void s_seg_unprep (struct s_data_t* sjob);
+static long s_seg_count (struct s_data_t* sjob);
+static bool s_seg_full (struct s_data_t* sjob);
+
+/* Continued captures. */
+static void s_spare_filename (char* filename, int s);
+static int  s_spare_open (struct s_data_t* sjob);
+static void s_spare_close (struct s_data_t* sjob);
+static void s_cont_start (task_t* self);
+static void s_cont_stop (task_t* self);
+static int  s_cont_adopt (struct s_data_t* sjob);
+static void s_cont_rollback (struct s_data_t* sjob, int n);
+static void s_cont_resume (struct s_data_t* sjob, uint8_t columns);
+
 /* Statistics for a job. */
 static int s_stats_read (struct s_data_t* sjob);
 static int s_stats_write (struct s_data_t* sjob);
+static void s_stats_reset (struct s_data_t* sjob);
 static int s_stats_send (struct s_data_t* sjob,
 	zsock_t* frontend, uint8_t status);
 
@@ -285,6 +526,26 @@ static void  s_flush (struct s_data_t* sjob);
 static int   s_try_queue_aiobuf (struct s_aiobuf_t* aiobuf,
 	const char* buf, uint16_t len);
 static int   s_queue_aiobuf (struct s_aiobuf_t* aiobuf, bool force);
+static int   s_crc_aiobuf (struct s_aiobuf_t* aiobuf, int crcfd,
+	size_t offset, const unsigned char* buf, size_t len);
+#ifdef COMPACT_FIDX
+static int   s_cidx_queue (struct s_data_t* sjob,
+	const struct s_fidx_t* fidx);
+static int   s_cidx_flush (struct s_data_t* sjob);
+#endif
+static int   s_send_aiobuf (struct s_aiobuf_t* aiobuf, bool force);
+static int   s_pop_uint (zmsg_t* msg, void* val, size_t size);
+static int   s_stream_credit (struct s_stream_t* stream, int timeout);
+static void  s_stream_end (struct s_data_t* sjob, uint8_t status);
+static void  s_prealloc_aiobuf (struct s_aiobuf_t* aiobuf,
+	size_t len);
+static int   s_fallocate (int fd, size_t offset, size_t len);
+static size_t s_prealloc_estimate (struct s_data_t* sjob,
+	struct s_aiobuf_t* aiobuf);
+static void  s_update_rates (struct s_data_t* sjob);
+static int   s_decode_events (struct s_data_t* sjob, tespkt* pkt,
+	bool is_tick);
+static void  s_tidx_start (struct s_data_t* sjob, tespkt* pkt);
 static char* s_canonicalize_path (const char* filename,
 	char* finalpath, bool mustexist);
 
@@ -297,31 +558,28 @@ static void  s_dbg_stats (struct s_data_t* sjob);
 /* -------------------------------------------------------------- */
 
 /*
- * mmap data for a stream or index file.
- * Returns 0 on success, -1 on error.
+ * Initialize a stream or index file. The bufzone is mapped when a
+ * job starts.
  */
-static int
+static void
 s_init_aiobuf (struct s_aiobuf_t* aiobuf)
 {
 	assert (aiobuf != NULL);
 
-	aiobuf->aios.aio_sigevent.sigev_notify = SIGEV_NONE;
-	aiobuf->aios.aio_fildes = -1;
-
-	void* buf = mmap (NULL, BUFSIZE, PROT_WRITE,
-		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (buf == (void*)-1)
-		return -1;
-
-	aiobuf->bufzone.base = aiobuf->bufzone.tail =
-		aiobuf->bufzone.cur = (unsigned char*) buf;
-	aiobuf->bufzone.ceil = aiobuf->bufzone.base + BUFSIZE;
-
-	return 0;
+	for (int a = 0; a < AIO_DEPTH; a++)
+		aiobuf->aios[a].aio_sigevent.sigev_notify = SIGEV_NONE;
+	aiobuf->fd = -1;
+	aiobuf->crcfd = -1;
+	aiobuf->spare_fd = -1;
+	aiobuf->spare_crcfd = -1;
+	aiobuf->next.fd = -1;
+	aiobuf->next.crcfd = -1;
+	aiobuf->prev.fd = -1;
+	aiobuf->prev.crcfd = -1;
 }
 
 /*
- * munmap data for a stream or index file.
+ * munmap the bufzone of a stream or index file.
  */
 static void
 s_fin_aiobuf (struct s_aiobuf_t* aiobuf)
@@ -331,9 +589,56 @@ s_fin_aiobuf (struct s_aiobuf_t* aiobuf)
 	/* Unmap bufzone */
 	if (aiobuf->bufzone.base != NULL)
 	{
-		munmap (aiobuf->bufzone.base, BUFSIZE);
-		aiobuf->bufzone.base = NULL;
+		munmap (aiobuf->bufzone.base, aiobuf->bufzone.len);
+		aiobuf->bufzone.base = aiobuf->bufzone.tail =
+			aiobuf->bufzone.head = aiobuf->bufzone.cur =
+			aiobuf->bufzone.ceil = NULL;
+		aiobuf->bufzone.len = 0;
+	}
+}
+
+/*
+ * (Re)maps the bufzone of a stream or index file with len bytes,
+ * prefaulted. It must be empty. If it cannot be mapped, the old
+ * one is kept.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_map_bufzone (struct s_aiobuf_t* aiobuf, size_t len)
+{
+	assert (aiobuf != NULL);
+	dbg_assert (len % BUFZONE_MIN == 0);
+	dbg_assert (aiobuf->bufzone.waiting == 0);
+	dbg_assert (aiobuf->bufzone.enqueued == 0);
+
+	if (aiobuf->bufzone.len == len)
+		return 0;
+
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	void* buf = (void*)-1;
+#if defined (BUFZONE_HUGEPAGES) && defined (MAP_HUGETLB)
+	buf = mmap (NULL, len, PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+#endif
+	if (buf == (void*)-1)
+		buf = mmap (NULL, len, PROT_WRITE, flags, -1, 0);
+	if (buf == (void*)-1)
+	{
+		logmsg (errno, LOG_ERR, "Cannot mmap %lu bytes for %s",
+			len, aiobuf->dataset);
+		return -1;
 	}
+
+	s_fin_aiobuf (aiobuf);
+	aiobuf->bufzone.base = aiobuf->bufzone.tail =
+		aiobuf->bufzone.head = aiobuf->bufzone.cur =
+		(unsigned char*) buf;
+	aiobuf->bufzone.ceil = aiobuf->bufzone.base + len;
+	aiobuf->bufzone.len = len;
+
+	return 0;
 }
 
 /*
@@ -385,6 +690,16 @@ s_is_req_valid (struct s_data_t* sjob)
 			return TES_CAP_REQ_EINV;
 	}
 
+	switch (sjob->h5mode)
+	{
+		case TES_H5_COPY:
+		case TES_H5_EXTERNAL:
+			break;
+		default:
+			logmsg (0, LOG_ERR, "Invalid conversion mode");
+			return TES_CAP_REQ_EINV;
+	}
+
 	/* Does it require capture? */
 	/* if min events was given, min ticks default to 1 */
 	if (sjob->min_events != 0 && sjob->min_ticks == 0)
@@ -407,6 +722,17 @@ s_is_req_valid (struct s_data_t* sjob)
 	/* Should we overwrite data files. */
 	sjob->nooverwrite = (sjob->ovrwtmode == TES_H5_OVRWT_NONE);
 
+	/* Should we split the capture. */
+	sjob->segmented = ( ! sjob->nocapture &&
+		(sjob->seg_ticks > 0 || sjob->seg_size > 0) );
+
+	/* A continued capture is replied to at its last tick, so it
+	 * cannot wait for the conversion. */
+	if (sjob->nocapture)
+		sjob->cont = 0;
+	if (sjob->cont)
+		sjob->async = 1;
+
 	return TES_CAP_REQ_OK;
 }
 
@@ -468,26 +794,58 @@ s_task_construct_filenames (struct s_data_t* sjob)
 		return TES_CAP_REQ_EPERM;
 	}
 
+	/* Segment manifest. */
+	rc = s_construct_dset_filename (sjob->segfilename,
+		sjob->statfilename, -1, SEG_EXT);
+	if (rc == -1)
+		return TES_CAP_REQ_EFAIL;
+
 	/* Index and data files. */
 	for (int s = 0; s < NUM_DSETS ; s++)
 	{
 		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
 		aiobuf->dataset = s_dsets[s].dataset;
 
-		rc = snprintf (aiobuf->filename, PATH_MAX, "%s.%s",
-			sjob->statfilename,
+		rc = s_construct_dset_filename (aiobuf->filename,
+			sjob->statfilename, (sjob->segmented ? 0 : -1),
 			s_dsets[s].extension);
-		if (rc == -1 || (size_t)rc >= PATH_MAX)
-		{
-			logmsg (rc == -1 ? errno : 0, LOG_ERR,
-				"Cannot construct filename for dataset");
+		if (rc == -1)
 			return TES_CAP_REQ_EFAIL;
-		}
 	}
   
 	return TES_CAP_REQ_OK;
 }
 
+/*
+ * Construct the filename of a stream or index file in segment seg.
+ * If seg < 0, the capture is not split into segments. buf must be
+ * able to hold PATH_MAX characters.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_construct_dset_filename (char* buf, const char* statfilename,
+	long seg, const char* ext)
+{
+	assert (buf != NULL);
+	assert (statfilename != NULL);
+	assert (ext != NULL);
+
+	int rc;
+	if (seg < 0)
+		rc = snprintf (buf, PATH_MAX, "%s.%s",
+			statfilename, ext);
+	else
+		rc = snprintf (buf, PATH_MAX, "%s.%04ld.%s",
+			statfilename, seg, ext);
+	if (rc == -1 || (size_t)rc >= PATH_MAX)
+	{
+		logmsg (rc == -1 ? errno : 0, LOG_ERR,
+			"Cannot construct filename for dataset");
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Opens the stream and index files.
  * It does not close any successfully opened files are closed if an
@@ -512,11 +870,31 @@ s_open (struct s_data_t* sjob, mode_t fmode)
 	dbg_assert (sjob->cur_stream.cur_size == 0);
 	dbg_assert (sjob->cur_tick.nframes == 0);
 
+	int rc = s_map_bufzones (sjob);
+	if (rc != TES_CAP_REQ_OK)
+		return rc;
+
 	/* Open the data files. */
+	memset (sjob->root_bytes, 0, sizeof (sjob->root_bytes));
+	s_stripe (sjob);
 	for (int s = 0; s < NUM_DSETS ; s++)
 	{
 		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
-		int rc = s_open_aiobuf (aiobuf, fmode);
+		if ( ! s_dset_enabled (sjob, s) )
+		{ /* delete stale files from a previous capture */
+			if ( ! (fmode & O_EXCL) &&
+				s_unlink_dset (aiobuf->filename) == -1 )
+			{
+				logmsg (errno, LOG_ERR, "Could not delete '%s'",
+					aiobuf->filename);
+				return TES_CAP_REQ_EFAIL;
+			}
+			continue;
+		}
+		rc = s_open_aiobuf (aiobuf, fmode);
+		if (rc == 0)
+			s_prealloc_aiobuf (aiobuf,
+				s_prealloc_estimate (sjob, aiobuf));
 		if (rc == -1)
 		{
 			if (sjob->nooverwrite)
@@ -537,7 +915,18 @@ s_open (struct s_data_t* sjob, mode_t fmode)
 }
 
 /*
- * Closes the stream and index files.
+ * Returns true if stream or index file s is written during the
+ * capture.
+ */
+static bool
+s_dset_enabled (struct s_data_t* sjob, int s)
+{
+	return (s < DSET_COL_FIRST || sjob->columns);
+}
+
+/*
+ * Closes the stream and index files, and deletes the next segment's
+ * if they were opened ahead.
  */
 static void
 s_close (struct s_data_t* sjob)
@@ -547,6 +936,73 @@ s_close (struct s_data_t* sjob)
 	/* Close the data files. */
 	for (int s = 0; s < NUM_DSETS ; s++)
 		s_close_aiobuf (&sjob->aio[s]);
+	s_seg_unprep (sjob);
+}
+
+/*
+ * Maps the bufzones of the files written during the job. Each gets
+ * its share of BUFZONE_TOTAL by its rate in the previous job, or an
+ * equal share if there was none, but no less than it had to grow to
+ * before.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_map_bufzones (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	double rates = 0;
+	int num_dsets = 0;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		if (s_dset_enabled (sjob, s))
+		{
+			rates += sjob->aio[s].rate.tick;
+			num_dsets++;
+		}
+	}
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		if ( ! s_dset_enabled (sjob, s) )
+		{
+			s_fin_aiobuf (aiobuf);
+			continue;
+		}
+
+		double share = ( (rates > 0) ?
+			aiobuf->rate.tick / rates : 1.0 / num_dsets );
+		size_t len = (size_t)(share * BUFZONE_TOTAL);
+		if (len < aiobuf->bufzone.grown)
+			len = aiobuf->bufzone.grown;
+		len = (len + BUFZONE_MIN - 1) / BUFZONE_MIN * BUFZONE_MIN;
+		if (len < BUFZONE_MIN)
+			len = BUFZONE_MIN;
+		if (len > BUFZONE_MAX)
+			len = BUFZONE_MAX;
+
+		if (s_map_bufzone (aiobuf, len) == -1)
+		{
+			s_unmap_bufzones (sjob);
+			return TES_CAP_REQ_EFAIL;
+		}
+	}
+
+	return TES_CAP_REQ_OK;
+}
+
+/*
+ * Unmaps all bufzones, call when the job is over and the files are
+ * closed.
+ */
+static void
+s_unmap_bufzones (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+		s_fin_aiobuf (&sjob->aio[s]);
 }
 
 /*
@@ -559,121 +1015,1152 @@ s_open_aiobuf (struct s_aiobuf_t* aiobuf, mode_t fmode)
 	assert (aiobuf != NULL);
 	assert (aiobuf->filename != NULL);
 
-	dbg_assert (aiobuf->aios.aio_fildes == -1);
+	dbg_assert (aiobuf->fd == -1);
 	dbg_assert (aiobuf->size == 0);
+	dbg_assert (aiobuf->inflight == 0);
 	dbg_assert (aiobuf->bufzone.cur == aiobuf->bufzone.tail);
+	dbg_assert (aiobuf->bufzone.cur == aiobuf->bufzone.head);
 	dbg_assert (aiobuf->bufzone.cur == aiobuf->bufzone.base);
 	dbg_assert (aiobuf->bufzone.waiting == 0);
 	dbg_assert (aiobuf->bufzone.enqueued == 0);
 
+	return s_open_dset (aiobuf->filename, aiobuf->root, fmode,
+		&aiobuf->fd, &aiobuf->crcfd);
+}
+
+/*
+ * Opens a stream or index file, and its checksum sidecar, on the
+ * given root. Sets fd and crcfd.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_open_dset (const char* filename, uint8_t root, mode_t fmode,
+	int* fd, int* crcfd)
+{
+	assert (filename != NULL);
+	assert (fd != NULL);
+	assert (crcfd != NULL);
+
 	/* If overwriting, unlink the file first to prevent permission
 	 * errors if owned by another user and to avoid writing outside of
 	 * root if data file is a symlink (it is not checked with
 	 * s_canonicalize_path). */
 	if (! (fmode & O_EXCL))
 	{
-		int fok = access (aiobuf->filename, F_OK);
-		if (fok == 0)
-		{
-			int rc = unlink (aiobuf->filename);
-			if (rc == -1)
-				return -1;
-		}
+		int rc = s_unlink_dset (filename);
+		if (rc == -1)
+			return -1;
+	}
+
+	if (root == 0)
+	{
+		*fd = open (filename, fmode,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (*fd == -1)
+			return -1;
+
+		return s_open_crc (filename, fmode, fd, crcfd);
+	}
+
+	/* Create it under the same path relative to the other root and
+	 * link to it. The link fails if not overwriting and the file
+	 * exists. */
+	const char* rootdir = s_dataroots[root];
+	char rootfname[PATH_MAX];
+	int rc = snprintf (rootfname, PATH_MAX, "%s%s", rootdir,
+		filename + strlen (DATAROOT));
+	if (rc == -1 || (size_t)rc >= PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
 	}
+	rc = s_mkdirs (rootfname, strlen (rootdir));
+	if (rc == 0 && ! (fmode & O_EXCL) &&
+		unlink (rootfname) == -1 && errno != ENOENT)
+		rc = -1;
+	if (rc == 0)
+		rc = symlink (rootfname, filename);
+	if (rc == -1)
+		return -1;
 
-	aiobuf->aios.aio_fildes = open (aiobuf->filename, fmode,
+	*fd = open (rootfname, fmode,
 		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (aiobuf->aios.aio_fildes == -1)
+	if (*fd == -1)
+	{
+		int errsv = errno;
+		unlink (filename);
+		errno = errsv;
 		return -1;
+	}
 
-	return 0;
+#if DEBUG_LEVEL >= VERBOSE
+	logmsg (0, LOG_DEBUG, "Writing %s to %s", filename, rootdir);
+#endif
+	return s_open_crc (filename, fmode, fd, crcfd);
 }
 
 /*
- * Close a stream or index file. Reset cursor and tail of bufzone.
- * Zero the aiocb struct.
+ * Opens the checksum sidecar of a stream or index file, which is
+ * always next to it under DATAROOT. The file must already be open
+ * as fd, it is closed if this fails.
+ * Returns 0 on success, -1 on error.
  */
-static void
-s_close_aiobuf (struct s_aiobuf_t* aiobuf)
+static int
+s_open_crc (const char* filename, mode_t fmode, int* fd, int* crcfd)
 {
-	assert (aiobuf != NULL);
-
-	if (aiobuf->aios.aio_fildes == -1)
-		return; /* _open failed? */
-
-	aiobuf->bufzone.waiting = 0;
-	aiobuf->bufzone.enqueued = 0;
-#if DEBUG_LEVEL >= VERBOSE
-	memset (&aiobuf->bufzone.st, 0, sizeof(aiobuf->bufzone.st));
-#endif
-
-	ftruncate (aiobuf->aios.aio_fildes, aiobuf->size);
-	close (aiobuf->aios.aio_fildes);
-	memset (&aiobuf->aios, 0, sizeof(aiobuf->aios));
-	aiobuf->aios.aio_sigevent.sigev_notify = SIGEV_NONE;
-	aiobuf->aios.aio_fildes = -1;
+	assert (filename != NULL);
+	dbg_assert (*fd != -1);
+	dbg_assert (*crcfd == -1);
 
-	aiobuf->size = 0;
+	char crcfname[PATH_MAX];
+	int rc = snprintf (crcfname, PATH_MAX, "%s" TESCAP_CRC_EXT,
+		filename);
+	if (rc == -1 || (size_t)rc >= PATH_MAX)
+		errno = ENAMETOOLONG;
+	else
+		*crcfd = open (crcfname, fmode | O_TRUNC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-	aiobuf->bufzone.cur = aiobuf->bufzone.tail =
-		aiobuf->bufzone.base;
+	if (*crcfd == -1)
+	{
+		int errsv = errno;
+		close (*fd);
+		*fd = -1;
+		errno = errsv;
+		return -1;
+	}
+	return 0;
 }
 
 /*
- * Requests the index and data files be saved in hdf5 format.
- * Returns TES_CAP_REQ_*
+ * Renames a stream or index file and its checksum sidecar. If the
+ * latter fails, renames the file back.
+ * Returns 0 on success, -1 on error.
  */
 static int
-s_conv_data (struct s_data_t* sjob)
+s_rename_dset (const char* from, const char* to)
 {
-	assert (sjob != NULL);
+	assert (from != NULL);
+	assert (to != NULL);
 
-	struct hdf5_dset_desc_t dsets[NUM_DSETS] = {0};
-	for (int s = 0; s < NUM_DSETS ; s++)
+	char crcfrom[PATH_MAX];
+	char crcto[PATH_MAX];
+	snprintf (crcfrom, PATH_MAX, "%s" TESCAP_CRC_EXT, from);
+	snprintf (crcto, PATH_MAX, "%s" TESCAP_CRC_EXT, to);
+
+	if (rename (from, to) == -1)
+		return -1;
+	if (rename (crcfrom, crcto) == -1)
 	{
-		dsets[s].filename = sjob->aio[s].filename;
-		dsets[s].dsetname = sjob->aio[s].dataset;
-		dsets[s].length = -1;
+		int errsv = errno;
+		rename (to, from);
+		errno = errsv;
+		return -1;
 	}
-
-	struct hdf5_conv_req_t creq = {
-		.filename = sjob->hdf5filename,
-		.group = sjob->measurement,
-		.dsets = dsets,
-		.num_dsets = NUM_DSETS,
-		.ovrwtmode = sjob->ovrwtmode,
-		.async = sjob->async,
-	};
-
-	int rc = hdf5_conv (&creq);
-	if (rc != TES_CAP_REQ_OK)
-		logmsg (errno, LOG_ERR, "Could not convert data to hdf5");
-
-	return rc;
+	return 0;
 }
 
 /*
- * Sends an error to client.
+ * Chooses a root for each payload file of the next segment (or the
+ * whole capture), placing the largest file expected from the rates
+ * in the previous job on the root with the fewest bytes expected so
+ * far. Without an estimate, files are placed round-robin.
  */
 static void
-s_send_err (struct s_data_t* sjob,
-	zsock_t* frontend, uint8_t status)
+s_stripe (struct s_data_t* sjob)
 {
-	zsock_send (frontend, TES_CAP_REP_PIC, status, 0, 0, 0, 0, 0, 0, 0);
+	assert (sjob != NULL);
 
-	zstr_free (&sjob->basefname);   /* nullifies the pointer */
-	zstr_free (&sjob->measurement); /* nullifies the pointer */
+	bool placed[NUM_DSETS] = {0};
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		sjob->aio[s].root = 0;
+		placed[s] = (s < DSET_STRIPE_FIRST ||
+			! s_dset_enabled (sjob, s));
+	}
+	if (NUM_ROOTS == 1)
+		return;
+
+	while (1)
+	{
+		int next = -1;
+		size_t next_est = 0;
+		for (int s = DSET_STRIPE_FIRST; s < NUM_DSETS ; s++)
+		{
+			if (placed[s])
+				continue;
+			size_t est = s_prealloc_estimate (sjob, &sjob->aio[s]);
+			if (next == -1 || est > next_est)
+			{
+				next = s;
+				next_est = est;
+			}
+		}
+		if (next == -1)
+			break;
+
+		size_t r_min = 0;
+		for (size_t r = 1; r < NUM_ROOTS; r++)
+		{
+			if (sjob->root_bytes[r] < sjob->root_bytes[r_min])
+				r_min = r;
+		}
+		sjob->aio[next].root = r_min;
+		sjob->root_bytes[r_min] += next_est + 1; /* +1 to alternate */
+		placed[next] = 1;
+	}
 }
 
 /*
- * Opens the stats file and reads stats. Closes it afterwards.
- * Returns TES_CAP_REQ_*
+ * Deletes a stream or index file and, if it links to a file on
+ * another root, that file as well.
+ * Returns 0 on success or if it does not exist, -1 on error.
  */
 static int
-s_stats_read (struct s_data_t* sjob)
+s_unlink_dset (const char* filename)
 {
-	assert (sjob != NULL);
-	assert (sjob->basefname != NULL);
+	assert (filename != NULL);
+
+	struct stat fstats;
+	int rc = lstat (filename, &fstats);
+	if (rc == -1)
+		return (errno == ENOENT ? 0 : -1);
+
+	if (S_ISLNK (fstats.st_mode))
+	{
+		char target[PATH_MAX];
+		ssize_t len = readlink (filename, target, PATH_MAX - 1);
+		if (len == -1)
+			return -1;
+		target[len] = '\0';
+
+		/* Only follow links we could have made. */
+		for (size_t r = 1; r < NUM_ROOTS &&
+			strstr (target, "/../") == NULL; r++)
+		{
+			if (strncmp (target, s_dataroots[r],
+				strlen (s_dataroots[r])) != 0)
+				continue;
+			rc = unlink (target);
+			if (rc == -1 && errno != ENOENT)
+				return -1;
+			break;
+		}
+	}
+
+	char crcfname[PATH_MAX];
+	snprintf (crcfname, PATH_MAX, "%s" TESCAP_CRC_EXT, filename);
+	rc = unlink (crcfname);
+	if (rc == -1 && errno != ENOENT)
+		return -1;
+
+	return unlink (filename);
+}
+
+/*
+ * Creates any missing directories of path, after the first skip
+ * characters, which must be an existing directory.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_mkdirs (const char* path, size_t skip)
+{
+	assert (path != NULL);
+	assert (skip <= strlen (path));
+
+	char buf[PATH_MAX];
+	snprintf (buf, PATH_MAX, "%s", path);
+	for (char* sep = strchr (buf + skip, '/'); sep != NULL;
+		sep = strchr (sep + 1, '/'))
+	{
+		*sep = '\0';
+		int rc = mkdir (buf, 0777);
+		*sep = '/';
+		if (rc == -1 && errno != EEXIST)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Close a stream or index file. Reset cursor, head and tail of
+ * bufzone. Zero the aiocb structs.
+ */
+static void
+s_close_aiobuf (struct s_aiobuf_t* aiobuf)
+{
+	assert (aiobuf != NULL);
+
+	if (aiobuf->fd == -1 && aiobuf->stream == NULL)
+		return; /* _open failed? */
+
+	aiobuf->bufzone.waiting = 0;
+	aiobuf->bufzone.enqueued = 0;
+#if DEBUG_LEVEL >= VERBOSE
+	memset (&aiobuf->bufzone.st, 0, sizeof(aiobuf->bufzone.st));
+#endif
+
+	/* Release any preallocated space beyond what was written. See
+	 * s_seg_next for the size while the previous segment's file is
+	 * still open (only if not flushed). */
+	if (aiobuf->fd != -1)
+	{
+		ftruncate (aiobuf->fd, aiobuf->size + aiobuf->prev.pending);
+		close (aiobuf->fd);
+	}
+	if (aiobuf->crcfd != -1)
+	{
+		close (aiobuf->crcfd);
+		aiobuf->crcfd = -1;
+	}
+	if (aiobuf->prev.fd != -1)
+		s_close_prev (aiobuf);
+	aiobuf->stream = NULL;
+	memset (&aiobuf->aios, 0, sizeof(aiobuf->aios));
+	for (int a = 0; a < AIO_DEPTH; a++)
+		aiobuf->aios[a].aio_sigevent.sigev_notify = SIGEV_NONE;
+	aiobuf->fd = -1;
+	aiobuf->first = 0;
+	aiobuf->inflight = 0;
+
+	aiobuf->size = 0;
+	aiobuf->alloc = 0;
+	aiobuf->noalloc = 0;
+
+	aiobuf->bufzone.cur = aiobuf->bufzone.head =
+		aiobuf->bufzone.tail = aiobuf->bufzone.base;
+}
+
+/*
+ * Closes the previous segment's file of a stream or index file, once
+ * all of it is written (or on error), releasing any preallocated
+ * space beyond its end.
+ */
+static void
+s_close_prev (struct s_aiobuf_t* aiobuf)
+{
+	assert (aiobuf != NULL);
+	dbg_assert (aiobuf->prev.fd != -1);
+
+	ftruncate (aiobuf->prev.fd, aiobuf->prev.end);
+	close (aiobuf->prev.fd);
+	close (aiobuf->prev.crcfd);
+	aiobuf->prev.fd = -1;
+	aiobuf->prev.crcfd = -1;
+	aiobuf->prev.waiting = 0;
+	aiobuf->prev.pending = 0;
+}
+
+/*
+ * Queues the conversion of the index and data files to hdf5 format.
+ * Sets conv_id to the ID of the conversion job.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_conv_data (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	long nsegs = s_seg_count (sjob);
+	if (nsegs < 0)
+		return TES_CAP_REQ_EFAIL;
+	if (nsegs > 0)
+		return s_conv_segments (sjob, nsegs);
+
+	struct hdf5_dset_desc_t dsets[NUM_DSETS] = {0};
+	int num_dsets = 0;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		if (s >= DSET_COL_FIRST &&
+			access (sjob->aio[s].filename, F_OK) == -1)
+			continue; /* events were not decoded */
+
+		dsets[num_dsets].filename = sjob->aio[s].filename;
+		dsets[num_dsets].dsetname = sjob->aio[s].dataset;
+		dsets[num_dsets].length = -1;
+		dsets[num_dsets].verify = 1;
+		num_dsets++;
+	}
+
+	struct hdf5_conv_req_t creq = {
+		.filename = sjob->hdf5filename,
+		.group = sjob->measurement,
+		.dsets = dsets,
+		.num_dsets = num_dsets,
+		.ovrwtmode = sjob->ovrwtmode,
+		.external = (sjob->h5mode == TES_H5_EXTERNAL),
+	};
+
+	int rc = hdf5_conv_queue (&creq, &sjob->conv_id);
+	if (rc != TES_CAP_REQ_OK)
+		logmsg (0, LOG_ERR, "Could not queue conversion to hdf5");
+
+	return rc;
+}
+
+/*
+ * Queues the conversion of the index and data files of a capture
+ * split into nsegs segments to hdf5 format. Each segment is saved in its
+ * own subgroup, named after the segment number. The manifest is
+ * saved as a dataset in the measurement group.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_conv_segments (struct s_data_t* sjob, long nsegs)
+{
+	assert (sjob != NULL);
+	assert (nsegs > 0);
+
+	size_t num_dsets = nsegs*NUM_DSETS + 1;
+	if (num_dsets > UINT16_MAX)
+	{
+		logmsg (0, LOG_ERR, "Too many segments: %ld", nsegs);
+		return TES_CAP_REQ_ECONV;
+	}
+
+	/* Names of segment datasets are <segment>/<dataset>. */
+#define SEG_DSETNAME_LEN 64
+	struct hdf5_dset_desc_t* dsets = (struct hdf5_dset_desc_t*)
+		calloc (num_dsets, sizeof (struct hdf5_dset_desc_t));
+	char* names = (char*) malloc (num_dsets *
+		(PATH_MAX + SEG_DSETNAME_LEN));
+	if (dsets == NULL || names == NULL)
+	{
+		logmsg ((errno == ENOMEM) ? 0 : errno, LOG_ERR,
+			"Cannot allocate memory");
+		free (dsets);
+		free (names);
+		return TES_CAP_REQ_EFAIL;
+	}
+
+	int rc = TES_CAP_REQ_OK;
+	size_t d = 0;
+	for (long g = 0; g < nsegs && rc == TES_CAP_REQ_OK; g++)
+	{
+		for (int s = 0; s < NUM_DSETS ; s++)
+		{
+			char* filename = names + d*(PATH_MAX + SEG_DSETNAME_LEN);
+			char* dsetname = filename + PATH_MAX;
+			if (s_construct_dset_filename (filename,
+				sjob->statfilename, g, s_dsets[s].extension) == -1)
+			{
+				rc = TES_CAP_REQ_EFAIL;
+				break;
+			}
+			if (s >= DSET_COL_FIRST && access (filename, F_OK) == -1)
+				continue; /* events were not decoded */
+
+			snprintf (dsetname, SEG_DSETNAME_LEN, "%04ld/%s",
+				g, s_dsets[s].dataset);
+			dsets[d].filename = filename;
+			dsets[d].dsetname = dsetname;
+			dsets[d].length = -1;
+			dsets[d].verify = 1;
+			d++;
+		}
+	}
+	dsets[d].filename = sjob->segfilename;
+	dsets[d].dsetname = "segments";
+	dsets[d].length = -1;
+	num_dsets = d + 1;
+
+	struct hdf5_conv_req_t creq = {
+		.filename = sjob->hdf5filename,
+		.group = sjob->measurement,
+		.dsets = dsets,
+		.num_dsets = num_dsets,
+		.ovrwtmode = sjob->ovrwtmode,
+		.external = (sjob->h5mode == TES_H5_EXTERNAL),
+	};
+
+	if (rc == TES_CAP_REQ_OK)
+		rc = hdf5_conv_queue (&creq, &sjob->conv_id);
+	if (rc != TES_CAP_REQ_OK)
+		logmsg (0, LOG_ERR, "Could not queue conversion to hdf5");
+
+	free (dsets);
+	free (names);
+	return rc;
+}
+
+/*
+ * If the client asked to wait for the conversion, sets a timer which
+ * sends the reply once it is done. The REP frontend will not read
+ * another request until then, but the task is otherwise free.
+ * Returns true if the timer was set, false if the caller should send
+ * the reply.
+ */
+static bool
+s_conv_wait (task_t* self)
+{
+	struct s_data_t* sjob = (struct s_data_t*) self->data;
+	dbg_assert (sjob->conv_id != 0);
+
+	if (sjob->async)
+		return 0;
+
+	int tid = zloop_timer (self->loop, CONV_POLL, 0,
+		s_conv_timer_hn, self);
+	if (tid == -1)
+	{
+		logmsg (errno, LOG_ERR,
+			"Could not set a timer, not waiting for conversion");
+		return 0;
+	}
+	sjob->conv_timer = tid;
+	return 1;
+}
+
+/*
+ * Checks on the conversion the client is waiting for. When it is
+ * done, cancels the timer and sends the reply.
+ */
+static int
+s_conv_timer_hn (zloop_t* loop, int timer_id, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+	struct s_data_t* sjob = (struct s_data_t*) self->data;
+	dbg_assert (sjob->conv_id != 0);
+	dbg_assert (sjob->conv_timer == timer_id);
+
+	struct hdf5_conv_stat_t st;
+	uint8_t status;
+	int rc = hdf5_conv_stat (sjob->conv_id, &st);
+	if (rc == -1)
+		status = TES_CAP_REQ_ECONV; /* forgotten, shouldn't happen */
+	else if (st.state != HDF5_CONV_DONE)
+		return 0;
+	else
+		status = st.status;
+
+	zloop_timer_end (loop, timer_id);
+	if (status != TES_CAP_REQ_OK)
+		logmsg (0, LOG_ERR, "Could not convert data to hdf5");
+
+	rc = s_stats_send (sjob, self->frontends[0].sock, status);
+	if (rc != TES_CAP_REQ_OK)
+		logmsg (0, LOG_NOTICE, "Could not send stats");
+
+	return 0;
+}
+
+/*
+ * Finds the most recent conversion of the given capture.
+ * Returns TES_CONV_REQ_*
+ */
+static int
+s_conv_lookup (const char* basefname, const char* measurement,
+	struct hdf5_conv_stat_t* st)
+{
+	assert (basefname != NULL);
+	assert (measurement != NULL);
+	assert (st != NULL);
+
+	if (strchr (measurement, '/') != NULL)
+		return TES_CONV_REQ_EINV;
+
+	/* The capture must exist, so that no directories are created
+	 * for the hdf5 file. */
+	char tmpfname[PATH_MAX];
+	char finalpath[PATH_MAX];
+	int rc = snprintf (tmpfname, PATH_MAX, "%s%s%s",
+		basefname,
+		strlen (measurement) == 0 ? "" : "-",
+		measurement);
+	if (rc == -1 || (size_t)rc >= PATH_MAX ||
+		s_canonicalize_path (tmpfname, finalpath, 1) == NULL)
+		return TES_CONV_REQ_ENOENT;
+
+	rc = snprintf (tmpfname, PATH_MAX, "%s.hdf5", basefname);
+	if (rc == -1 || (size_t)rc >= PATH_MAX ||
+		s_canonicalize_path (tmpfname, finalpath, 0) == NULL)
+		return TES_CONV_REQ_ENOENT;
+
+	uint32_t id;
+	rc = hdf5_conv_find (finalpath, measurement, &id);
+	if (rc == 0)
+		rc = hdf5_conv_stat (id, st);
+	if (rc == -1)
+		return TES_CONV_REQ_ENOENT;
+
+	switch (st->state)
+	{
+		case HDF5_CONV_QUEUED:
+			return TES_CONV_REQ_QUEUED;
+		case HDF5_CONV_RUNNING:
+			return TES_CONV_REQ_RUNNING;
+		default:
+			return (st->status == TES_CAP_REQ_OK ?
+				TES_CONV_REQ_DONE : TES_CONV_REQ_ECONV);
+	}
+}
+
+/*
+ * Sends an error to client.
+ */
+static void
+s_send_err (struct s_data_t* sjob,
+	zsock_t* frontend, uint8_t status)
+{
+	zsock_send (frontend, TES_CAP_REP_PIC, status, 0, 0, 0, 0, 0, 0, 0);
+
+	sjob->conv_id = 0;
+	zstr_free (&sjob->basefname);   /* nullifies the pointer */
+	zstr_free (&sjob->measurement); /* nullifies the pointer */
+}
+
+/*
+ * Opens the segment manifest, or deletes a stale one if the capture
+ * is not segmented. Opens the files of the second segment ahead of
+ * time.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_seg_open (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+	dbg_assert (sjob->segfd == -1);
+	dbg_assert (sjob->cur_seg.num == 0);
+
+	/* See notes in s_open_aiobuf. */
+	int fok = access (sjob->segfilename, F_OK);
+	if (fok == 0 && ( ! (sjob->fmode & O_EXCL) || ! sjob->segmented ))
+	{
+		int rc = unlink (sjob->segfilename);
+		if (rc == -1)
+		{
+			logmsg (errno, LOG_ERR, "Could not delete manifest");
+			return TES_CAP_REQ_EFAIL;
+		}
+	}
+
+	if ( ! sjob->segmented )
+		return TES_CAP_REQ_OK;
+
+	sjob->segfd = open (sjob->segfilename, sjob->fmode,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (sjob->segfd == -1)
+	{
+		logmsg (errno, LOG_ERR, "Could not open manifest");
+		return (sjob->nooverwrite ?
+			TES_CAP_REQ_EABORT : TES_CAP_REQ_EFAIL);
+	}
+
+	if (s_seg_prep (sjob) == -1)
+	{
+		close (sjob->segfd);
+		sjob->segfd = -1;
+		return (sjob->nooverwrite ?
+			TES_CAP_REQ_EABORT : TES_CAP_REQ_EFAIL);
+	}
+
+	return TES_CAP_REQ_OK;
+}
+
+/*
+ * Writes the manifest entry for the current segment, given the
+ * number of frames in it. Call before switching from or closing the
+ * stream and index files, their bytes need not be written yet. If it
+ * is the last segment (i.e. not called by s_seg_next), closes the
+ * manifest.
+ */
+static void
+s_seg_close (struct s_data_t* sjob, uint64_t frames)
+{
+	assert (sjob != NULL);
+
+	if (sjob->segfd == -1)
+		return;
+
+	struct s_seg_t* seg = &sjob->cur_seg.idx;
+	seg->frames = frames;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		seg->sizes[s] = aiobuf->size + aiobuf->bufzone.waiting +
+			aiobuf->bufzone.enqueued;
+	}
+
+	off_t rc = write (sjob->segfd, seg, SEG_LEN);
+	if (rc != SEG_LEN)
+		logmsg (errno, LOG_ERR, "Could not write manifest");
+
+	if (sjob->st.frames == seg->first_frame + frames)
+	{ /* last one */
+		close (sjob->segfd);
+		sjob->segfd = -1;
+	}
+}
+
+/*
+ * Switches to the stream and index files of the next segment, opened
+ * ahead by s_seg_prep. The current frame (a tick) becomes the first
+ * frame of the next segment. The bytes of the current segment are
+ * written out in the background, its files are closed once they are
+ * (see s_queue_aiobuf).
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_seg_next (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+	dbg_assert (sjob->segmented);
+	dbg_assert (sjob->st.frames > sjob->cur_seg.idx.first_frame);
+
+	uint64_t frames = sjob->st.frames - 1 -
+		sjob->cur_seg.idx.first_frame;
+	if ( ! sjob->seg_ready && s_seg_prep (sjob) == -1 )
+	{
+		s_flush (sjob);
+		s_seg_close (sjob, frames);
+		s_close (sjob);
+		close (sjob->segfd);
+		sjob->segfd = -1;
+		return -1;
+	}
+
+#ifdef COMPACT_FIDX
+	s_cidx_flush (sjob);
+	memset (&sjob->cidx, 0, sizeof (sjob->cidx));
+#endif
+	s_seg_close (sjob, frames);
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		snprintf (aiobuf->filename, PATH_MAX, "%s",
+			aiobuf->next.filename);
+		if ( ! s_dset_enabled (sjob, s) )
+			continue;
+
+		/* Only if the previous segment was very short. */
+		int jobrc = EINPROGRESS;
+		while (aiobuf->prev.fd != -1 && jobrc == EINPROGRESS)
+			jobrc = s_queue_aiobuf (aiobuf, 1);
+		if (aiobuf->prev.fd != -1)
+			s_close_prev (aiobuf); /* error */
+
+		/* Offsets into the new file are still size + enqueued +
+		 * waiting, size wraps around below 0 until the bytes of the
+		 * old one are written. */
+		aiobuf->prev.fd = aiobuf->fd;
+		aiobuf->prev.crcfd = aiobuf->crcfd;
+		aiobuf->prev.waiting = aiobuf->bufzone.waiting;
+		aiobuf->prev.pending = aiobuf->bufzone.waiting +
+			aiobuf->bufzone.enqueued;
+		aiobuf->prev.end = aiobuf->size + aiobuf->prev.pending;
+		aiobuf->size = 0 - aiobuf->prev.pending;
+
+		aiobuf->fd = aiobuf->next.fd;
+		aiobuf->crcfd = aiobuf->next.crcfd;
+		aiobuf->alloc = aiobuf->next.alloc;
+		aiobuf->noalloc = aiobuf->next.noalloc;
+		aiobuf->next.fd = -1;
+		aiobuf->next.crcfd = -1;
+
+		/* Close the old file, or queue the rest of it without
+		 * waiting. */
+		if (aiobuf->prev.pending == 0)
+			s_close_prev (aiobuf);
+		else
+			s_queue_aiobuf (aiobuf, 0);
+	}
+	sjob->seg_ready = 0;
+
+	memset (&sjob->cur_seg.idx, 0, SEG_LEN);
+	sjob->cur_seg.idx.first_frame = sjob->st.frames - 1;
+	sjob->cur_seg.first_event = sjob->st.events;
+	sjob->cur_seg.num++;
+
+#if DEBUG_LEVEL >= VERBOSE
+	logmsg (0, LOG_DEBUG, "Started segment %u at frame #%lu",
+		sjob->cur_seg.num, sjob->cur_seg.idx.first_frame);
+#endif
+	return 0;
+}
+
+/*
+ * Opens the stream and index files of the next segment, so that
+ * s_seg_next need not open any files on the packet path. Any opened
+ * are closed and deleted if this fails.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_seg_prep (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+	dbg_assert (sjob->segmented);
+	dbg_assert ( ! sjob->seg_ready );
+
+	uint32_t num = sjob->cur_seg.num + 1;
+	s_stripe (sjob);
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		dbg_assert (aiobuf->next.fd == -1);
+		int rc = s_construct_dset_filename (aiobuf->next.filename,
+			sjob->statfilename, num, s_dsets[s].extension);
+		if (rc == 0 && ! s_dset_enabled (sjob, s))
+			continue;
+		if (rc == 0)
+			rc = s_open_dset (aiobuf->next.filename, aiobuf->root,
+				sjob->fmode, &aiobuf->next.fd,
+				&aiobuf->next.crcfd);
+		if (rc == -1)
+		{
+			logmsg (errno, LOG_ERR,
+				"Could not open files for segment %u", num);
+			s_seg_unprep (sjob);
+			return -1;
+		}
+
+		/* As s_prealloc_aiobuf. */
+		size_t len = s_prealloc_estimate (sjob, aiobuf);
+		aiobuf->next.alloc = 0;
+		aiobuf->next.noalloc = 0;
+		if (len > 0 && s_fallocate (aiobuf->next.fd, 0, len) != 0)
+			aiobuf->next.noalloc = 1;
+		else
+			aiobuf->next.alloc = len;
+	}
+
+	sjob->seg_ready = 1;
+	return 0;
+}
+
+/*
+ * Closes and deletes the next segment's files, if they were not
+ * switched to.
+ */
+static void
+s_seg_unprep (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		if (aiobuf->next.fd == -1)
+			continue;
+
+		close (aiobuf->next.fd);
+		close (aiobuf->next.crcfd);
+		s_unlink_dset (aiobuf->next.filename);
+		aiobuf->next.fd = -1;
+		aiobuf->next.crcfd = -1;
+	}
+	sjob->seg_ready = 0;
+}
+
+/*
+ * Constructs the name of spare stream or index file s.
+ */
+static void
+s_spare_filename (char* filename, int s)
+{
+	snprintf (filename, PATH_MAX, "%s.%s",
+		SPARE_FNAME, s_dsets[s].extension);
+}
+
+/*
+ * Opens a spare set of stream and index files, which a continued
+ * capture switches to at its last tick, so that the next one need
+ * not open any files on the packet path. They are always under
+ * DATAROOT, since they are later renamed.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_spare_open (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		dbg_assert (aiobuf->spare_fd == -1);
+		if ( ! s_dset_enabled (sjob, s) )
+			continue;
+
+		char filename[PATH_MAX];
+		char crcfname[PATH_MAX];
+		s_spare_filename (filename, s);
+		snprintf (crcfname, PATH_MAX, "%s" TESCAP_CRC_EXT, filename);
+		aiobuf->spare_fd = open (filename, O_RDWR | O_CREAT | O_TRUNC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (aiobuf->spare_fd != -1)
+			aiobuf->spare_crcfd = open (crcfname,
+				O_RDWR | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (aiobuf->spare_crcfd == -1)
+		{
+			logmsg (errno, LOG_ERR, "Could not open '%s'", filename);
+			s_spare_close (sjob);
+			return TES_CAP_REQ_EFAIL;
+		}
+	}
+
+	return TES_CAP_REQ_OK;
+}
+
+/*
+ * Closes and deletes the spare files, if they were not used.
+ */
+static void
+s_spare_close (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		if (aiobuf->spare_fd == -1)
+			continue;
+
+		char filename[PATH_MAX];
+		s_spare_filename (filename, s);
+		close (aiobuf->spare_fd);
+		if (aiobuf->spare_crcfd != -1)
+			close (aiobuf->spare_crcfd);
+		s_unlink_dset (filename);
+		aiobuf->spare_fd = -1;
+		aiobuf->spare_crcfd = -1;
+	}
+}
+
+/*
+ * Switches to the spare files after the last tick of a continued
+ * capture has been written and replied to. The capture goes on until
+ * the next request adopts the files (see s_cont_adopt), or gives up
+ * after CONT_MAX_TICKS. The frontend is polled meanwhile.
+ */
+static void
+s_cont_start (task_t* self)
+{
+	assert (self != NULL);
+
+	struct s_data_t* sjob = (struct s_data_t*) self->data;
+	dbg_assert ( ! sjob->recording );
+
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		if (aiobuf->spare_fd == -1)
+			continue;
+
+		dbg_assert (aiobuf->fd == -1);
+		aiobuf->fd = aiobuf->spare_fd;
+		aiobuf->crcfd = aiobuf->spare_crcfd;
+		aiobuf->spare_fd = -1;
+		aiobuf->spare_crcfd = -1;
+		aiobuf->root = 0;
+		s_spare_filename (aiobuf->filename, s);
+	}
+
+	s_cont_resume (sjob, sjob->columns);
+	sjob->continuing = 1;
+
+	int rc = zloop_reader (self->loop, self->frontends[0].sock,
+		self->frontends[0].handler, self);
+	if (rc == -1)
+		logmsg (errno, LOG_ERR, "Could not re-enable the zloop reader");
+}
+
+/*
+ * Stops a continued capture which was not adopted and deletes its
+ * files. Disables the frontend again, the caller must deactivate the
+ * task.
+ */
+static void
+s_cont_stop (task_t* self)
+{
+	assert (self != NULL);
+
+	struct s_data_t* sjob = (struct s_data_t*) self->data;
+	dbg_assert (sjob->continuing);
+
+	s_flush (sjob);
+	s_close (sjob);
+	s_unmap_bufzones (sjob);
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		if (s_dset_enabled (sjob, s))
+			s_unlink_dset (sjob->aio[s].filename);
+	}
+	s_stats_reset (sjob);
+	sjob->continuing = 0;
+
+	zloop_reader_end (self->loop, self->frontends[0].sock);
+}
+
+/*
+ * Renames the files of a continued capture to the ones constructed
+ * for the request, following the same rules as s_open. On error,
+ * renames back the ones that were renamed.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_cont_adopt (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+	dbg_assert (sjob->continuing);
+
+	int rc = TES_CAP_REQ_OK;
+	int s = 0;
+	for (; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		bool exists = (access (aiobuf->filename, F_OK) == 0);
+		if ( exists && ! sjob->nooverwrite &&
+			s_unlink_dset (aiobuf->filename) == -1 )
+		{
+			logmsg (errno, LOG_ERR, "Could not delete '%s'",
+				aiobuf->filename);
+			rc = TES_CAP_REQ_EFAIL;
+			break;
+		}
+		if ( ! s_dset_enabled (sjob, s) )
+			continue; /* stale file from a previous capture */
+
+		if (exists && sjob->nooverwrite)
+		{
+			logmsg (0, LOG_INFO, "Not going to overwrite");
+			rc = TES_CAP_REQ_EABORT;
+			break;
+		}
+
+		char filename[PATH_MAX];
+		s_spare_filename (filename, s);
+		if (s_rename_dset (filename, aiobuf->filename) == -1)
+		{
+			logmsg (errno, LOG_ERR, "Could not rename '%s'",
+				filename);
+			rc = TES_CAP_REQ_EFAIL;
+			break;
+		}
+	}
+
+	if (rc != TES_CAP_REQ_OK)
+		s_cont_rollback (sjob, s);
+	return rc;
+}
+
+/*
+ * Renames the first n files adopted by s_cont_adopt back to the
+ * spare files and deletes the segment manifest if it was opened.
+ */
+static void
+s_cont_rollback (struct s_data_t* sjob, int n)
+{
+	assert (sjob != NULL);
+
+	for (int s = 0; s < n ; s++)
+	{
+		if ( ! s_dset_enabled (sjob, s) )
+			continue;
+
+		char filename[PATH_MAX];
+		s_spare_filename (filename, s);
+		if (s_rename_dset (sjob->aio[s].filename, filename) == -1)
+			logmsg (errno, LOG_ERR, "Could not rename '%s'",
+				sjob->aio[s].filename);
+	}
+
+	if (sjob->segfd != -1)
+	{
+		close (sjob->segfd);
+		sjob->segfd = -1;
+		unlink (sjob->segfilename);
+	}
+}
+
+/*
+ * Restores the parameters of a continued capture, overwritten by
+ * a request which was not valid for adopting it or by the previous
+ * job. It captures with the same columns until CONT_MAX_TICKS.
+ */
+static void
+s_cont_resume (struct s_data_t* sjob, uint8_t columns)
+{
+	assert (sjob != NULL);
+
+	sjob->min_ticks = CONT_MAX_TICKS;
+	sjob->min_events = 0;
+	sjob->seg_ticks = 0;
+	sjob->seg_size = 0;
+	sjob->columns = columns;
+	sjob->start_ts = 0;
+	sjob->nocapture = 0;
+	sjob->segmented = 0;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		if (s_dset_enabled (sjob, s))
+			s_spare_filename (sjob->aio[s].filename, s);
+	}
+}
+
+/*
+ * Returns the number of segments in the manifest, 0 if there is no
+ * manifest (capture was not segmented), -1 on error.
+ */
+static long
+s_seg_count (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
+	struct stat fstats;
+	int rc = stat (sjob->segfilename, &fstats);
+	if (rc == -1)
+	{
+		if (errno == ENOENT)
+			return 0;
+		logmsg (errno, LOG_ERR, "Could not stat manifest");
+		return -1;
+	}
+	if (fstats.st_size % SEG_LEN != 0)
+	{
+		logmsg (0, LOG_ERR, "Manifest is corrupt");
+		return -1;
+	}
+	return fstats.st_size / SEG_LEN;
+}
+
+/*
+ * Returns true if the current segment has reached the requested
+ * number of ticks or size.
+ */
+static bool
+s_seg_full (struct s_data_t* sjob)
+{
+	dbg_assert (sjob != NULL);
+
+	if (sjob->seg_ticks > 0 &&
+		sjob->cur_seg.idx.ticks >= sjob->seg_ticks)
+		return 1;
+
+	if (sjob->seg_size == 0)
+		return 0;
+
+	uint64_t size = 0;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		size += aiobuf->size + aiobuf->bufzone.waiting +
+			aiobuf->bufzone.enqueued;
+	}
+	return (size >= sjob->seg_size);
+}
+
+/*
+ * Opens the stats file and reads stats. Closes it afterwards.
+ * Returns TES_CAP_REQ_*
+ */
+static int
+s_stats_read (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+	assert (sjob->basefname != NULL);
 	dbg_assert (sjob->statfd == -1);
 
 	sjob->statfd = open (sjob->statfilename, O_RDONLY);
@@ -753,15 +2240,31 @@ s_stats_send (struct s_data_t* sjob,
 		sjob->st.frames_lost,
 		sjob->st.frames_dropped);
 
+	s_stats_reset (sjob);
+	return (rc ? TES_CAP_REQ_EFIN : TES_CAP_REQ_OK);
+}
+
+/*
+ * Resets the statistics and the state of the job.
+ */
+static void
+s_stats_reset (struct s_data_t* sjob)
+{
+	assert (sjob != NULL);
+
 	memset (&sjob->st, 0, STAT_LEN);
 	memset (&sjob->cur_stream, 0, sizeof (sjob->cur_stream));
 	memset (&sjob->cur_tick, 0, sizeof (sjob->cur_tick));
+	memset (&sjob->cur_seg, 0, sizeof (sjob->cur_seg));
+#ifdef COMPACT_FIDX
+	memset (&sjob->cidx, 0, sizeof (sjob->cidx));
+#endif
+	sjob->evt_time = 0;
+	sjob->conv_id = 0;
 
 	zstr_free (&sjob->basefname);   /* nullifies the pointer */
 	zstr_free (&sjob->measurement); /* nullifies the pointer */
 	sjob->recording = 0;
-
-	return (rc ? TES_CAP_REQ_EFIN : TES_CAP_REQ_OK);
 }
 
 /*
@@ -772,6 +2275,10 @@ s_flush (struct s_data_t* sjob)
 {
 	assert (sjob != NULL);
 
+#ifdef COMPACT_FIDX
+	s_cidx_flush (sjob);
+#endif
+
 	int jobrc;
 	for (int s = 0; s < NUM_DSETS ; s++)
 	{
@@ -782,8 +2289,8 @@ s_flush (struct s_data_t* sjob)
 }
 
 /*
- * Copies buf to bufzone. If previous aio_write is completed and
- * enough bytes are waiting in buffer, queues them.
+ * Copies buf to bufzone. If enough bytes are waiting in buffer,
+ * queues them, unless AIO_DEPTH batches are already in flight.
  * If there is no space for another packet, will block until it's
  * done.
  * Returns 0 on success or if nothing was queued.
@@ -794,24 +2301,26 @@ s_try_queue_aiobuf (struct s_aiobuf_t* aiobuf,
 	const char* buf, uint16_t len)
 {
 	dbg_assert (aiobuf != NULL);
-	dbg_assert (aiobuf->aios.aio_fildes != -1);
+	dbg_assert (aiobuf->fd != -1 || aiobuf->stream != NULL);
 	dbg_assert (buf != NULL);
 	dbg_assert (len > 0);
 
 	dbg_assert (aiobuf->bufzone.enqueued + aiobuf->bufzone.waiting <=
-		BUFSIZE - TESPKT_MTU);
+		aiobuf->bufzone.len - TESPKT_MTU);
 	dbg_assert (aiobuf->bufzone.cur >= aiobuf->bufzone.base);
+	dbg_assert (aiobuf->bufzone.head >= aiobuf->bufzone.base);
 	dbg_assert (aiobuf->bufzone.tail >= aiobuf->bufzone.base);
 	dbg_assert (aiobuf->bufzone.cur < aiobuf->bufzone.ceil);
-	dbg_assert (aiobuf->bufzone.tail + aiobuf->bufzone.enqueued <=
-		aiobuf->bufzone.ceil);
-	dbg_assert (aiobuf->bufzone.cur < aiobuf->bufzone.tail ||
-		aiobuf->bufzone.cur >=
-			aiobuf->bufzone.tail + aiobuf->bufzone.enqueued);
-	dbg_assert (aiobuf->bufzone.cur == aiobuf->bufzone.tail
-		+ aiobuf->bufzone.enqueued + aiobuf->bufzone.waiting -
-			((aiobuf->bufzone.cur < aiobuf->bufzone.tail) ?
-				 BUFSIZE : 0));
+	dbg_assert (aiobuf->bufzone.head < aiobuf->bufzone.ceil);
+	dbg_assert (aiobuf->bufzone.tail < aiobuf->bufzone.ceil);
+	dbg_assert (aiobuf->bufzone.head == aiobuf->bufzone.tail
+		+ aiobuf->bufzone.enqueued -
+			((aiobuf->bufzone.head < aiobuf->bufzone.tail) ?
+				 aiobuf->bufzone.len : 0));
+	dbg_assert (aiobuf->bufzone.cur == aiobuf->bufzone.head
+		+ aiobuf->bufzone.waiting -
+			((aiobuf->bufzone.cur < aiobuf->bufzone.head) ?
+				 aiobuf->bufzone.len : 0));
 
 	/* Wrap cursor if needed */
 	int reserve = len - (aiobuf->bufzone.ceil - aiobuf->bufzone.cur);
@@ -834,34 +2343,45 @@ s_try_queue_aiobuf (struct s_aiobuf_t* aiobuf,
 	 * and there is stil space for more packets, wait. */
 	if (aiobuf->bufzone.waiting < MINSIZE && reserve < 0 &&
 		aiobuf->bufzone.enqueued + aiobuf->bufzone.waiting <=
-			BUFSIZE - TESPKT_MTU)
+			aiobuf->bufzone.len - TESPKT_MTU)
 		return 0;
 
 	/* Try to queue next batch but don't force */
 	int jobrc = s_queue_aiobuf (aiobuf, 0);
 #if DEBUG_LEVEL >= VERBOSE
-	if (jobrc == EINPROGRESS)
+	if (jobrc == EINPROGRESS && aiobuf->bufzone.waiting > 0)
 		aiobuf->bufzone.st.num_skipped++;
 #endif
 
 	/* If there is no space for a full frame, force write until
 	 * there is. If we are finalizingm wait for all bytes to be
 	 * written. */
-#if DEBUG_LEVEL >= VERBOSE
 	bool blocked = 0;
-#endif
 	while ( aiobuf->bufzone.enqueued + aiobuf->bufzone.waiting >
-		BUFSIZE - TESPKT_MTU && jobrc == EINPROGRESS )
+		aiobuf->bufzone.len - TESPKT_MTU && jobrc == EINPROGRESS )
 	{
-#if DEBUG_LEVEL >= VERBOSE
 		blocked = 1;
-#endif
 		jobrc = s_queue_aiobuf (aiobuf, 1);
 	}
 #if DEBUG_LEVEL >= VERBOSE
 	if (blocked)
 		aiobuf->bufzone.st.num_blocked++;
 #endif
+
+	/* Having blocked, drain the bufzone and double it, so that it
+	 * rides out the next stall. Only an empty one can be remapped. */
+	if (blocked && aiobuf->bufzone.len < BUFZONE_MAX)
+	{
+		while (jobrc == EINPROGRESS)
+			jobrc = s_queue_aiobuf (aiobuf, 1);
+		if (jobrc == 0 &&
+			s_map_bufzone (aiobuf, 2*aiobuf->bufzone.len) == 0)
+		{
+			aiobuf->bufzone.grown = aiobuf->bufzone.len;
+			logmsg (0, LOG_INFO, "Bufzone for %s grew to %lu bytes",
+				aiobuf->dataset, aiobuf->bufzone.len);
+		}
+	}
 	if (jobrc == -1)
 	{
 		/* TO DO: how to handle errors */
@@ -872,7 +2392,7 @@ s_try_queue_aiobuf (struct s_aiobuf_t* aiobuf,
 		/* TO DO: how to handle errors */
 #if DEBUG_LEVEL >= VERBOSE
 		logmsg (0, LOG_ERR, "Queued %lu bytes, wrote %lu",
-			aiobuf->bufzone.enqueued,
+			aiobuf->bufzone.st.last_queued,
 			aiobuf->bufzone.st.last_written);
 #else /* DEBUG_LEVEL >= VERBOSE */
 		logmsg (0, LOG_ERR, "Wrote unexpected number of bytes");
@@ -883,25 +2403,27 @@ s_try_queue_aiobuf (struct s_aiobuf_t* aiobuf,
 	int jobrc = 0;
 	aiobuf->size += aiobuf->bufzone.waiting;
 	aiobuf->bufzone.waiting = 0;
-	aiobuf->bufzone.tail = aiobuf->bufzone.cur;
+	aiobuf->bufzone.tail = aiobuf->bufzone.head =
+		aiobuf->bufzone.cur;
 #endif /* skip writing */
 
 	dbg_assert (aiobuf->bufzone.enqueued + aiobuf->bufzone.waiting <=
-		BUFSIZE - TESPKT_MTU);
+		aiobuf->bufzone.len - TESPKT_MTU);
 	return jobrc;
 }
 
 /*
- * Queue the next batch for aio_write-ing.
- * If force is true, will suspend if file is not ready for writing.
- * Always calls aio_return for previous job. Calls aio_return if
- * waiting for new job.
+ * Releases written batches and queues the bytes waiting in the
+ * bufzone for aio_write-ing, as long as there is a free aiocb in the
+ * ring. Batches may complete in any order, but are released in the
+ * order they were queued, so the tail only ever moves over bytes
+ * which are on disk.
+ * If force is true, will suspend until the oldest batch is written.
+ * Always calls aio_return for the batches it releases.
  * 
- * Returns 0 if no new bytes in the bufzone (should only happen if
- * flushing or waiting for a large batch and no space in the
- * bufzone).
- * Returns EINPROGRESS on successful queue, or if force is false and
- * file is not ready.
+ * Returns 0 if no batches are in flight and no bytes are waiting in
+ * the bufzone (should only happen if flushing).
+ * Returns EINPROGRESS if any batches are in flight.
  * Returns -1 on error.
  * Returns -2 if number of bytes written as reported by aio_return
  * is unexpected.
@@ -911,115 +2433,487 @@ s_queue_aiobuf (struct s_aiobuf_t* aiobuf, bool force)
 {
 	dbg_assert (aiobuf != NULL);
 
-	/* If there was no previous job, no need to do checks. */
-	if (aiobuf->bufzone.enqueued == 0)
-		goto prepare_next;
+	if (aiobuf->stream != NULL)
+		return s_send_aiobuf (aiobuf, force);
 
 	/* ---------------------------------------------------------- */
-	/* Check if ready. */
-	int rc = aio_error (&aiobuf->aios);
-	if ( ! force && rc == EINPROGRESS )
-		return EINPROGRESS;
+	/* Release written batches, oldest first. */
+	int rc;
+	while (aiobuf->inflight > 0)
+	{
+		struct aiocb* aios = &aiobuf->aios[aiobuf->first];
+
+		/* Check if ready. */
+		rc = aio_error (aios);
+		if ( ! force && rc == EINPROGRESS )
+			break;
+
+		/* Suspend while ready. */
+		if ( rc == EINPROGRESS )
+		{
+			const struct aiocb* aiol[1] = { aios, };
+			rc = aio_suspend (aiol, 1, NULL);
+			if (rc == -1)
+				return -1;
+			rc = aio_error (aios);
+		}
+
+		if (rc != 0)
+		{
+			dbg_assert (rc != ECANCELED && rc != EINPROGRESS);
+			errno = rc; /* aio_error does not set it */
+			return -1;
+		}
+
+		/* Check completion status. */
+		ssize_t wrc = aio_return (aios);
+		if (wrc == -1 && errno == EAGAIN)
+		{
+#if DEBUG_LEVEL >= VERBOSE
+			aiobuf->bufzone.st.failed_batches++;
+#endif
+			/* Requeue the batch as is. */
+			do
+			{
+				rc = aio_write (aios);
+			} while (rc == -1 && errno == EAGAIN);
+			if (rc == -1)
+				return -1; /* an error other than EAGAIN */
+			continue;
+		}
+
+		if (wrc == -1)
+			return -1; /* an error other than EAGAIN */
+		if ((size_t)wrc != aios->aio_nbytes)
+		{
+#if DEBUG_LEVEL >= VERBOSE
+			aiobuf->bufzone.st.last_queued = aios->aio_nbytes;
+			aiobuf->bufzone.st.last_written = wrc;
+#endif
+			return -2;
+		}
 
-	/* Suspend while ready. */
-	if ( rc == EINPROGRESS )
+		/* Increase file size by number of bytes written. */
+		aiobuf->size += wrc;
+		aiobuf->bufzone.enqueued -= wrc;
+
+		/* Bytes of the previous segment are released first, close
+		 * its file once they all are, see s_seg_next. */
+		if (unlikely (aiobuf->prev.pending > 0))
+		{
+			dbg_assert ((size_t)wrc <= aiobuf->prev.pending);
+			aiobuf->prev.pending -= wrc;
+			if (aiobuf->prev.pending == 0)
+				s_close_prev (aiobuf);
+		}
+
+		/* Release written bytes by moving the tail. */
+		aiobuf->bufzone.tail += wrc;
+		/* if batch ended at the end of the bufzone */
+		if (aiobuf->bufzone.tail == aiobuf->bufzone.ceil)
+			aiobuf->bufzone.tail = aiobuf->bufzone.base;
+		dbg_assert (aiobuf->bufzone.tail < aiobuf->bufzone.ceil);
+
+		aiobuf->first = (aiobuf->first + 1) % AIO_DEPTH;
+		aiobuf->inflight--;
+		force = 0; /* release the rest only if already written */
+	}
+
+	/* ---------------------------------------------------------- */
+	/* Queue waiting bytes. */
+	while (aiobuf->bufzone.waiting > 0 && aiobuf->inflight < AIO_DEPTH)
 	{
-		const struct aiocb* aiol[1] = { &aiobuf->aios, };
-		rc = aio_suspend (aiol, 1, NULL);
-		if (rc == -1)
+		/* If cursor had wrapped around, queue until the end of the
+		 * bufzone and the rest as the next batch. */
+		size_t nbytes;
+		if (unlikely (aiobuf->bufzone.cur < aiobuf->bufzone.head))
+			nbytes = aiobuf->bufzone.ceil - aiobuf->bufzone.head;
+		else
+			nbytes = aiobuf->bufzone.cur - aiobuf->bufzone.head;
+
+		/* Batches in flight end where this one begins. Bytes of the
+		 * previous segment go to its file first. */
+		int fd = aiobuf->fd;
+		int crcfd = aiobuf->crcfd;
+		size_t offset = aiobuf->size + aiobuf->bufzone.enqueued;
+		if (unlikely (aiobuf->prev.waiting > 0))
+		{
+			if (nbytes > aiobuf->prev.waiting)
+				nbytes = aiobuf->prev.waiting;
+			fd = aiobuf->prev.fd;
+			crcfd = aiobuf->prev.crcfd;
+			offset = aiobuf->prev.end - aiobuf->prev.waiting;
+		}
+		dbg_assert (nbytes > 0);
+		dbg_assert (nbytes <= aiobuf->bufzone.waiting);
+
+#if DEBUG_LEVEL >= VERBOSE
+		{
+			int bin = nbytes * (STAT_NBINS - 1) / aiobuf->bufzone.len;
+			dbg_assert (bin >= 0 && bin < STAT_NBINS);
+			aiobuf->bufzone.st.batches[bin]++;
+		}
+		aiobuf->bufzone.st.prev_waiting = aiobuf->bufzone.waiting;
+		aiobuf->bufzone.st.prev_enqueued = aiobuf->bufzone.enqueued;
+#endif
+
+		/* Extend the file in large steps ahead of writing. */
+		if (fd == aiobuf->fd && offset + nbytes > aiobuf->alloc)
+			s_prealloc_aiobuf (aiobuf,
+				offset + nbytes + PREALLOC_STEP);
+
+		/* The batch is likely still in cache from the copy into the
+		 * bufzone. */
+		if (s_crc_aiobuf (aiobuf, crcfd, offset,
+			aiobuf->bufzone.head, nbytes) == -1)
 			return -1;
-		rc = aio_error (&aiobuf->aios);
+
+		struct aiocb* aios = &aiobuf->aios[
+			(aiobuf->first + aiobuf->inflight) % AIO_DEPTH];
+		aios->aio_fildes = fd;
+		aios->aio_offset = offset;
+		aios->aio_buf = aiobuf->bufzone.head;
+		aios->aio_nbytes = nbytes;
+		do
+		{
+			rc = aio_write (aios);
+		} while (rc == -1 && errno == EAGAIN);
+		if (rc == -1)
+			return -1; /* an error other than EAGAIN */
+
+		aiobuf->inflight++;
+		if (unlikely (aiobuf->prev.waiting > 0))
+			aiobuf->prev.waiting -= nbytes;
+		aiobuf->bufzone.waiting -= nbytes;
+		aiobuf->bufzone.enqueued += nbytes;
+		aiobuf->bufzone.head += nbytes;
+		if (aiobuf->bufzone.head == aiobuf->bufzone.ceil)
+			aiobuf->bufzone.head = aiobuf->bufzone.base;
 	}
 
-	if (rc != 0)
+	if (aiobuf->inflight == 0)
+	{
+		dbg_assert (aiobuf->bufzone.waiting == 0);
+		dbg_assert (aiobuf->bufzone.enqueued == 0);
+		return 0;
+	}
+	return EINPROGRESS;
+}
+
+/*
+ * Appends the checksum of a batch at offset to the sidecar crcfd of
+ * the file it goes to.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_crc_aiobuf (struct s_aiobuf_t* aiobuf, int crcfd, size_t offset,
+	const unsigned char* buf, size_t len)
+{
+	dbg_assert (aiobuf != NULL);
+	dbg_assert (crcfd != -1);
+
+	struct tescap_crc crc = {
+		.offset = offset,
+		.length = len,
+		.crc = tescap_crc32c (0, buf, len),
+	};
+	ssize_t rc = write (crcfd, &crc, TESCAP_CRC_LEN);
+	if (rc != TESCAP_CRC_LEN)
 	{
-		dbg_assert (rc != ECANCELED && rc != EINPROGRESS);
-		errno = rc; /* aio_error does not set it */
+		logmsg (errno, LOG_ERR, "Could not write checksum for %s",
+			aiobuf->dataset);
 		return -1;
 	}
+	return 0;
+}
 
-	/* Check completion status. */
-	ssize_t wrc = aio_return (&aiobuf->aios);
-	if (wrc == -1 && errno == EAGAIN)
+#ifdef COMPACT_FIDX
+/*
+ * Writes v as a varint to buf.
+ * Returns the number of bytes written.
+ */
+static inline size_t
+s_varint (uint8_t* buf, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80)
 	{
-#if DEBUG_LEVEL >= VERBOSE
-		aiobuf->bufzone.st.failed_batches++;
-#endif
-		goto queue_as_is; /* requeue previous batch */
+		buf[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = (uint8_t)v;
+	return n;
+}
+
+/*
+ * Returns the TESCAP_*DAT file a frame of payload type pt goes to.
+ */
+static inline int
+s_ftype_dat (uint8_t pt)
+{
+	switch (pt)
+	{
+		case FTYPE_TICK:
+			return TESCAP_TDAT;
+		case FTYPE_MCA:
+			return TESCAP_MDAT;
+		case FTYPE_BAD:
+			return TESCAP_BDAT;
+		default:
+			return TESCAP_EDAT;
+	}
+}
+
+/*
+ * Encodes the frame index entry as described in tescap.h. A frame
+ * which repeats the previous one (apart from its start, which is as
+ * predicted) only extends the current run; the run is written out
+ * when a different frame comes or by s_cidx_flush.
+ * Returns same as s_try_queue_aiobuf.
+ */
+static int
+s_cidx_queue (struct s_data_t* sjob, const struct s_fidx_t* fidx)
+{
+	dbg_assert (sjob != NULL);
+	dbg_assert (fidx != NULL);
+
+	int dat = s_ftype_dat (fidx->ftype.PT);
+	uint64_t next = sjob->cidx.next[dat];
+	sjob->cidx.next[dat] = fidx->start + fidx->length;
+
+	struct s_fidx_t* prev = &sjob->cidx.prev;
+	if ( likely (sjob->cidx.started) && ! fidx->changed &&
+		fidx->start == next &&
+		fidx->length == prev->length &&
+		fidx->esize == prev->esize &&
+		memcmp (&fidx->ftype, &prev->ftype, 1) == 0 &&
+		sjob->cidx.run < UINT32_MAX )
+	{
+		sjob->cidx.run++;
+		return 0;
+	}
+
+	int rc = s_cidx_flush (sjob);
+	if (rc < 0)
+		return rc;
+
+	uint8_t rec[TESCAP_CIDX_MAXLEN];
+	memcpy (rec, &fidx->ftype, 1);
+	if (fidx->changed)
+		rec[0] |= TESCAP_CIDX_CHANGED;
+	size_t len = 1 + s_varint (rec + 1, fidx->length);
+	if ( ! sjob->cidx.started || fidx->esize != prev->esize )
+	{
+		rec[0] |= TESCAP_CIDX_ESIZE;
+		len += s_varint (rec + len, fidx->esize);
+	}
+	int64_t delta = fidx->start - next;
+	len += s_varint (rec + len, (delta << 1) ^ (delta >> 63));
+	dbg_assert (len <= TESCAP_CIDX_MAXLEN);
+
+	*prev = *fidx;
+	sjob->cidx.started = 1;
+	return s_try_queue_aiobuf (&sjob->aio[DSET_FIDX],
+		(char*)rec, len);
+}
+
+/*
+ * Writes out the current run of repeated frames, if any.
+ * Returns same as s_try_queue_aiobuf.
+ */
+static int
+s_cidx_flush (struct s_data_t* sjob)
+{
+	dbg_assert (sjob != NULL);
+
+	if (sjob->cidx.run == 0)
+		return 0;
+
+	uint8_t rec[TESCAP_CIDX_MAXLEN];
+	rec[0] = TESCAP_CIDX_RUN;
+	size_t len = 1 + s_varint (rec + 1, sjob->cidx.run);
+	sjob->cidx.run = 0;
+	return s_try_queue_aiobuf (&sjob->aio[DSET_FIDX],
+		(char*)rec, len);
+}
+#endif /* COMPACT_FIDX */
+
+/*
+ * Sends the bytes waiting in the bufzone to the streaming client,
+ * as long as it has given credit. The message is a copy, so bytes
+ * are released as soon as they are sent.
+ * If force is true, will wait up to STREAM_TIMEOUT for credit.
+ *
+ * Returns 0 if no bytes are waiting in the bufzone.
+ * Returns EINPROGRESS if bytes are waiting for credit.
+ * Returns -1 on error or if the client has not given credit in time.
+ */
+static int
+s_send_aiobuf (struct s_aiobuf_t* aiobuf, bool force)
+{
+	dbg_assert (aiobuf != NULL);
+	dbg_assert (aiobuf->stream != NULL);
+	dbg_assert (aiobuf->inflight == 0);
+	dbg_assert (aiobuf->bufzone.enqueued == 0);
+
+	struct s_stream_t* stream = aiobuf->stream;
+	while (aiobuf->bufzone.waiting > 0)
+	{
+		if (stream->error)
+			return -1;
+		if (stream->credit == 0)
+		{
+			int rc = s_stream_credit (stream,
+				force ? STREAM_TIMEOUT : 0);
+			if (rc == -1)
+				return -1;
+			if (stream->credit == 0)
+				return EINPROGRESS;
+		}
+
+		/* If cursor had wrapped around, send until the end of the
+		 * bufzone and the rest as the next batch. */
+		size_t nbytes;
+		if (unlikely (aiobuf->bufzone.cur < aiobuf->bufzone.head))
+			nbytes = aiobuf->bufzone.ceil - aiobuf->bufzone.head;
+		else
+			nbytes = aiobuf->bufzone.cur - aiobuf->bufzone.head;
+		dbg_assert (nbytes > 0);
+		dbg_assert (nbytes <= aiobuf->bufzone.waiting);
+
+		int rc = zsock_send (stream->sock, "f" TES_STREAM_REP_PIC,
+			stream->client,
+			TES_STREAM_DATA,
+			TES_CAP_REQ_OK,
+			aiobuf->extension,
+			(uint64_t)aiobuf->size,
+			aiobuf->bufzone.head,
+			nbytes);
+		if (rc == -1)
+			return -1;
+		stream->credit--;
+
+		aiobuf->size += nbytes;
+		aiobuf->bufzone.waiting -= nbytes;
+		aiobuf->bufzone.head += nbytes;
+		if (aiobuf->bufzone.head == aiobuf->bufzone.ceil)
+			aiobuf->bufzone.head = aiobuf->bufzone.base;
+		aiobuf->bufzone.tail = aiobuf->bufzone.head;
 	}
 
-	if (wrc == -1)
-		return -1; /* an error other than EAGAIN */
-	if ((size_t)wrc != aiobuf->bufzone.enqueued)
-	{
-		dbg_assert (aiobuf->bufzone.enqueued > 0);
-#if DEBUG_LEVEL >= VERBOSE
-		aiobuf->bufzone.st.last_written = wrc;
-#endif
-		return -2;
-	}
+	return 0;
+}
 
-	/* ---------------------------------------------------------- */
-prepare_next:
-#if DEBUG_LEVEL >= VERBOSE
+/*
+ * Pops a frame holding an unsigned integer of the given size, as sent
+ * by zsock_send, into val.
+ * Returns 0 on success, -1 if there is no frame or it is of a
+ * different size.
+ */
+static int
+s_pop_uint (zmsg_t* msg, void* val, size_t size)
+{
+	dbg_assert (msg != NULL);
+	dbg_assert (val != NULL);
+
+	zframe_t* frame = zmsg_pop (msg);
+	int rc = -1;
+	if (frame != NULL && zframe_size (frame) == size)
 	{
-		int bin = aiobuf->bufzone.enqueued *
-			(STAT_NBINS - 1) / BUFSIZE;
-		dbg_assert (bin >= 0 && bin < STAT_NBINS);
-		aiobuf->bufzone.st.batches[bin]++;
+		memcpy (val, zframe_data (frame), size);
+		rc = 0;
 	}
-	aiobuf->bufzone.st.prev_waiting = aiobuf->bufzone.waiting;
-	aiobuf->bufzone.st.prev_enqueued = aiobuf->bufzone.enqueued;
-#endif
-
-	/* Increase file size by number of bytes written. */
-	aiobuf->size += aiobuf->bufzone.enqueued;
+	zframe_destroy (&frame);
+	return rc;
+}
 
-	/* Release written bytes by moving the tail. */
-	aiobuf->bufzone.tail += aiobuf->bufzone.enqueued;
-	/* if cursor had wrapped around last time */
-	if (aiobuf->bufzone.tail == aiobuf->bufzone.ceil)
-		aiobuf->bufzone.tail = aiobuf->bufzone.base;
-	dbg_assert (aiobuf->bufzone.tail < aiobuf->bufzone.ceil);
+/*
+ * Reads credit sent by the streaming client. If it has none left,
+ * waits up to timeout ms for more. Requests from other clients are
+ * refused.
+ * Returns 0 on success, -1 on error or if the client has not given
+ * credit in time.
+ */
+static int
+s_stream_credit (struct s_stream_t* stream, int timeout)
+{
+	dbg_assert (stream != NULL);
+	dbg_assert (stream->client != NULL);
 
-	/* If cursor had wrapped around, queue until the end of the
-	 * bufzone. When done, tail will move to ceil, we handle
-	 * this above. */
-	if (unlikely (aiobuf->bufzone.cur < aiobuf->bufzone.tail))
-		aiobuf->bufzone.enqueued = aiobuf->bufzone.ceil
-			- aiobuf->bufzone.tail;
-	else
-		aiobuf->bufzone.enqueued = aiobuf->bufzone.cur
-			- aiobuf->bufzone.tail;
+	zmq_pollitem_t item = {
+		.socket = zsock_resolve (stream->sock),
+		.events = ZMQ_POLLIN,
+	};
+	while (1)
+	{
+		int rc = zmq_poll (&item, 1,
+			(stream->credit > 0) ? 0 : timeout);
+		if (rc == -1)
+			return -1;
+		if (rc == 0)
+			break;
 
-	dbg_assert (aiobuf->bufzone.waiting >= aiobuf->bufzone.enqueued);
-	aiobuf->bufzone.waiting -= aiobuf->bufzone.enqueued;
+		zframe_t* client = NULL;
+		zmsg_t* msg = NULL;
+		rc = zsock_recv (stream->sock, "fm", &client, &msg);
+		if (rc == -1)
+			return -1;
 
-	dbg_assert (aiobuf->bufzone.waiting == 0 || aiobuf->bufzone.tail
-		+ aiobuf->bufzone.enqueued == aiobuf->bufzone.ceil);
+		if (zmsg_size (msg) == 1 && zframe_eq (client, stream->client))
+		{ /* see TES_STREAM_CREDIT_PIC */
+			uint32_t credit = 0;
+			if (s_pop_uint (msg, &credit, sizeof (credit)) == 0 &&
+				credit <= TES_STREAM_MAXCREDIT)
+				stream->credit += credit;
+			if (stream->credit > TES_STREAM_MAXCREDIT)
+				stream->credit = TES_STREAM_MAXCREDIT;
+		}
+		else if (zmsg_size (msg) != 1)
+		{ /* a new request, we are busy */
+			zsock_send (stream->sock, "f" TES_STREAM_REP_PIC,
+				client, TES_STREAM_END, TES_CAP_REQ_EFAIL,
+				"", (uint64_t)0, NULL, (size_t)0);
+		}
+		zframe_destroy (&client);
+		zmsg_destroy (&msg);
+	}
 
-	/* ---------------------------------------------------------- */
-queue_as_is:
-	dbg_assert (aiobuf->bufzone.tail != aiobuf->bufzone.ceil);
-	/* Check if called in vain, should only happen at the end when
-	 * flushing or if we had queued a batch larger than
-	 * BUFSIZE - TESPKT_MTU. */
-	if (aiobuf->bufzone.enqueued == 0)
+	if (stream->credit == 0 && timeout > 0)
 	{
-		dbg_assert (aiobuf->bufzone.waiting == 0);
-		return 0;
+		logmsg (0, LOG_ERR, "Client sent no credit for %d ms",
+			timeout);
+		stream->error = 1;
+		errno = ETIMEDOUT;
+		return -1;
 	}
+	return 0;
+}
 
-	aiobuf->aios.aio_offset = aiobuf->size;
-	aiobuf->aios.aio_buf = aiobuf->bufzone.tail;
-	aiobuf->aios.aio_nbytes = aiobuf->bufzone.enqueued;
-	do
-	{
-		rc = aio_write (&aiobuf->aios);
-	} while (rc == -1 && errno == EAGAIN);
+/*
+ * Sends the statistics to the streaming client as the last message
+ * and resets them.
+ */
+static void
+s_stream_end (struct s_data_t* sjob, uint8_t status)
+{
+	assert (sjob != NULL);
+	assert (sjob->stream.client != NULL);
+
+	int rc = zsock_send (sjob->stream.sock, "f" TES_STREAM_REP_PIC,
+		sjob->stream.client,
+		TES_STREAM_END,
+		status,
+		"",
+		(uint64_t)STAT_LEN,
+		&sjob->st,
+		(size_t)STAT_LEN);
 	if (rc == -1)
-		return -1; /* an error other than EAGAIN */
-	return EINPROGRESS;
+		logmsg (0, LOG_NOTICE, "Could not send stats");
+
+	zframe_destroy (&sjob->stream.client); /* nullifies the pointer */
+	sjob->stream.credit = 0;
+	sjob->stream.error = 0;
+	s_stats_reset (sjob);
 }
 
 /*
@@ -1162,6 +3056,238 @@ s_canonicalize_path (const char* filename,
 	return finalpath;
 }
 
+/*
+ * Allocates disk space for the first len bytes of a stream or index
+ * file. If the filesystem does not support it, it is not tried again
+ * until the file is reopened.
+ */
+static void
+s_prealloc_aiobuf (struct s_aiobuf_t* aiobuf, size_t len)
+{
+	dbg_assert (aiobuf != NULL);
+	dbg_assert (aiobuf->fd != -1);
+
+	if (aiobuf->noalloc || len <= aiobuf->alloc)
+		return;
+
+	int rc = s_fallocate (aiobuf->fd,
+		aiobuf->alloc, len - aiobuf->alloc);
+	if (rc != 0)
+	{
+#if DEBUG_LEVEL >= VERBOSE
+		logmsg (rc, LOG_DEBUG, "Cannot preallocate %lu bytes for %s",
+			len, aiobuf->dataset);
+#endif
+		aiobuf->noalloc = 1;
+		return;
+	}
+	aiobuf->alloc = len;
+}
+
+/*
+ * Allocates disk space for len bytes of a file at offset.
+ * Returns 0 on success, an error number otherwise.
+ */
+static int
+s_fallocate (int fd, size_t offset, size_t len)
+{
+#ifdef linux
+	/* posix_fallocate in glibc falls back to writing zeros. */
+	if (fallocate (fd, 0, offset, len) == -1)
+		return errno;
+	return 0;
+#else
+	return posix_fallocate (fd, offset, len);
+#endif
+}
+
+/*
+ * Estimates the size of a stream or index file at the end of the job,
+ * or segment if splitting the capture, based on the rates in the
+ * previous job. Returns 0 if there was no previous job.
+ */
+static size_t
+s_prealloc_estimate (struct s_data_t* sjob, struct s_aiobuf_t* aiobuf)
+{
+	dbg_assert (sjob != NULL);
+	dbg_assert (aiobuf != NULL);
+
+	/* Job ends when both are reached. */
+	double est = sjob->min_ticks * aiobuf->rate.tick;
+	double est_events = sjob->min_events * aiobuf->rate.event;
+	if (est_events > est)
+		est = est_events;
+
+	if (sjob->seg_ticks > 0 &&
+		sjob->seg_ticks * aiobuf->rate.tick < est)
+		est = sjob->seg_ticks * aiobuf->rate.tick;
+	if (sjob->seg_size > 0 && sjob->seg_size < est)
+		est = sjob->seg_size;
+	if (est > PREALLOC_MAX)
+		est = PREALLOC_MAX;
+
+	return (size_t)est;
+}
+
+/*
+ * Updates the rate at which each stream and index file grew, using
+ * the last segment. Call after flushing and before closing files.
+ */
+static void
+s_update_rates (struct s_data_t* sjob)
+{
+	dbg_assert (sjob != NULL);
+
+	uint64_t ticks = sjob->cur_seg.idx.ticks;
+	uint64_t events = sjob->st.events - sjob->cur_seg.first_event;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
+		if (ticks > 0)
+			aiobuf->rate.tick = (double)aiobuf->size / ticks;
+		if (events > 0)
+			aiobuf->rate.event = (double)aiobuf->size / events;
+	}
+}
+
+/*
+ * Decodes the events in a frame into one array per field and queues
+ * each array to its column file. Ticks and MCA frames are not
+ * recorded, but ticks' time offset is counted towards the time of
+ * the following events. Each field is extracted in its own loop,
+ * branching only once per frame on the event type.
+ * Returns 0 on success or same as s_try_queue_aiobuf on error.
+ */
+static int
+s_decode_events (struct s_data_t* sjob, tespkt* pkt, bool is_tick)
+{
+	dbg_assert (sjob != NULL);
+	dbg_assert ( ! tespkt_is_mca (pkt) );
+
+	/* Time is counted from the first tick. */
+	if (is_tick)
+	{
+		if (sjob->st.frames > 1)
+			sjob->evt_time += tespkt_event_toff (pkt, 0);
+		return 0;
+	}
+
+	bool is_trace = tespkt_is_trace_long (pkt);
+	if (is_trace && ! tespkt_is_header (pkt))
+		return 0;
+
+	uint16_t nevts = tespkt_event_nums (pkt);
+	dbg_assert (nevts <= MAX_FRAME_EVENTS);
+	if (nevts == 0)
+		return 0;
+
+	struct s_cols_t* cols = &sjob->cols;
+	for (uint16_t e = 0; e < nevts; e++)
+	{
+		cols->toff[e] = tespkt_event_toff (pkt, e);
+		cols->ch[e] = tespkt_evt_fl (pkt, e)->CH;
+	}
+	uint64_t time = sjob->evt_time;
+	for (uint16_t e = 0; e < nevts; e++)
+	{
+		time += cols->toff[e];
+		cols->time[e] = time;
+	}
+	sjob->evt_time = time;
+
+	memset (cols->height, 0, nevts * sizeof (cols->height[0]));
+	memset (cols->riset, 0, nevts * sizeof (cols->riset[0]));
+	memset (cols->plen, 0, nevts * sizeof (cols->plen[0]));
+	if (is_trace)
+	{
+		cols->area[0] = tespkt_trace_area (pkt);
+		cols->plen[0] = tespkt_trace_len (pkt);
+	}
+	else if (tespkt_is_peak (pkt))
+	{
+		memset (cols->area, 0, nevts * sizeof (cols->area[0]));
+		for (uint16_t e = 0; e < nevts; e++)
+			cols->height[e] = tespkt_peak_height (pkt, e);
+		for (uint16_t e = 0; e < nevts; e++)
+			cols->riset[e] = tespkt_peak_riset (pkt, e);
+	}
+	else if (tespkt_is_area (pkt))
+	{
+		for (uint16_t e = 0; e < nevts; e++)
+			cols->area[e] = tespkt_event_area (pkt, e);
+	}
+	else if (tespkt_is_pulse (pkt))
+	{
+		for (uint16_t e = 0; e < nevts; e++)
+			cols->area[e] = tespkt_pulse_area (pkt, e);
+		for (uint16_t e = 0; e < nevts; e++)
+			cols->plen[e] = tespkt_pulse_len (pkt, e);
+	}
+	else
+		memset (cols->area, 0, nevts * sizeof (cols->area[0]));
+
+	struct
+	{
+		int dset;
+		void* col;
+		size_t size;
+	} queue[NUM_COLS] = {
+		{ DSET_CCHN, cols->ch,     sizeof (cols->ch[0])     },
+		{ DSET_CTOF, cols->toff,   sizeof (cols->toff[0])   },
+		{ DSET_CTIM, cols->time,   sizeof (cols->time[0])   },
+		{ DSET_CHGT, cols->height, sizeof (cols->height[0]) },
+		{ DSET_CRST, cols->riset,  sizeof (cols->riset[0])  },
+		{ DSET_CARE, cols->area,   sizeof (cols->area[0])   },
+		{ DSET_CPLN, cols->plen,   sizeof (cols->plen[0])   },
+	};
+	for (int c = 0; c < NUM_COLS; c++)
+	{
+		int jobrc = s_try_queue_aiobuf (&sjob->aio[queue[c].dset],
+			(char*)queue[c].col, nevts * queue[c].size);
+		if (jobrc < 0)
+			return jobrc;
+	}
+
+	return 0;
+}
+
+/*
+ * Fills in the tick index for the tick in pkt. Call before its
+ * payload is queued for writing.
+ */
+static void
+s_tidx_start (struct s_data_t* sjob, tespkt* pkt)
+{
+	dbg_assert (sjob != NULL);
+	dbg_assert (tespkt_is_tick (pkt));
+
+	struct tescap_tidx* tidx = &sjob->cur_tick.idx;
+	tidx->ts = tespkt_tick_ts (pkt);
+	tidx->tick_frame = sjob->st.frames - 1 -
+		sjob->cur_seg.idx.first_frame;
+	tidx->start_frame = tidx->tick_frame;
+	tidx->stop_frame = tidx->tick_frame;
+	tidx->reserved = 0;
+
+#ifdef SINGLE_FILE
+	int dats[TESCAP_NDATS] = {
+		DSET_ADAT, DSET_ADAT, DSET_ADAT, DSET_ADAT };
+#else
+	int dats[TESCAP_NDATS] = {
+		[TESCAP_TDAT] = DSET_TDAT,
+		[TESCAP_EDAT] = DSET_EDAT,
+		[TESCAP_MDAT] = DSET_MDAT,
+		[TESCAP_BDAT] = DSET_BDAT,
+	};
+#endif
+	for (int d = 0; d < TESCAP_NDATS; d++)
+	{
+		struct s_aiobuf_t* aiobuf = &sjob->aio[dats[d]];
+		tidx->offsets[d] = aiobuf->size +
+			aiobuf->bufzone.waiting + aiobuf->bufzone.enqueued;
+	}
+}
+
 #if DEBUG_LEVEL >= VERBOSE
 static void
 s_dbg_stats (struct s_data_t* sjob)
@@ -1170,7 +3296,8 @@ s_dbg_stats (struct s_data_t* sjob)
 	{
 		struct s_aiobuf_t* aiobuf = &sjob->aio[s];
 		logmsg (0, LOG_DEBUG, "Dataset %s: ", aiobuf->dataset); 
-		uint64_t batches_tot = 0, steps = BUFSIZE / (STAT_NBINS - 1);
+		uint64_t batches_tot = 0,
+			steps = aiobuf->bufzone.len / (STAT_NBINS - 1);
 		for (int b = 0 ; b < STAT_NBINS ; b++)
 		{
 			logmsg (0, LOG_DEBUG,
@@ -1209,7 +3336,8 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	task_t* self = (task_t*) self_;
 
 	struct s_data_t* sjob = (struct s_data_t*) self->data;
-	dbg_assert ( ! sjob->recording );
+	dbg_assert ( ! sjob->recording || sjob->continuing );
+	uint8_t columns = sjob->columns; /* in case continuing */
 
 	int rc = zsock_recv (frontend, TES_CAP_REQ_PIC,
 		&sjob->basefname,
@@ -1218,7 +3346,13 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 		&sjob->min_events,
 		&sjob->ovrwtmode,
 		&sjob->async,
-		&sjob->capmode);
+		&sjob->capmode,
+		&sjob->h5mode,
+		&sjob->seg_ticks,
+		&sjob->seg_size,
+		&sjob->columns,
+		&sjob->cont,
+		&sjob->start_ts);
 	/* Would also return -1 if picture contained a pointer (p) or a null
 	 * frame (z) but message received did not match this signature; this
 	 * is irrelevant in this case; we don't get interrupted, this should
@@ -1227,9 +3361,20 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 
 	/* Is the request understood? */
 	rc = s_is_req_valid (sjob);
+	if (rc == TES_CAP_REQ_OK && sjob->continuing &&
+		(sjob->nocapture || sjob->columns != columns ||
+		 sjob->start_ts != 0) )
+	{
+		logmsg (0, LOG_INFO, "Only an unscheduled capture with the "
+			"same columns can be requested while continuing the "
+			"previous one");
+		rc = TES_CAP_REQ_EINV;
+	}
 	if (rc != TES_CAP_REQ_OK)
 	{
 		s_send_err (sjob, frontend, rc);
+		if (sjob->continuing)
+			s_cont_resume (sjob, columns);
 		return 0;
 	}
 
@@ -1253,6 +3398,9 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 				sjob->basefname,
 				sjob->measurement,
 				sjob->async ? ". Convering asynchronously" : "");
+		if (sjob->start_ts != 0)
+			logmsg (0, LOG_INFO, "Starting at timestamp %lu",
+				sjob->start_ts);
 	}
 
 	/* Set the filenames and dataset names, will detect if the stats file
@@ -1261,6 +3409,8 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	if (rc != TES_CAP_REQ_OK)
 	{
 		s_send_err (sjob, frontend, rc);
+		if (sjob->continuing)
+			s_cont_resume (sjob, columns);
 		return 0;
 	}
 
@@ -1288,6 +3438,9 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 			return 0;
 		}
 
+		if ( ! sjob->noconvert && s_conv_wait (self) )
+			return 0; /* reply when the conversion is done */
+
 		rc = s_stats_send (sjob, frontend, TES_CAP_REQ_OK);
 		if (rc != TES_CAP_REQ_OK)
 		{
@@ -1307,16 +3460,37 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	mode_t fmode = O_RDWR | O_CREAT;
 	if (sjob->nooverwrite)
 		fmode |= O_EXCL;
+	sjob->fmode = fmode;
 
-	rc = s_open (sjob, fmode);
+	/* A continued capture's files are renamed, the rest is as for
+	 * a new one. */
+	if (sjob->continuing)
+		rc = s_cont_adopt (sjob);
+	else
+		rc = s_open (sjob, fmode);
+	if (rc == TES_CAP_REQ_OK)
+		rc = s_seg_open (sjob);
+	if (rc == TES_CAP_REQ_OK && sjob->cont)
+		rc = s_spare_open (sjob);
 	if (rc != TES_CAP_REQ_OK)
 	{
 		s_send_err (sjob, frontend, rc);
-		s_close (sjob);
+		if (sjob->continuing)
+		{
+			s_seg_unprep (sjob);
+			s_cont_rollback (sjob, NUM_DSETS);
+			s_cont_resume (sjob, columns);
+		}
+		else
+		{
+			s_close (sjob);
+			s_unmap_bufzones (sjob);
+		}
 		return 0;
 	}
 
-	logmsg (0, LOG_INFO, "Opened files '%s.*' for writing",
+	logmsg (0, LOG_INFO, "%s files '%s.*' for writing",
+		sjob->continuing ? "Continuing into" : "Opened",
 		sjob->statfilename);
 
 	/* Unlink stat file to prevent permission errors later when writing */
@@ -1329,11 +3503,32 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 			logmsg (errno, LOG_ERR, "Could not delete stat file");
 			s_send_err (sjob, frontend, TES_CAP_REQ_EFAIL);
 
+			s_spare_close (sjob);
+			if (sjob->continuing)
+			{
+				s_seg_unprep (sjob);
+				s_cont_rollback (sjob, NUM_DSETS);
+				s_cont_resume (sjob, columns);
+				return 0;
+			}
 			s_close (sjob);
+			s_unmap_bufzones (sjob);
+			if (sjob->segfd != -1)
+			{
+				close (sjob->segfd);
+				sjob->segfd = -1;
+			}
 			return 0;
 		}
 	}
 
+	if (sjob->continuing)
+	{ /* task is already active, only disable polling */
+		sjob->continuing = 0;
+		zloop_reader_end (loop, frontend);
+		return 0;
+	}
+
 	/* Disable polling on the frontend until the job is done. Wakeup
 	 * packet handler. */
 	task_activate (self);
@@ -1341,6 +3536,147 @@ task_cap_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	return 0;
 }
 
+/*
+ * Called when a client sends a request on the conversion REP socket.
+ * Sends the progress of the most recent conversion of the given
+ * capture. This frontend is polled even while capturing.
+ */
+int
+task_cap_conv_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	char* basefname = NULL;
+	char* measurement = NULL;
+	int rc = zsock_recv (frontend, TES_CONV_REQ_PIC,
+		&basefname, &measurement);
+	/* Would also return -1 if picture contained a pointer (p) or a null
+	 * frame (z) but message received did not match this signature; this
+	 * is irrelevant in this case; we don't get interrupted, this should
+	 * not happen. */
+	assert (rc != -1);
+
+	struct hdf5_conv_stat_t st = {0};
+	uint8_t status = TES_CONV_REQ_EINV;
+	if (basefname != NULL)
+		status = s_conv_lookup (basefname,
+			(measurement == NULL) ? "" : measurement, &st);
+	else
+		logmsg (0, LOG_INFO, "Received a malformed request");
+
+	zsock_send (frontend, TES_CONV_REP_PIC,
+		status, st.ahead, st.done, st.total);
+
+	zstr_free (&basefname);
+	zstr_free (&measurement);
+	return 0;
+}
+
+/*
+ * Called when a client sends a request on the stream ROUTER socket.
+ * For valid requests, marks the task as active. Frames are then
+ * indexed as for a capture, but sent to the client instead of being
+ * saved.
+ */
+int
+task_cap_stream_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+
+	struct s_data_t* sjob = (struct s_data_t*) self->data;
+	dbg_assert ( ! sjob->recording );
+	dbg_assert (sjob->stream.client == NULL);
+
+	zframe_t* client = NULL;
+	zmsg_t* msg = NULL;
+	int rc = zsock_recv (frontend, "fm", &client, &msg);
+	assert (rc != -1);
+
+	if (zmsg_size (msg) == 1)
+	{ /* credit sent after the end of a stream */
+		zframe_destroy (&client);
+		zmsg_destroy (&msg);
+		return 0;
+	}
+
+	/* Frames are min ticks, min events, columns and credit, see
+	 * TES_STREAM_REQ_PIC. */
+	uint64_t min_ticks = 0, min_events = 0;
+	uint8_t columns = 0;
+	uint32_t credit = 0;
+	rc = s_pop_uint (msg, &min_ticks, sizeof (min_ticks));
+	if (rc == 0)
+		rc = s_pop_uint (msg, &min_events, sizeof (min_events));
+	if (rc == 0)
+		rc = s_pop_uint (msg, &columns, sizeof (columns));
+	if (rc == 0)
+		rc = s_pop_uint (msg, &credit, sizeof (credit));
+	if (rc == 0 && zmsg_size (msg) != 0)
+		rc = -1;
+	zmsg_destroy (&msg);
+
+	if ( rc == -1 || (min_ticks == 0 && min_events == 0) ||
+		credit == 0 )
+	{
+		logmsg (0, LOG_INFO, "Received a malformed request");
+		zsock_send (frontend, "f" TES_STREAM_REP_PIC,
+			client, TES_STREAM_END, TES_CAP_REQ_EINV,
+			"", (uint64_t)0, NULL, (size_t)0);
+		zframe_destroy (&client);
+		return 0;
+	}
+
+	sjob->min_ticks = min_ticks;
+	sjob->min_events = min_events;
+	sjob->columns = (columns != 0);
+	/* if min events was given, min ticks default to 1 */
+	if (sjob->min_events != 0 && sjob->min_ticks == 0)
+		sjob->min_ticks = 1;
+	sjob->ovrwtmode = TES_H5_OVRWT_NONE;
+	sjob->async = 0;
+	sjob->capmode = TES_CAP_CAPONLY;
+	sjob->h5mode = TES_H5_COPY;
+	sjob->seg_ticks = 0;
+	sjob->seg_size = 0;
+	sjob->nocapture = 0;
+	sjob->noconvert = 1;
+	sjob->nooverwrite = 0;
+	sjob->segmented = 0;
+	sjob->cont = 0;
+	sjob->start_ts = 0;
+
+	if (s_map_bufzones (sjob) != TES_CAP_REQ_OK)
+	{
+		zsock_send (frontend, "f" TES_STREAM_REP_PIC,
+			client, TES_STREAM_END, TES_CAP_REQ_EFAIL,
+			"", (uint64_t)0, NULL, (size_t)0);
+		zframe_destroy (&client);
+		return 0;
+	}
+
+	sjob->stream.sock = frontend;
+	sjob->stream.client = client;
+	sjob->stream.credit = credit;
+	if (sjob->stream.credit > TES_STREAM_MAXCREDIT)
+		sjob->stream.credit = TES_STREAM_MAXCREDIT;
+	for (int s = 0; s < NUM_DSETS ; s++)
+	{
+		if (s_dset_enabled (sjob, s))
+			sjob->aio[s].stream = &sjob->stream;
+	}
+
+	logmsg (0, LOG_INFO,
+			"Received request to stream %lu ticks and %lu events",
+			sjob->min_ticks,
+			sjob->min_events);
+
+	/* Disable polling on the frontends until the job is done. Wakeup
+	 * packet handler. */
+	task_activate (self);
+
+	return 0;
+}
+
 /*
  * Saves packet payloads to corresponding file(s) and writes index
  * files.
@@ -1354,7 +3690,8 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	struct s_data_t* sjob = (struct s_data_t*) self->data;
 
 	bool is_tick = tespkt_is_tick (pkt);
-	if ( ! sjob->recording && is_tick )
+	if ( ! sjob->recording && is_tick && ( sjob->start_ts == 0 ||
+			tespkt_tick_ts (pkt) >= sjob->start_ts ) )
 		sjob->recording = 1; /* start the capture */
 
 	if ( ! sjob->recording )
@@ -1389,7 +3726,9 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 
 	/* *************** Update tick and frame indices ***************
 	 * ***************** and choose the data file. ************** */
+#ifndef COMPACT_FIDX
 	struct s_aiobuf_t* aiofidx = &sjob->aio[DSET_FIDX];
+#endif
 #ifdef SINGLE_FILE
 	struct s_aiobuf_t* aiodat = &sjob->aio[DSET_ADAT];
 #else
@@ -1438,15 +3777,30 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 
 		if (sjob->st.ticks > 0)
 		{
-			struct s_tidx_t* tidx = &sjob->cur_tick.idx;
+			struct tescap_tidx* tidx = &sjob->cur_tick.idx;
 			jobrc = s_try_queue_aiobuf (
 				&sjob->aio[DSET_TIDX], (char*)tidx, TIDX_LEN);
 			if (jobrc < 0)
 				finishing = 1; /* error */
 		}
 
+		/* Start a new segment, unless this tick finishes the job. */
+		if ( sjob->segmented && ! finishing &&
+			( sjob->st.ticks + 1 <= sjob->min_ticks ||
+				sjob->st.events < sjob->min_events ) &&
+			s_seg_full (sjob) )
+		{
+			if (s_seg_next (sjob) == -1)
+				goto finish; /* error, files are closed */
+		}
+		else if ( sjob->segmented && ! sjob->seg_ready &&
+			sjob->cur_seg.idx.ticks == 1 )
+		{ /* the tick after the rollover, s_seg_next retries */
+			s_seg_prep (sjob);
+		}
+
 		sjob->cur_tick.nframes = 0;
-		/* no need to zero the index */
+		s_tidx_start (sjob, pkt);
 	}
 	else
 	{
@@ -1454,7 +3808,7 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		aiodat = &sjob->aio[DSET_EDAT];
 #endif
 
-		struct s_tidx_t* tidx = &sjob->cur_tick.idx;
+		struct tescap_tidx* tidx = &sjob->cur_tick.idx;
 		const struct tespkt_event_type* etype = tespkt_etype (pkt);
 		uint8_t pt = linear_etype (etype->PKT, etype->TR);
 		fidx.ftype.PT = pt;
@@ -1466,14 +3820,14 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		sjob->prev_esize = esize;
 		sjob->prev_etype = pt;
 
+		uint64_t cur_frame = sjob->st.frames - 1 -
+			sjob->cur_seg.idx.first_frame;
 		if (sjob->cur_tick.nframes == 0)
 		{ /* first non-tick event frame after a tick */
-			tidx->start_frame = sjob->st.frames - 1;
-		}
-		else
-		{ /* in case it's the last event before a tick */
-			tidx->stop_frame = sjob->st.frames - 1;
+			tidx->start_frame = cur_frame;
 		}
+		/* in case it's the last event before a tick */
+		tidx->stop_frame = cur_frame;
 		sjob->cur_tick.nframes++;
 	}
 
@@ -1632,11 +3986,16 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	else if (is_tick)
 	{ /* tick */
 		sjob->st.ticks++;
+		sjob->cur_seg.idx.ticks++;
 		/* Ticks should be > min_ticks cause we count the
 		 * starting one too. */
 		if (sjob->st.ticks > sjob->min_ticks &&
 			sjob->st.events >= sjob->min_events)
 		{
+			/* Index the last tick too, so that the index covers
+			 * all ticks. */
+			s_try_queue_aiobuf (&sjob->aio[DSET_TIDX],
+				(char*)&sjob->cur_tick.idx, TIDX_LEN);
 			finishing = 1; /* DONE */
 		}
 	}
@@ -1646,6 +4005,14 @@ task_cap_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		sjob->st.events += tespkt_event_nums (pkt);
 	}
 
+	/* ******************** Decode events. ******************** */
+	if (sjob->columns && ! is_mca)
+	{
+		jobrc = s_decode_events (sjob, pkt, is_tick);
+		if (jobrc < 0)
+			finishing = 1; /* error */
+	}
+
 done:
 	/* **************** Write frame payload. **************** */
 	jobrc = s_try_queue_aiobuf (aiodat, datstart, datlen);
@@ -1654,21 +4021,31 @@ done:
 
 	/* ***************** Write frame index. ***************** */
 
+#ifdef COMPACT_FIDX
+	jobrc = s_cidx_queue (sjob, &fidx);
+#else
 	jobrc = s_try_queue_aiobuf (
 		aiofidx, (char*)&fidx, FIDX_LEN);
+#endif
 	if (jobrc < 0)
 		finishing = 1; /* error */
 
-	dbg_assert ( sjob->st.frames * FIDX_LEN ==
-		aiofidx->size +
+#ifndef COMPACT_FIDX
+	dbg_assert ( (sjob->st.frames - sjob->cur_seg.idx.first_frame) *
+		FIDX_LEN == aiofidx->size +
 		aiofidx->bufzone.waiting +
 		aiofidx->bufzone.enqueued );
+#endif
 
 	/* ********************* Check if done. ********************* */
 	if (finishing)
 	{
+finish:
 		/* Flush all buffers. */
 		s_flush (sjob);
+		s_seg_close (sjob,
+			sjob->st.frames - sjob->cur_seg.idx.first_frame);
+		s_update_rates (sjob);
 
 		logmsg (0, LOG_INFO,
 			"Finished writing %lu ticks and %lu events",
@@ -1679,21 +4056,53 @@ done:
 		/* Close stream and index files. */
 		s_close (sjob);
 
+		if (sjob->continuing)
+		{ /* nobody adopted it, or error */
+			logmsg (0, LOG_INFO, "Discarding continued capture");
+			s_cont_stop (self);
+			return TASK_SLEEP;
+		}
+
 		uint8_t status = ( ( sjob->min_ticks > sjob->st.ticks ||
 			 sjob->min_events > sjob->st.events ) ?
 			TES_CAP_REQ_EWRT : TES_CAP_REQ_OK );
 
+		if (sjob->stream.client != NULL)
+		{ /* nothing was saved */
+			s_stream_end (sjob, status);
+			s_unmap_bufzones (sjob);
+			return TASK_SLEEP;
+		}
+
 		/* Write stats regardless of errors. */
 		int rc = s_stats_write (sjob);
 		if (status == TES_CAP_REQ_OK)
 			status = rc;
 
 		/* Convert them to hdf5, only if all is ok until now. */
+		bool waiting = 0;
 		if ( status == TES_CAP_REQ_OK && ! sjob->noconvert )
+		{
 			status = s_conv_data (sjob);
+			if (status == TES_CAP_REQ_OK)
+				waiting = s_conv_wait (self);
+		}
+
+		/* Send reply, unless waiting for the conversion. */
+		if ( ! waiting )
+			s_stats_send (sjob, self->frontends[0].sock, status);
 
-		/* Send reply. */
-		s_stats_send (sjob, self->frontends[0].sock, status);
+		/* Continue into the spare files, starting with this tick,
+		 * as if it was the first one of a new capture. */
+		if ( sjob->cont && status == TES_CAP_REQ_OK && is_tick &&
+			! err && ! waiting &&
+			sjob->aio[DSET_FIDX].spare_fd != -1 )
+		{
+			s_cont_start (self);
+			return task_cap_pkt_hn (loop, pkt, flen, 0, err, self);
+		}
+		s_spare_close (sjob);
+		s_unmap_bufzones (sjob);
 
 		/* Enable polling on the frontend and deactivate packet
 		 * handler. */
@@ -1705,7 +4114,6 @@ done:
 
 /*
  * Perform checks and statically allocate the data struct.
- * mmap data for stream and index files.
  * Returns 0 on success, -1 on error.
  */
 int
@@ -1713,12 +4121,23 @@ task_cap_init (task_t* self)
 {
 	assert (self != NULL);
 	assert (*(DATAROOT + strlen (DATAROOT) - 1) == '/');
+	for (size_t r = 0; r < NUM_ROOTS; r++)
+		assert (*(s_dataroots[r] + strlen (s_dataroots[r]) - 1) == '/');
+	assert (NUM_ROOTS <= UINT8_MAX);
 	assert (sizeof (struct s_stats_t) == STAT_LEN);
 	assert (sizeof (struct s_fidx_t) == FIDX_LEN);
-	assert (sizeof (struct s_tidx_t) == TIDX_LEN);
+	assert (sizeof (struct tescap_tidx) == TIDX_LEN);
 	assert (sizeof (struct s_sidx_t) == SIDX_LEN);
+	assert (sizeof (struct s_seg_t) == SEG_LEN);
 	assert (sizeof (s_dsets) == NUM_DSETS * sizeof (struct s_dset_t));
+#ifdef COMPACT_FIDX
+	assert (memcmp (s_dsets[DSET_FIDX].extension, "cidx", 4) == 0);
+	assert (FTYPE_TICK == TESCAP_FTYPE_TICK);
+	assert (FTYPE_MCA == TESCAP_FTYPE_MCA);
+	assert (FTYPE_BAD == TESCAP_FTYPE_BAD);
+#else
 	assert (memcmp (s_dsets[DSET_FIDX].extension, "fidx", 4) == 0);
+#endif
 	assert (memcmp (s_dsets[DSET_MIDX].extension, "midx", 4) == 0);
 	assert (memcmp (s_dsets[DSET_TIDX].extension, "tidx", 4) == 0);
 	assert (memcmp (s_dsets[DSET_RIDX].extension, "ridx", 4) == 0);
@@ -1730,22 +4149,23 @@ task_cap_init (task_t* self)
 	assert (memcmp (s_dsets[DSET_TDAT].extension, "tdat", 4) == 0);
 	assert (memcmp (s_dsets[DSET_EDAT].extension, "edat", 4) == 0);
 #endif
+	assert (memcmp (s_dsets[DSET_CCHN].extension, "cchn", 4) == 0);
+	assert (memcmp (s_dsets[DSET_CPLN].extension, "cpln", 4) == 0);
 
 	static struct s_data_t sjob;
 	sjob.statfd = -1;
+	sjob.segfd = -1;
 
-	int rc = 0;
 	for (int s = 0; s < NUM_DSETS ; s++)
 	{
-		rc = s_init_aiobuf (&sjob.aio[s]);
-		if (rc != 0)
-			break;
+		sjob.aio[s].dataset = s_dsets[s].dataset;
+		sjob.aio[s].extension = s_dsets[s].extension;
+		s_init_aiobuf (&sjob.aio[s]);
 	}
+
+	int rc = hdf5_conv_queue_start (CONV_NWORKERS, CONV_QLEN);
 	if (rc != 0)
-	{
-		logmsg (errno, LOG_ERR, "Cannot mmap %lu bytes", BUFSIZE);
 		return -1;
-	}
 
 	self->data = &sjob;
 	return 0;
@@ -1766,17 +4186,36 @@ task_cap_fin (task_t* self)
 	assert (sjob != NULL);
 
 	int rc = 0;
-	if (sjob->basefname != NULL)
+	if (sjob->conv_id != 0)
+	{ /* Client is waiting for a conversion. */
+		rc = s_stats_send (
+			sjob, self->frontends[0].sock, TES_CAP_REQ_ECONV);
+	}
+	else if (sjob->continuing)
+	{ /* Nobody has adopted it. */
+		s_cont_stop (self);
+	}
+	else if (sjob->stream.client != NULL)
+	{ /* A stream is in progress. _stream_end nullifies this. */
+		s_flush (sjob);
+		s_close (sjob);
+		s_stream_end (sjob, TES_CAP_REQ_EWRT);
+	}
+	else if (sjob->basefname != NULL)
 	{ /* A job is in progress. _stats_send nullifies this. */
 		s_flush (sjob);
+		s_seg_close (sjob,
+			sjob->st.frames - sjob->cur_seg.idx.first_frame);
 		s_close (sjob);
+		s_spare_close (sjob);
 		rc  = s_stats_write (sjob);
 		rc |= s_stats_send  (
 			sjob, self->frontends[0].sock, TES_CAP_REQ_EWRT);
 	}
 
-	for (int s = 0; s < NUM_DSETS ; s++)
-		s_fin_aiobuf (&sjob->aio[s]);
+	s_unmap_bufzones (sjob);
+
+	hdf5_conv_queue_stop ();
 
 	self->data = NULL;
 	return (rc ? -1 : 0);
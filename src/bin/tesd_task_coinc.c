@@ -0,0 +1,363 @@
+/*
+ * Finds N-fold coincidences between channels in the event stream.
+ *
+ * Event times are reconstructed from the cumulative time offsets, so
+ * events come in time order. The first event of a selected channel
+ * opens a window, the events of other selected channels within the
+ * window are added to it (only the first one of each channel), and
+ * the first event after the window closes it, in constant time per
+ * event. A window with at least nfold channels is a coincidence.
+ *
+ * The task is always active, so that the number of coincidences is
+ * available to the info task. Records of the coincidences are only
+ * built while someone is subscribed to them, and are published in
+ * batches, at each tick or when the message is full.
+ */
+
+#include "tesd_tasks.h"
+
+#define ENDP_REP 0
+#define ENDP_PUB 1
+
+#define CONF_LEN 8
+struct s_conf_t
+{
+	uint32_t window; // in units of 4ns, from the first event
+	uint8_t  mask;   // bit for each channel to look at
+	uint8_t  nfold;  // min number of channels
+	uint16_t : 16;   /* reserved */
+};
+
+struct s_msg_hdr_t
+{
+	uint64_t tick;   // number of ticks since activation
+	uint32_t nrecs;
+	uint32_t : 32;   /* reserved */
+} __attribute__ ((__packed__));
+
+struct s_rec_hdr_t
+{
+	int32_t  time;   // of the first event, since the tick
+	uint8_t  n;      // number of channels
+	uint32_t : 24;   /* reserved */
+} __attribute__ ((__packed__));
+
+struct s_entry_t
+{
+	uint8_t  ch;
+	char     quantity; // topic of the software MCA, or 0
+	uint16_t toff;     // since the first event
+	uint32_t value;
+} __attribute__ ((__packed__));
+
+struct s_msg_t
+{
+	char topic[TES_TOPIC_LEN];
+	struct s_msg_hdr_t hdr;
+	uint8_t recs[TES_COINC_MAXSIZE - TES_COINC_HDR_LEN]
+		__attribute__ ((aligned (4)));
+};
+
+/*
+ * Data for currently built batch and open window.
+ */
+struct s_data_t
+{
+	struct s_conf_t cur_conf; // current configuration
+	struct s_conf_t conf;     // to be applied at next tick
+	struct s_msg_t msg;     // currently built
+	size_t   len;           // of msg, including topic
+	bool     wanted;        // someone is subscribed to the records
+	uint64_t ticks;         // number of ticks so far
+	uint64_t now;           // time of the current event
+	uint64_t tick_time;     // of the last tick
+	uint64_t count;         // of coincidences
+	/* The open window. */
+	bool     open;
+	uint64_t start;         // time of its first event
+	uint8_t  seen;          // bit for each channel in it
+	uint8_t  n;             // number of channels in it
+	struct s_entry_t entries[TES_COINC_MAXCH];
+};
+
+/* Written by the task, read by the info task. */
+static uint64_t s_count;
+
+static int  s_publish (task_t* self);
+static int  s_close (task_t* self);
+static void s_prep_next (task_t* self);
+
+/* -------------------------------------------------------------- */
+/* --------------------------- HELPERS -------------------------- */
+/* -------------------------------------------------------------- */
+
+/*
+ * Publishes the current batch, if it has any records.
+ * Returns 0 on success, TASK_ERROR on error.
+ */
+static int
+s_publish (task_t* self)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	if (data->msg.hdr.nrecs == 0)
+		return 0;
+
+	int rc = zmq_send (
+		zsock_resolve (self->frontends[ENDP_PUB].sock),
+		(void*)&data->msg, data->len, 0);
+	if (rc == -1)
+	{
+		logmsg (errno, LOG_ERR,
+			"Cannot send the coincidences");
+		return TASK_ERROR;
+	}
+
+	data->msg.hdr.nrecs = 0;
+	data->len = TES_TOPIC_LEN + TES_COINC_HDR_LEN;
+	return 0;
+}
+
+/*
+ * Closes the open window, counts it if it is a coincidence and adds
+ * its record to the batch if wanted.
+ * Returns 0 on success, TASK_ERROR on error.
+ */
+static int
+s_close (task_t* self)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	dbg_assert (data->open);
+
+	data->open = 0;
+	if (data->n < data->cur_conf.nfold)
+		return 0;
+
+	data->count++;
+	__atomic_store_n (&s_count, data->count, __ATOMIC_RELAXED);
+	if ( ! data->wanted )
+		return 0;
+
+	size_t reclen = TES_COINC_REC_LEN +
+		data->n * TES_COINC_ENTRY_LEN;
+	if (data->len + reclen > TES_TOPIC_LEN + TES_COINC_MAXSIZE)
+	{
+		int rc = s_publish (self);
+		if (rc != 0)
+			return rc;
+	}
+
+	uint8_t* rec = (uint8_t*)&data->msg + data->len;
+	struct s_rec_hdr_t* hdr = (struct s_rec_hdr_t*) rec;
+	memset (hdr, 0, TES_COINC_REC_LEN);
+	hdr->time = data->start - data->tick_time;
+	hdr->n = data->n;
+	memcpy (hdr + 1, data->entries, data->n * TES_COINC_ENTRY_LEN);
+	data->len += reclen;
+	data->msg.hdr.nrecs++;
+	return 0;
+}
+
+/*
+ * Called at each tick and on activation.
+ */
+static void
+s_prep_next (task_t* self)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	dbg_assert (data->msg.hdr.nrecs == 0);
+
+	memcpy (&data->cur_conf, &data->conf, CONF_LEN);
+	data->msg.hdr.tick = data->ticks;
+	data->len = TES_TOPIC_LEN + TES_COINC_HDR_LEN;
+	data->wanted = (task_endp_nsubs (&self->frontends[ENDP_PUB],
+		data->msg.topic) > 0);
+	data->tick_time = data->now;
+}
+
+/* -------------------------------------------------------------- */
+/* ----------------------------- API ---------------------------- */
+/* -------------------------------------------------------------- */
+
+uint64_t
+task_coinc_count (void)
+{
+	return __atomic_load_n (&s_count, __ATOMIC_RELAXED);
+}
+
+int
+task_coinc_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+
+	struct s_conf_t conf = {0};
+	int rc = zsock_recv (frontend, TES_COINC_REQ_PIC,
+		&conf.mask, &conf.nfold, &conf.window);
+	/* Would also return -1 if picture contained a pointer (p) or a null
+	 * frame (z) but message received did not match this signature; this
+	 * is irrelevant in this case; we don't get interrupted, this should
+	 * not happen. */
+	assert (rc != -1);
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	if (conf.window == 0 || conf.window > TES_COINC_MAXWINDOW ||
+		conf.nfold < 2 ||
+		conf.nfold > __builtin_popcount (conf.mask))
+	{
+		logmsg (0, LOG_DEBUG,
+			"Not changing configuration");
+	}
+	else
+	{
+		logmsg (0, LOG_INFO,
+			"Looking for %hhu-fold coincidences between channels "
+			"0x%02hhx within %u",
+			conf.nfold, conf.mask, conf.window);
+
+		data->conf = conf;
+	}
+
+	zsock_send (frontend, TES_COINC_REP_PIC,
+		data->conf.mask, data->conf.nfold, data->conf.window);
+
+	return 0;
+}
+
+/*
+ * Each event's time is the previous one's plus its time offset.
+ */
+int
+task_coinc_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
+		uint16_t missed, int err, task_t* self)
+{
+	dbg_assert (self != NULL);
+
+	if (err || ! tespkt_is_event (pkt))
+		return 0;
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	bool is_tick = tespkt_is_tick (pkt);
+	bool is_trace = tespkt_is_trace_long (pkt);
+	if ( is_trace && ! tespkt_is_header (pkt) )
+		return 0; /* non-header frame from multi-stream */
+
+	char q = 0;
+	if (tespkt_is_peak (pkt))
+		q = TES_TOPIC_SMCA_HEIGHT;
+	else if (tespkt_is_area (pkt))
+		q = TES_TOPIC_SMCA_AREA;
+	else if (tespkt_is_pulse (pkt) || is_trace)
+		q = TES_TOPIC_SMCA_PULSE;
+
+	for (int e = 0; e < tespkt_event_nums (pkt); e++)
+	{
+		if (is_tick || is_trace)
+			dbg_assert (e == 0);
+		data->now += tespkt_event_toff (pkt, e);
+
+		int rc = 0;
+		if (data->open &&
+			data->now - data->start > data->cur_conf.window)
+			rc = s_close (self);
+		if (rc == 0 && is_tick)
+		{
+			data->ticks++;
+			rc = s_publish (self);
+			s_prep_next (self);
+		}
+		if (rc != 0)
+			return rc;
+		if (is_tick)
+			continue;
+
+		uint8_t ch = tespkt_evt_fl (pkt, e)->CH;
+		uint8_t bit = (1 << ch);
+		if ( ! (data->cur_conf.mask & bit) )
+			continue;
+
+		if ( ! data->open )
+		{
+			data->open = 1;
+			data->start = data->now;
+			data->seen = 0;
+			data->n = 0;
+		}
+		if (data->seen & bit)
+			continue; /* only the first one of each channel */
+		data->seen |= bit;
+
+		struct s_entry_t* entry = &data->entries[data->n++];
+		entry->ch = ch;
+		entry->quantity = q;
+		entry->toff = data->now - data->start;
+		if (q == TES_TOPIC_SMCA_HEIGHT)
+			entry->value = tespkt_peak_height (pkt, e);
+		else if (q == TES_TOPIC_SMCA_AREA)
+			entry->value = tespkt_event_area (pkt, e);
+		else if (is_trace)
+			entry->value = tespkt_trace_area (pkt);
+		else if (q == TES_TOPIC_SMCA_PULSE)
+			entry->value = tespkt_pulse_area (pkt, e);
+		else
+			entry->value = 0;
+	}
+
+	return 0;
+}
+
+int
+task_coinc_init (task_t* self)
+{
+	assert (self != NULL);
+	assert (TES_NCHANNELS <= TES_COINC_MAXCH);
+	assert (sizeof (struct s_conf_t) == CONF_LEN);
+	assert (sizeof (struct s_msg_hdr_t) == TES_COINC_HDR_LEN);
+	assert (sizeof (struct s_rec_hdr_t) == TES_COINC_REC_LEN);
+	assert (sizeof (struct s_entry_t) == TES_COINC_ENTRY_LEN);
+	assert (offsetof (struct s_msg_t, hdr) == TES_TOPIC_LEN);
+	assert (TES_COINC_HDR_LEN + TES_COINC_REC_LEN +
+		TES_COINC_MAXCH*TES_COINC_ENTRY_LEN <= TES_COINC_MAXSIZE);
+	assert (self->frontends[ENDP_REP].type == ZMQ_REP);
+	assert (self->frontends[ENDP_PUB].type == ZMQ_XPUB);
+
+	static struct s_data_t data;
+
+	/* Some defaults: 2-fold within 100ns. */
+	data.conf.window = 25;
+	data.conf.mask = (1 << TES_NCHANNELS) - 1;
+	data.conf.nfold = 2;
+
+	data.msg.topic[0] = TES_TOPIC_COINC;
+	data.msg.topic[1] = TES_TOPIC_RAW;
+	data.msg.topic[2] = TES_TOPIC_ALLCH;
+
+	self->data = &data;
+	return 0;
+}
+
+int
+task_coinc_wakeup (task_t* self)
+{
+	assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	data->open = 0;
+	data->msg.hdr.nrecs = 0;
+	s_prep_next (self);
+	return 0;
+}
+
+int
+task_coinc_fin (task_t* self)
+{
+	assert (self != NULL);
+
+	self->data = NULL;
+	return 0;
+}
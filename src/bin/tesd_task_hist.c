@@ -1,4 +1,56 @@
 #include "tesd_tasks.h"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define ENDP_PUB     0
+#define ENDP_ACC_REP 1
+
+/* Histograms are assembled into a buffer from a pool and published
+ * without copying. The buffer is returned to the pool when ZMQ is
+ * done sending it (from the I/O thread) and when it is no longer
+ * the last one, so assembly continues while slow subscribers are
+ * still being sent previous ones. Keep the high water mark below the
+ * number of buffers, so that ZMQ drops histograms for a subscriber
+ * which falls behind, rather than holding on to all of them. */
+#define NUM_BUFS 8
+#define SNDHWM   4
+
+struct s_buf_t
+{
+	uint32_t      refs; // 0 if free, atomic
+	char          topic[TES_TOPIC_LEN];
+	unsigned char data[TES_HIST_MAXSIZE];
+};
+
+/* Sums of histograms are published, if anyone is subscribed to
+ * them, every nhists histograms or every window ms, whichever is
+ * configured. A sum is restarted if the binning changes. */
+#define ACC_CONF_LEN 16
+struct s_acc_conf_t
+{
+	uint64_t window; // in ms, if nhists is 0
+	uint32_t nhists;
+	uint32_t : 32;   // reserved
+};
+
+struct s_acc_t
+{
+	uint64_t : 64;              // so that bins are aligned
+	uint32_t : 32;
+	char     topic[TES_TOPIC_LEN];
+	uint64_t nhists;            // number summed so far
+	struct tespkt_mca_hdr hdr;  // of first, total and stop time
+	                            // updated for each
+	uint64_t bins[TES_HIST_ACC_MAXBINS];
+} __attribute__ ((aligned (16)));
+
+/* Histograms are also published, if anyone is subscribed to them,
+ * encoded as runs of non-zero bins, and as runs of non-zero
+ * differences from the previous histogram. Every ENC_KEYFRAMES-th of
+ * the latter, and any for which the binning changed, is a keyframe,
+ * encoded as the former. */
+#define ENC_KEYFRAMES 16
 
 /*
  * Data for currently built histogram.
@@ -14,20 +66,71 @@ struct s_data_t
 #ifndef TES_MCASIZE_BUG
 	uint16_t      size;      // size of histogram including header
 	uint16_t      cur_size;  // number of received bytes so far
+	uint16_t      last_size; // size of last published, 0 if none
 #else
 	uint32_t      size;      // size of histogram including header
 	uint32_t      cur_size;  // number of received bytes so far
+	uint32_t      last_size; // size of last published, 0 if none
 #endif
 	bool          discard;   // discard all frames until next header
-	unsigned char buf[TES_HIST_MAXSIZE];
+	struct s_buf_t* buf;     // being assembled, NULL if none free
+	struct s_buf_t* last;    // last published, for new subscribers
+	struct s_buf_t  bufs[NUM_BUFS];
+	struct
+	{
+		struct s_acc_conf_t cur_conf; // for the current sum
+		struct s_acc_conf_t conf;     // to be applied at next sum
+		int64_t  start;   // zclock_mono at first histogram
+		uint16_t nbins;   // in the current sum
+		uint16_t last_nbins; // in last, 0 if none
+		struct s_acc_t* cur;  // one of sums
+		struct s_acc_t* last; // the other, last published
+		struct s_acc_t  sums[2];
+	} acc;
+	struct
+	{
+		uint32_t seq;       // of last encoded
+		uint16_t since_key; // encoded since last keyframe
+		unsigned char msg[TES_TOPIC_LEN + TES_HIST_ENC_MAXSIZE];
+	} enc;
 };
 
 static void s_clear (struct s_data_t* hist);
+static void s_acc_bins (uint64_t* restrict sum,
+	const unsigned char* restrict bins, uint16_t nbins);
+static int  s_acc_add (struct s_data_t* hist, zsock_t* sock,
+	const unsigned char* data, size_t len);
+static size_t s_enc (struct s_data_t* hist, char encoding,
+	const unsigned char* data, size_t len,
+	const unsigned char* prev);
+static int  s_enc_send (struct s_data_t* hist, zsock_t* sock,
+	const unsigned char* data, size_t len,
+	const unsigned char* prev, size_t prev_len,
+	bool sparse, bool delta, bool replay);
+static bool s_matches (const char* topic,
+	const char* prefix, size_t len);
+static struct s_buf_t* s_buf_get (struct s_data_t* hist);
+static void s_buf_put (void* data, void* buf_);
+static int  s_buf_send (zsock_t* sock, struct s_buf_t* buf,
+	size_t len);
+static int  s_buf_replay (zsock_t* sock, struct s_buf_t* buf,
+	size_t len);
 
 /* -------------------------------------------------------------- */
 /* --------------------------- HELPERS -------------------------- */
 /* -------------------------------------------------------------- */
 
+/*
+ * Returns true if a subscription to prefix gets topic.
+ */
+static bool
+s_matches (const char* topic, const char* prefix, size_t len)
+{
+	if (len > TES_TOPIC_LEN)
+		len = TES_TOPIC_LEN;
+	return (memcmp (topic, prefix, len) == 0);
+}
+
 static void
 s_clear (struct s_data_t* hist)
 {
@@ -40,10 +143,389 @@ s_clear (struct s_data_t* hist)
 	hist->discard = 0;
 }
 
+/*
+ * Takes a free buffer from the pool, with one reference.
+ * Returns NULL if all are in use.
+ */
+static struct s_buf_t*
+s_buf_get (struct s_data_t* hist)
+{
+	dbg_assert (hist != NULL);
+
+	for (int b = 0; b < NUM_BUFS; b++)
+	{
+		struct s_buf_t* buf = &hist->bufs[b];
+		uint32_t free = 0;
+		if (__atomic_compare_exchange_n (&buf->refs, &free, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return buf;
+	}
+	return NULL;
+}
+
+/*
+ * Drops a reference to a buffer. Has the signature of zmq_free_fn,
+ * since it is also called by ZMQ when done with a message.
+ */
+static void
+s_buf_put (void* data, void* buf_)
+{
+	struct s_buf_t* buf = (struct s_buf_t*) buf_;
+	if (buf == NULL)
+		return;
+
+	dbg_assert (__atomic_load_n (&buf->refs, __ATOMIC_RELAXED) > 0);
+	__atomic_sub_fetch (&buf->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Adds nbins 32-bit bins to 64-bit sums. bins need not be aligned.
+ */
+static void
+s_acc_bins (uint64_t* restrict sum, const unsigned char* restrict bins,
+	uint16_t nbins)
+{
+	dbg_assert (sum != NULL);
+	dbg_assert (bins != NULL);
+
+	uint16_t b = 0;
+#ifdef __SSE2__
+	/* Widen four bins at a time by interleaving with zeros. */
+	dbg_assert (((uintptr_t)sum & 15) == 0);
+	const __m128i zero = _mm_setzero_si128 ();
+	for (; b + 4 <= nbins; b += 4)
+	{
+		__m128i v = _mm_loadu_si128 (
+			(const __m128i*)(bins + b*TESPKT_MCA_BIN_LEN));
+		__m128i* s = (__m128i*)(sum + b);
+		s[0] = _mm_add_epi64 (s[0], _mm_unpacklo_epi32 (v, zero));
+		s[1] = _mm_add_epi64 (s[1], _mm_unpackhi_epi32 (v, zero));
+	}
+#endif
+	for (; b < nbins; b++)
+	{
+		uint32_t v;
+		memcpy (&v, bins + b*TESPKT_MCA_BIN_LEN, sizeof (v));
+		sum[b] += v;
+	}
+}
+
+/*
+ * Adds a complete histogram to the current sum and publishes the
+ * sum if it is done.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_acc_add (struct s_data_t* hist, zsock_t* sock,
+	const unsigned char* data, size_t len)
+{
+	dbg_assert (hist != NULL);
+	dbg_assert (len >= TESPKT_MCA_HDR_LEN);
+
+	const struct tespkt_mca_hdr* hdr =
+		(const struct tespkt_mca_hdr*) data;
+	uint16_t nbins = (len - TESPKT_MCA_HDR_LEN) / TESPKT_MCA_BIN_LEN;
+	dbg_assert (nbins <= TES_HIST_ACC_MAXBINS);
+	struct s_acc_t* sum = hist->acc.cur;
+
+	if ( sum->nhists > 0 && ( nbins != hist->acc.nbins ||
+		hdr->lowest_value != sum->hdr.lowest_value ||
+		memcmp (&hdr->flags, &sum->hdr.flags,
+			sizeof (hdr->flags)) != 0 ) )
+	{
+		logmsg (0, LOG_INFO, "Binning changed, restarting sum");
+		sum->nhists = 0;
+	}
+
+	if (sum->nhists == 0)
+	{
+		hist->acc.cur_conf = hist->acc.conf;
+		hist->acc.start = zclock_mono ();
+		hist->acc.nbins = nbins;
+		sum->topic[0] = TES_TOPIC_MCA_SUM;
+		sum->topic[1] = TES_TOPIC_RAW;
+		sum->topic[2] = hdr->flags.C;
+		sum->topic[3] = 0;
+		sum->hdr = *hdr;
+		memset (sum->bins, 0, nbins * sizeof (uint64_t));
+	}
+	else
+	{
+		sum->hdr.total += hdr->total;
+		sum->hdr.stop_time = hdr->stop_time;
+	}
+	s_acc_bins (sum->bins, data + TESPKT_MCA_HDR_LEN, nbins);
+	sum->nhists++;
+
+	const struct s_acc_conf_t* conf = &hist->acc.cur_conf;
+	if ( conf->nhists > 0 ? sum->nhists < conf->nhists :
+		(uint64_t)(zclock_mono () - hist->acc.start) < conf->window )
+		return 0;
+
+	int rc = zmq_send (zsock_resolve (sock), sum->topic,
+		TES_TOPIC_LEN + TES_HIST_ACC_HDR_LEN +
+		nbins * sizeof (uint64_t), 0);
+	if (rc == -1)
+		return -1;
+
+	hist->acc.cur = hist->acc.last;
+	hist->acc.last = sum;
+	hist->acc.last_nbins = nbins;
+	hist->acc.cur->nhists = 0;
+	return 0;
+}
+
+/*
+ * Encodes a histogram into hist->enc.msg, under the topic for the
+ * given encoding, as runs of non-zero bins, or of non-zero
+ * differences from the bins of prev if it is not NULL. Isolated
+ * zeros are included in a run, since they cost as much as starting
+ * a new one.
+ * Returns the length of the message.
+ */
+static size_t
+s_enc (struct s_data_t* hist, char encoding,
+	const unsigned char* data, size_t len,
+	const unsigned char* prev)
+{
+	dbg_assert (hist != NULL);
+	dbg_assert (len >= TESPKT_MCA_HDR_LEN);
+
+	uint16_t nbins = (len - TESPKT_MCA_HDR_LEN) / TESPKT_MCA_BIN_LEN;
+	dbg_assert (nbins <= TES_HIST_ACC_MAXBINS);
+	const unsigned char* bins = data + TESPKT_MCA_HDR_LEN;
+	if (prev != NULL)
+		prev += TESPKT_MCA_HDR_LEN;
+
+	const struct tespkt_mca_hdr* hdr =
+		(const struct tespkt_mca_hdr*) data;
+	unsigned char* msg = hist->enc.msg;
+	msg[0] = TES_TOPIC_MCA;
+	msg[1] = encoding;
+	msg[2] = hdr->flags.C;
+	msg[3] = 0;
+	msg += TES_TOPIC_LEN;
+	msg[0] = (prev == NULL); /* keyframe */
+	msg[1] = 0;
+	memcpy (msg + 2, &nbins, 2);
+	memcpy (msg + 4, &hist->enc.seq, 4);
+	memcpy (msg + 8, data, TESPKT_MCA_HDR_LEN);
+	unsigned char* cur = msg + TES_HIST_ENC_HDR_LEN;
+
+	/* Bins are written as they are read. A run is closed, and its
+	 * header written, at the second zero after it. */
+	uint16_t first = 0;
+	uint16_t end = 0;    /* one past last non-zero in run */
+	unsigned char* run = NULL;
+	for (uint16_t b = 0; b < nbins; b++)
+	{
+		uint32_t v, p = 0;
+		memcpy (&v, bins + b*TESPKT_MCA_BIN_LEN, sizeof (v));
+		if (prev != NULL)
+			memcpy (&p, prev + b*TESPKT_MCA_BIN_LEN, sizeof (p));
+		v -= p;
+
+		if (v == 0)
+		{
+			if (run != NULL && b - end == 1)
+			{ /* close it */
+				uint16_t n = end - first;
+				memcpy (run, &first, 2);
+				memcpy (run + 2, &n, 2);
+				cur = run + TES_HIST_ENC_RUN_LEN +
+					n*TESPKT_MCA_BIN_LEN;
+				run = NULL;
+			}
+			else if (run != NULL)
+			{
+				memcpy (cur, &v, sizeof (v));
+				cur += sizeof (v);
+			}
+			continue;
+		}
+
+		if (run == NULL)
+		{
+			run = cur;
+			first = b;
+			cur += TES_HIST_ENC_RUN_LEN;
+		}
+		memcpy (cur, &v, sizeof (v));
+		cur += sizeof (v);
+		end = b + 1;
+	}
+	if (run != NULL)
+	{
+		uint16_t n = end - first;
+		memcpy (run, &first, 2);
+		memcpy (run + 2, &n, 2);
+		cur = run + TES_HIST_ENC_RUN_LEN + n*TESPKT_MCA_BIN_LEN;
+	}
+
+	dbg_assert ((size_t)(cur - msg) <= TES_HIST_ENC_MAXSIZE);
+	return cur - hist->enc.msg;
+}
+
+/*
+ * Publishes a histogram sparse encoded, and/or delta encoded against
+ * prev, which is the previous one, or NULL if there is none. Marks
+ * the messages as replays if replay is true.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_enc_send (struct s_data_t* hist, zsock_t* sock,
+	const unsigned char* data, size_t len,
+	const unsigned char* prev, size_t prev_len,
+	bool sparse, bool delta, bool replay)
+{
+	dbg_assert (hist != NULL);
+
+	const struct tespkt_mca_hdr* hdr =
+		(const struct tespkt_mca_hdr*) data;
+	const struct tespkt_mca_hdr* prev_hdr =
+		(const struct tespkt_mca_hdr*) prev;
+	bool key = ( prev == NULL || prev_len != len ||
+		hist->enc.since_key == 0 ||
+		hist->enc.since_key >= ENC_KEYFRAMES ||
+		hdr->lowest_value != prev_hdr->lowest_value ||
+		memcmp (&hdr->flags, &prev_hdr->flags,
+			sizeof (hdr->flags)) != 0 );
+
+	size_t mlen = 0;
+	if (sparse)
+	{
+		mlen = s_enc (hist, TES_TOPIC_SPARSE, data, len, NULL);
+		if (replay)
+			hist->enc.msg[3] = TES_TOPIC_REPLAY;
+		int rc = zmq_send (zsock_resolve (sock),
+			hist->enc.msg, mlen, 0);
+		if (rc == -1)
+			return -1;
+	}
+
+	if ( ! delta )
+		return 0;
+
+	/* A keyframe is the same as the sparse one. */
+	if (key && sparse)
+		hist->enc.msg[1] = TES_TOPIC_DELTA;
+	else
+		mlen = s_enc (hist, TES_TOPIC_DELTA, data, len,
+			(key ? NULL : prev));
+	if (replay)
+		hist->enc.msg[3] = TES_TOPIC_REPLAY;
+	int rc = zmq_send (zsock_resolve (sock), hist->enc.msg, mlen, 0);
+	if (rc == -1)
+		return -1;
+
+	hist->enc.since_key = (key ? 1 : hist->enc.since_key + 1);
+	return 0;
+}
+
+/*
+ * Publishes the topic and the first len bytes of a buffer without
+ * copying them.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_buf_send (zsock_t* sock, struct s_buf_t* buf, size_t len)
+{
+	dbg_assert (buf != NULL);
+
+	zmq_msg_t msg;
+	__atomic_add_fetch (&buf->refs, 1, __ATOMIC_RELAXED);
+	int rc = zmq_msg_init_data (&msg, buf->topic,
+		TES_TOPIC_LEN + len, s_buf_put, buf);
+	if (rc == -1)
+	{
+		s_buf_put (NULL, buf);
+		return -1;
+	}
+	rc = zmq_msg_send (&msg, zsock_resolve (sock), 0);
+	if (rc == -1)
+	{
+		zmq_msg_close (&msg); /* calls s_buf_put */
+		return -1;
+	}
+	dbg_assert ((size_t)rc == TES_TOPIC_LEN + len);
+	return 0;
+}
+
+/*
+ * Publishes a copy of the topic and the first len bytes of a buffer,
+ * marked as a replay. The buffer is left as it is, since it may still
+ * be queued for sending.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+s_buf_replay (zsock_t* sock, struct s_buf_t* buf, size_t len)
+{
+	dbg_assert (buf != NULL);
+
+	zmq_msg_t msg;
+	int rc = zmq_msg_init_size (&msg, TES_TOPIC_LEN + len);
+	if (rc == -1)
+		return -1;
+	char* data = (char*) zmq_msg_data (&msg);
+	memcpy (data, buf->topic, TES_TOPIC_LEN + len);
+	data[3] = TES_TOPIC_REPLAY;
+	rc = zmq_msg_send (&msg, zsock_resolve (sock), 0);
+	if (rc == -1)
+	{
+		zmq_msg_close (&msg);
+		return -1;
+	}
+	return 0;
+}
+
 /* -------------------------------------------------------------- */
 /* ----------------------------- API ---------------------------- */
 /* -------------------------------------------------------------- */
 
+/*
+ * Sets how many histograms or over how long to sum them. Exactly one
+ * of the two must be non-zero, otherwise the configuration is not
+ * changed. Replies with the configuration.
+ */
+int
+task_hist_acc_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+
+	uint32_t nhists;
+	uint64_t window;
+	int rc = zsock_recv (frontend, TES_HIST_ACC_REQ_PIC,
+		&nhists, &window);
+	/* We don't get interrupted, this should not happen. */
+	assert (rc != -1);
+
+	struct s_data_t* hist = (struct s_data_t*) self->data;
+	if ( (nhists == 0) == (window == 0) )
+	{
+		logmsg (0, LOG_DEBUG,
+			"Not changing configuration");
+	}
+	else
+	{
+		if (nhists > 0)
+			logmsg (0, LOG_INFO,
+				"Summing every %u histograms", nhists);
+		else
+			logmsg (0, LOG_INFO,
+				"Summing histograms every %lu ms", window);
+
+		hist->acc.conf.nhists = nhists;
+		hist->acc.conf.window = window;
+	}
+
+	zsock_send (frontend, TES_HIST_ACC_REP_PIC,
+		hist->acc.conf.nhists, hist->acc.conf.window);
+
+	return 0;
+}
+
 /*
  * Accumulates MCA frames and sends them out as soon as the last one
  * is received. It aborts the whole histogram if an MCA frame is
@@ -108,6 +590,16 @@ task_hist_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		dbg_assert (hist->cur_size == 0);
 		dbg_assert ( ! hist->discard );
 
+		if (hist->buf == NULL)
+			hist->buf = s_buf_get (hist);
+		if (hist->buf == NULL)
+		{
+			logmsg (0, LOG_WARNING,
+				"All histogram buffers are in use");
+			hist->discard = 1;
+			return 0;
+		}
+
 		/* Inspect header */
 		hist->nbins = tespkt_mca_nbins_tot (pkt);
 		hist->size  = tespkt_mca_size (pkt);
@@ -127,7 +619,7 @@ task_hist_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	/* Copy frame, check current size. */
 	uint16_t paylen = flen - TESPKT_HDR_LEN;
 	dbg_assert (hist->cur_size <= TES_HIST_MAXSIZE - paylen);
-	memcpy (hist->buf + hist->cur_size,
+	memcpy (hist->buf->data + hist->cur_size,
 		(char*)pkt + TESPKT_HDR_LEN, paylen);
 
 	hist->cur_size += paylen;
@@ -136,10 +628,19 @@ task_hist_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	{
 		dbg_assert (hist->cur_size == hist->size);
 
-		/* Send the histogram */
-		int rc = zmq_send (
-			zsock_resolve (self->frontends[0].sock),
-			hist->buf, hist->cur_size, 0);
+		/* Publish what anyone is subscribed to. */
+		zsock_t* pub = self->frontends[ENDP_PUB].sock;
+		const struct tespkt_mca_hdr* hdr =
+			(const struct tespkt_mca_hdr*) hist->buf->data;
+		char* topic = hist->buf->topic;
+		topic[0] = TES_TOPIC_MCA;
+		topic[1] = TES_TOPIC_RAW;
+		topic[2] = hdr->flags.C;
+		topic[3] = 0;
+
+		int rc = 0;
+		if (task_endp_nsubs (&self->frontends[ENDP_PUB], topic) > 0)
+			rc = s_buf_send (pub, hist->buf, hist->cur_size);
 		if (rc == -1)
 		{
 			logmsg (errno, LOG_ERR,
@@ -148,17 +649,66 @@ task_hist_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		}
 
 #if DEBUG_LEVEL >= VERBOSE
-		if ((unsigned int)rc != hist->cur_size)
-			logmsg (errno, LOG_ERR,
-				"Histogram is %lu bytes long, sent %u",
-				hist->cur_size, rc);
-
 		hist->published++;
 		if (hist->published % 50)
 			logmsg (0, LOG_DEBUG,
 				"Published 50 more histogtams");
 #endif
 
+		/* Sum it, unless nobody wants the sums. Then start afresh
+		 * when someone does. */
+		char sum_topic[TES_TOPIC_LEN] = {
+			TES_TOPIC_MCA_SUM, TES_TOPIC_RAW, topic[2], 0};
+		if (task_endp_nsubs (&self->frontends[ENDP_PUB],
+			sum_topic) > 0)
+		{
+			rc = s_acc_add (hist, pub,
+				hist->buf->data, hist->cur_size);
+			if (rc == -1)
+			{
+				logmsg (errno, LOG_ERR,
+					"Cannot send the sum of histograms");
+				return TASK_ERROR;
+			}
+		}
+		else
+		{
+			hist->acc.cur->nhists = 0;
+			hist->acc.last_nbins = 0;
+		}
+
+		/* Encode it against the last one, if anyone wants it. A
+		 * subscriber to deltas needs a keyframe when it starts. */
+		char enc_topic[TES_TOPIC_LEN] = {
+			TES_TOPIC_MCA, TES_TOPIC_SPARSE, topic[2], 0};
+		bool sparse = (task_endp_nsubs (
+			&self->frontends[ENDP_PUB], enc_topic) > 0);
+		enc_topic[1] = TES_TOPIC_DELTA;
+		bool delta = (task_endp_nsubs (
+			&self->frontends[ENDP_PUB], enc_topic) > 0);
+		if (sparse || delta)
+		{
+			hist->enc.seq++;
+			rc = s_enc_send (hist, pub,
+				hist->buf->data, hist->cur_size,
+				(hist->last == NULL ? NULL : hist->last->data),
+				hist->last_size, sparse, delta, 0);
+			if (rc == -1)
+			{
+				logmsg (errno, LOG_ERR,
+					"Cannot send the encoded histogram");
+				return TASK_ERROR;
+			}
+		}
+		if ( ! delta )
+			hist->enc.since_key = 0;
+
+		/* Our reference is now held by last. Assembly continues in
+		 * the next buffer while this one is sent. */
+		s_buf_put (NULL, hist->last);
+		hist->last = hist->buf;
+		hist->last_size = hist->cur_size;
+		hist->buf = s_buf_get (hist);
 		s_clear (hist);
 		return 0;
 	}
@@ -171,9 +721,32 @@ int
 task_hist_init (task_t* self)
 {
 	assert (self != NULL);
+	assert (sizeof (struct s_acc_conf_t) == ACC_CONF_LEN);
+	assert (offsetof (struct s_acc_t, bins) -
+		offsetof (struct s_acc_t, nhists) == TES_HIST_ACC_HDR_LEN);
+	assert (offsetof (struct s_acc_t, nhists) -
+		offsetof (struct s_acc_t, topic) == TES_TOPIC_LEN);
+	assert (offsetof (struct s_buf_t, data) -
+		offsetof (struct s_buf_t, topic) == TES_TOPIC_LEN);
+	assert (self->frontends[ENDP_PUB].type == ZMQ_XPUB);
+	assert (self->frontends[ENDP_ACC_REP].type == ZMQ_REP);
 
+	/* Buffers may be released by ZMQ after we are done, so they
+	 * must outlive the task. */
 	static struct s_data_t hist;
 	hist.discard = 1;
+	hist.acc.cur = &hist.acc.sums[0];
+	hist.acc.last = &hist.acc.sums[1];
+
+	/* Some defaults. */
+	hist.acc.conf.nhists = 10;
+
+	int hwm = SNDHWM;
+	int rc = zmq_setsockopt (
+		zsock_resolve (self->frontends[ENDP_PUB].sock),
+		ZMQ_SNDHWM, &hwm, sizeof (hwm));
+	if (rc == -1)
+		return -1;
 
 	self->data = &hist;
 	return 0;
@@ -187,6 +760,67 @@ task_hist_wakeup (task_t* self)
 
 	s_clear (hist);
 	hist->discard = 1;
+	/* Nothing was collected while sleeping, it is outdated. */
+	s_buf_put (NULL, hist->last);
+	hist->last = NULL;
+	hist->last_size = 0;
+	hist->acc.cur->nhists = 0;
+	hist->acc.last_nbins = 0;
+	hist->enc.since_key = 0;
+	return 0;
+}
+
+/*
+ * Re-publishes the last histogram, sum or encoded histogram, those
+ * of them the subscription is to, so that a new subscriber need not
+ * wait for the next one. Existing subscribers get them again, marked
+ * as replays so they can drop them. Encoded ones are sent as
+ * keyframes, which the following delta applies to.
+ */
+int
+task_hist_sub (task_t* self, task_endp_t* frontend,
+	const char* prefix, size_t len)
+{
+	assert (self != NULL);
+	struct s_data_t* hist = (struct s_data_t*) self->data;
+
+	int rc = 0;
+	if (hist->last != NULL &&
+		s_matches (hist->last->topic, prefix, len))
+		rc = s_buf_replay (frontend->sock,
+			hist->last, hist->last_size);
+
+	if (rc == 0 && hist->acc.last_nbins > 0 &&
+		s_matches (hist->acc.last->topic, prefix, len))
+	{
+		/* zmq_send copies it, so it can be reset right after. */
+		hist->acc.last->topic[3] = TES_TOPIC_REPLAY;
+		rc = zmq_send (zsock_resolve (frontend->sock),
+			hist->acc.last->topic, TES_TOPIC_LEN +
+			TES_HIST_ACC_HDR_LEN +
+			hist->acc.last_nbins * sizeof (uint64_t), 0);
+		hist->acc.last->topic[3] = 0;
+	}
+
+	if (rc == 0 && hist->last != NULL)
+	{
+		char topic[TES_TOPIC_LEN] = {TES_TOPIC_MCA,
+			TES_TOPIC_SPARSE, hist->last->topic[2], 0};
+		bool sparse = s_matches (topic, prefix, len);
+		topic[1] = TES_TOPIC_DELTA;
+		bool delta = s_matches (topic, prefix, len);
+		if (sparse || delta)
+			rc = s_enc_send (hist, frontend->sock,
+				hist->last->data, hist->last_size, NULL, 0,
+				sparse, delta, 1);
+	}
+
+	if (rc == -1)
+	{
+		logmsg (errno, LOG_ERR,
+			"Cannot send the histogram");
+		return TASK_ERROR;
+	}
 	return 0;
 }
 
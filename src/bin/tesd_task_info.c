@@ -20,6 +20,7 @@ struct s_data_t
 	uint64_t mcas;
 	uint64_t traces;
 	uint64_t events;
+	uint64_t coincs; // coincidence count at the start
 };
 
 static zloop_timer_fn  s_timeout_hn;
@@ -39,6 +40,7 @@ s_timeout_hn (zloop_t* loop, int timer_id, void* self_)
 
 	task_t* self = (task_t*) self_;
 	struct s_data_t* info = (struct s_data_t*) self->data;
+	uint64_t coincs = task_coinc_count () - info->coincs;
 
 	/* Enable polling on the frontend and deactivate packet
 	 * handler. */
@@ -51,14 +53,17 @@ s_timeout_hn (zloop_t* loop, int timer_id, void* self_)
 		"%lu bad, "
 		"%lu ticks, "
 		"%lu mcas, "
-		"%lu traces"
-		"%lu other events",
+		"%lu traces, "
+		"%lu other events, "
+		"%lu coincidences",
 		info->received,
 		info->missed,
 		info->bad,
 		info->ticks,
 		info->mcas,
-		info->traces);
+		info->traces,
+		info->events,
+		coincs);
 	zsock_send (self->frontends[0].sock, TES_INFO_REP_PIC,
 		TES_INFO_REQ_OK,
 		info->received,
@@ -67,7 +72,8 @@ s_timeout_hn (zloop_t* loop, int timer_id, void* self_)
 		info->ticks,
 		info->mcas,
 		info->traces,
-		info->events);
+		info->events,
+		coincs);
 
 	memset (info, 0, sizeof (struct s_data_t));
 
@@ -100,7 +106,7 @@ task_info_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 		logmsg (0, LOG_INFO,
 			"Received a malformed request");
 		zsock_send (frontend, TES_INFO_REP_PIC,
-			TES_INFO_REQ_EINV, 0, 0, 0, 0, 0);
+			TES_INFO_REQ_EINV, 0, 0, 0, 0, 0, 0, 0, 0);
 		return 0;
 	}
 
@@ -117,6 +123,10 @@ task_info_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 		return TASK_ERROR;
 	}
 
+	/* Coincidences are counted by their own task. */
+	struct s_data_t* info = (struct s_data_t*) self->data;
+	info->coincs = task_coinc_count ();
+
 	/* Disable polling on the frontend until the job is done. Wakeup
 	 * packet handler. */
 	task_activate (self);
@@ -1,60 +1,70 @@
 /*
  * TO DO:
- *  - cache histograms so subsequent subscribers can get the last
- *    completed one.
  *  - determine number of channels at startup by querying the register
  *    server
  */
 
 #include "tesd_tasks.h"
 
-/* Need to keep track of all non-ref frames between two neighbouring
- * reference frames. */
-#define MAX_SIMULT_POINTS 16
+/* Event times are reconstructed from the cumulative time offsets.
+ * Each event from a channel which is paired with a reference channel
+ * is kept until it is resolved against the previous and next events
+ * of each of its reference channels, at the latest when the next one
+ * arrives. Delays saturate at DELAY_MAX, so an event is resolved as
+ * soon as the delay since it reaches the delay since the previous
+ * reference (which is then the smaller one), and no event is pending
+ * for longer than DELAY_MAX. Events are queued once for all reference
+ * channels, each of which has its own head in the queue. Each event
+ * is thus queued once and resolved once per reference channel, and
+ * MAX_PENDING only needs to hold the events of DELAY_MAX, which is
+ * all of them unless many have a zero time offset. */
+#define DELAY_MAX   UINT16_MAX
+#define MAX_PENDING 65536 // power of 2
 #define ENDP_REP 0
 #define ENDP_PUB 1
 
-/* Add to delay, so bin 0 is underflow and middle bin is 0 delay. */
-#define BIN_OFFSET 511
-
-#define CONF_LEN 16
+#define CONF_LEN 24
 struct s_conf_t
 {
-	uint64_t ticks;  // publish and reset after that many
-	uint8_t  ref_ch; // reference channel
+	uint64_t ticks;     // publish and reset after that many
+	uint64_t pairs;     // TES_JITTER_PAIR bits of histograms
+	uint16_t nbins;     // including under-/overflow
+	uint8_t  shift;     // log2 of bin width in units of 4ns
+	uint8_t  nchannels; // pairs are between the first nchannels
+	uint32_t : 32;      /* reserved */
 };
 
 struct s_point_t
 {
-	/* Even though each frame's delay saturates at UINT16_MAX, we allow
-	 * for larger accumulated delay, so we select the correct overflow bin
-	 * (positive vs negative) more often. */
-	uint16_t delay_since; // delay since last reference
-	uint16_t delay_until; // delay until next reference
-	int      hid;         // histogram (0 to TES_JITTER_NHISTS-1)
+	uint64_t time;  // of the event
+	uint8_t  ch;    // channel of the event
 };
 
 struct s_hist_hdr_t
 {
-	uint64_t : 48; /* reserved */
-	uint8_t ref_ch;
-	uint8_t nhists;
+	uint16_t nbins;
+	uint8_t  shift;
+	uint8_t  nchannels;
+	uint32_t : 24; /* reserved */
+	uint8_t  nhists;
 } __attribute__ ((__packed__));
 
-struct s_subhist_t
+struct s_subhist_hdr_t
 {
-	struct
-	{
-		uint64_t : 56; /* reserved */
-		uint8_t ch;
-	} hdr;
-	uint32_t bins[TES_JITTER_NBINS];
-};
+	uint64_t : 48; /* reserved */
+	uint8_t ref_ch;
+	uint8_t ch;
+} __attribute__ ((__packed__));
 
-struct s_hist_t
+/* The histograms are between channels, they are published as one
+ * under the topic for all channels. Each of the hdr.nhists
+ * histograms is a s_subhist_hdr_t followed by hdr.nbins bins. */
+struct s_msg_t
 {
+	char topic[TES_TOPIC_LEN];
 	struct s_hist_hdr_t hdr;
-	struct s_subhist_t hists[TES_JITTER_NHISTS];
+	uint8_t hists[TES_JITTER_MAXSIZE - TES_JITTER_HDR_LEN]
+		__attribute__ ((aligned (4)));
 };
 
 /*
@@ -68,79 +78,129 @@ struct s_data_t
 	uint64_t published;    // number of published histograms
 	uint64_t dropped;      // number of aborted histograms
 #endif
-	struct s_hist_t hist;
+	struct s_msg_t msg;    // currently built
+	struct s_msg_t last;   // last published, for new subscribers
+	size_t   len;          // of msg, including topic
+	size_t   last_len;     // of last
+	bool     has_last;     // last is valid
 	uint64_t ticks;        // number of ticks so far
-	struct s_point_t points[MAX_SIMULT_POINTS];
-	uint8_t  cur_npts;     // no. of non-ref frames since last ref + 1
+	uint64_t now;          // time of the current event
 	bool     publishing;   // discard all frames until first tick
+	/* For the current configuration. */
+	uint32_t* bins[TES_JITTER_MAXHISTS];
+	int8_t   hids[TES_JITTER_MAXCH][TES_JITTER_MAXCH]; // or -1
+	bool     is_ref[TES_JITTER_MAXCH];    // of any pair
+	bool     is_target[TES_JITTER_MAXCH]; // of any pair
+	uint8_t  refs[TES_JITTER_MAXCH];
+	uint8_t  nrefs;
+	int      bin_offset;   // bin of 0 delay
+	/* For each reference channel. */
+	uint64_t ref_time[TES_JITTER_MAXCH]; // of the last event
+	bool     has_ref[TES_JITTER_MAXCH];  // ref_time is valid
+	uint32_t head[TES_JITTER_MAXCH];     // of pending, oldest
+	uint32_t tail;         // of pending, one past newest
+	struct s_point_t pending[MAX_PENDING];
 };
 
-static inline void s_add_to_since (struct s_point_t* pt, uint16_t delay);
-static inline void s_add_to_until (struct s_point_t* pt, uint16_t delay);
-static inline void s_save_points (struct s_data_t* data);
+static uint64_t s_all_pairs (uint8_t nchannels);
+static inline void s_add_point (struct s_data_t* data,
+	int hid, uint32_t delay, bool until);
+static inline void s_resolve (struct s_data_t* data,
+	uint8_t ref_ch, bool at_ref);
 static void s_prep_next (struct s_data_t* data);
 
 /* -------------------------------------------------------------- */
 /* --------------------------- HELPERS -------------------------- */
 /* -------------------------------------------------------------- */
 
-static inline void
-s_add_to_since (struct s_point_t* pt, uint16_t delay)
-{
-		if (pt->delay_since + delay > UINT16_MAX)
-			pt->delay_since = UINT16_MAX;
-		else
-			pt->delay_since += delay;
-}
-
-static inline void
-s_add_to_until (struct s_point_t* pt, uint16_t delay)
+/*
+ * Returns the pairs mask of all pairs of different channels among the
+ * first nchannels.
+ */
+static uint64_t
+s_all_pairs (uint8_t nchannels)
 {
-		if (pt->delay_until + delay > UINT16_MAX)
-			pt->delay_until = UINT16_MAX;
-		else
-			pt->delay_until += delay;
+	dbg_assert (nchannels <= TES_JITTER_MAXCH);
+
+	uint64_t pairs = 0;
+	for (uint8_t ref_ch = 0; ref_ch < nchannels; ref_ch++)
+		for (uint8_t ch = 0; ch < nchannels; ch++)
+			if (ch != ref_ch)
+				pairs |= TES_JITTER_PAIR (ref_ch, ch);
+	return pairs;
 }
 
 /*
- * Called on a reference frame.
+ * Adds a point at delay, which is until the reference if until is
+ * true, since it otherwise.
  */
 static inline void
-s_save_points (struct s_data_t* data)
+s_add_point (struct s_data_t* data, int hid, uint32_t delay,
+	bool until)
 {
 	dbg_assert (data != NULL);
-
-	for (uint8_t p = 0; p < data->cur_npts - 1; p++)
-	{
-		struct s_point_t* pt = &data->points[p];
-		int bin = pt->delay_since;
-		if (bin > pt->delay_until)
-			bin = - (int)pt->delay_until;
+	dbg_assert (hid < TES_JITTER_MAXHISTS);
+	dbg_assert (hid >= 0);
 
 #if DEBUG_LEVEL >= ARE_YOU_NUTS
-		logmsg (0, LOG_DEBUG, "Added a point at %d", bin);
+	logmsg (0, LOG_DEBUG, "Added a point at %s%u",
+		until ? "-" : "", delay);
 #endif
 
-		bin += BIN_OFFSET;
-		if (bin < 0)
-			bin = 0;
-		else if (bin >= TES_JITTER_NBINS)
-			bin = TES_JITTER_NBINS - 1;
-		
-		dbg_assert (pt->hid < TES_JITTER_NHISTS);
-		dbg_assert (pt->hid >= 0);
-		struct s_subhist_t* hist = &data->hist.hists[pt->hid];
-		hist->bins[bin]++;
+	/* Bin k holds delays from k to k+1 bin widths. */
+	int bin = data->bin_offset;
+	if (until)
+		bin -= (delay + (1 << data->cur_conf.shift) - 1) >>
+			data->cur_conf.shift;
+	else
+		bin += delay >> data->cur_conf.shift;
+	if (bin < 0)
+		bin = 0;
+	else if (bin >= data->cur_conf.nbins)
+		bin = data->cur_conf.nbins - 1;
+
+	uint32_t* bins = data->bins[hid];
+	bins[bin]++;
 #if DEBUG_LEVEL >= VERBOSE
-		if (data->hist.hists[pt->hid].bins[bin] == 0)
-			logmsg (0, LOG_WARNING, "Overflow of bin %hd", bin);
+	if (bins[bin] == 0)
+		logmsg (0, LOG_WARNING, "Overflow of bin %hd", bin);
 #endif
+}
+
+/*
+ * Resolves pending points against reference channel ref_ch, oldest
+ * first, for which the delay since its last event is no greater than
+ * the delay until its next, or, if at_ref is true, all of them, the
+ * current event being its next.
+ */
+static inline void
+s_resolve (struct s_data_t* data, uint8_t ref_ch, bool at_ref)
+{
+	dbg_assert (data != NULL);
+	dbg_assert (data->has_ref[ref_ch]);
+
+	for (; data->head[ref_ch] != data->tail; data->head[ref_ch]++)
+	{
+		struct s_point_t* pt = &data->pending[
+			data->head[ref_ch] & (MAX_PENDING - 1)];
+		int hid = data->hids[ref_ch][pt->ch];
+		if (hid == -1)
+			continue; /* not paired with this one */
+
+		uint64_t since = pt->time - data->ref_time[ref_ch];
+		uint64_t until = data->now - pt->time;
+		if (since > DELAY_MAX)
+			since = DELAY_MAX;
+		if (until > DELAY_MAX)
+			until = DELAY_MAX;
+
+		if (since <= until)
+			s_add_point (data, hid, since, 0);
+		else if (at_ref)
+			s_add_point (data, hid, until, 1);
+		else
+			break; /* so are the rest, they are later */
 	}
-	/* Start accumulating delay for next non-reference frame. */
-	data->points[0].delay_since = 0;
-	data->points[0].delay_until = 0;
-	data->points[0].hid = -1;
-	data->cur_npts = 1;
 }
 
 /*
@@ -151,30 +211,60 @@ s_prep_next (struct s_data_t* data)
 {
 	dbg_assert (data != NULL);
 
+	bool changed = (memcmp (&data->cur_conf, &data->conf,
+		CONF_LEN) != 0);
 	memcpy (&data->cur_conf, &data->conf, CONF_LEN);
-	memset (&data->hist, 0, sizeof (data->hist));
-	data->hist.hdr.ref_ch = data->conf.ref_ch;
-	data->hist.hdr.nhists = TES_JITTER_NHISTS;
-	for (int h = 0, ch = 0; h < TES_JITTER_NHISTS; h++, ch++)
+	struct s_conf_t* conf = &data->cur_conf;
+
+	data->msg.hdr.nbins = conf->nbins;
+	data->msg.hdr.shift = conf->shift;
+	data->msg.hdr.nchannels = conf->nchannels;
+	data->bin_offset = conf->nbins / 2;
+
+	/* Histograms are ordered by reference channel, then channel. */
+	size_t sublen = TES_JITTER_SUBHDR_LEN + 4*conf->nbins;
+	uint8_t* subhist = data->msg.hists;
+	uint8_t nhists = 0;
+	data->nrefs = 0;
+	memset (data->is_target, 0, sizeof (data->is_target));
+	for (uint8_t ref_ch = 0; ref_ch < TES_JITTER_MAXCH; ref_ch++)
 	{
-		if (ch == data->conf.ref_ch)
-			ch++;
-		data->hist.hists[h].hdr.ch = ch;
+		data->is_ref[ref_ch] = 0;
+		for (uint8_t ch = 0; ch < TES_JITTER_MAXCH; ch++)
+		{
+			data->hids[ref_ch][ch] = -1;
+			if ( ! (conf->pairs & TES_JITTER_PAIR (ref_ch, ch)) )
+				continue;
+
+			struct s_subhist_hdr_t* hdr =
+				(struct s_subhist_hdr_t*) subhist;
+			memset (subhist, 0, sublen);
+			hdr->ref_ch = ref_ch;
+			hdr->ch = ch;
+			data->bins[nhists] = (uint32_t*)(hdr + 1);
+			data->hids[ref_ch][ch] = nhists++;
+			data->is_ref[ref_ch] = 1;
+			data->is_target[ch] = 1;
+			subhist += sublen;
+		}
+		if (data->is_ref[ref_ch])
+			data->refs[data->nrefs++] = ref_ch;
+	}
+	data->msg.hdr.nhists = nhists;
+	data->len = subhist - (uint8_t*)&data->msg;
+	dbg_assert (data->len <= TES_TOPIC_LEN + TES_JITTER_MAXSIZE);
+
+	if (changed)
+	{ /* pending points are for other histograms */
+		memset (data->has_ref, 0, sizeof (data->has_ref));
+		for (uint8_t ref_ch = 0; ref_ch < TES_JITTER_MAXCH; ref_ch++)
+			data->head[ref_ch] = data->tail;
 	}
-	/* No need to zero data->points, each new point when first added is
-	 * set to the greatest dealy. */
+
+	/* Pending points go to the next histogram. */
 	data->ticks = 0;
 	if (data->publishing)
-	{
-		dbg_assert (data->cur_npts > 0);
-		/* Last entry in hist->points is now first in the queue. */
-		data->points[0] = data->points[data->cur_npts - 1];
-		dbg_assert(data->points[0].hid == -1);
-		data->cur_npts = 1;
 		data->ticks = 1;
-	}
-	else
-		dbg_assert (data->cur_npts == 0);
 }
 
 /* -------------------------------------------------------------- */
@@ -188,10 +278,10 @@ task_jitter_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 
 	task_t* self = (task_t*) self_;
 
-	uint8_t ref_ch;
-	uint64_t ticks;
+	struct s_conf_t conf = {0};
 	int rc = zsock_recv (frontend, TES_JITTER_REQ_PIC,
-		&ref_ch, &ticks);
+		&conf.nchannels, &conf.pairs, &conf.ticks,
+		&conf.nbins, &conf.shift);
 	/* Would also return -1 if picture contained a pointer (p) or a null
 	 * frame (z) but message received did not match this signature; this
 	 * is irrelevant in this case; we don't get interrupted, this should
@@ -199,7 +289,18 @@ task_jitter_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	assert (rc != -1);
 
 	struct s_data_t* data = (struct s_data_t*) self->data;
-	if (ticks == 0 || ref_ch > TES_JITTER_NHISTS)
+	uint64_t all_pairs = 0;
+	if (conf.nchannels <= TES_JITTER_MAXCH)
+		all_pairs = s_all_pairs (conf.nchannels);
+	if (conf.pairs == 0)
+		conf.pairs = all_pairs;
+
+	if (conf.ticks == 0 || conf.nchannels < 2 ||
+		conf.nchannels > TES_JITTER_MAXCH ||
+		(conf.pairs & ~all_pairs) ||
+		conf.nbins < TES_JITTER_MINBINS ||
+		conf.nbins > TES_JITTER_MAXBINS ||
+		conf.shift > TES_JITTER_MAXSHIFT)
 	{
 		logmsg (0, LOG_DEBUG,
 			"Not changing configuration");
@@ -207,38 +308,33 @@ task_jitter_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
 	else
 	{
 		logmsg (0, LOG_INFO,
-			"Using channel %u as reference, publishing each %lu ticks",
-			ref_ch, ticks);
+			"Using pairs 0x%016lx of %hhu channels, %hu bins of "
+			"width %u, publishing each %lu ticks",
+			conf.pairs, conf.nchannels, conf.nbins,
+			1U << conf.shift, conf.ticks);
 
-		data->conf.ref_ch = ref_ch;
-		data->conf.ticks = ticks;
+		data->conf = conf;
 	}
 
 	zsock_send (frontend, TES_JITTER_REP_PIC,
-		data->conf.ref_ch, data->conf.ticks);
+		data->conf.nchannels, data->conf.pairs, data->conf.ticks,
+		data->conf.nbins, data->conf.shift);
 
 	return 0;
 }
 
 /*
- * Reference frames are non-tick frames from the reference channel.
- *
- * At any time the number of currently tracked points is number of
- * non-reference frames since last reference frame + 1 (the last point
- * accumulating delays for the would-be-next non-reference point).
- *
- * Any frame adds its delay to the delay_until of all but the last
- * currently tracked points.
+ * Reference frames are non-tick frames from a reference channel of
+ * any histogram.
  *
- * In addition to that:
- *  - If the frame is a reference frame, it saves all but the last
- *    tracked points to the histogram and resets them.
- *  - If the frame is a non-reference frame its delay is added to the
- *    delay_since of the last point (would-be-next non-reference point).
- *    In addition to that:
- *     - If the non-reference frame is not a tick, a new point in the
- *       tracked list is added with the delay_since of the last one, and
- *       the delay_until of 0. It is the new would-be-next point.
+ * Each event's time is the previous one's plus its time offset. A
+ * non-tick event from a channel which is paired with a reference
+ * channel is queued. On each event, queued ones which are now known
+ * to be closer to the previous event of a reference channel than to
+ * its next are saved to the histogram with the delay since the
+ * previous, and on an event of the reference channel all the rest
+ * with the delay until it. Events before the first one of a reference
+ * channel are skipped for it.
  */
 int
 task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
@@ -248,7 +344,6 @@ task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 
 	struct s_data_t* data = (struct s_data_t*) self->data;
 	dbg_assert (data->cur_conf.ticks > 0);
-	dbg_assert (data->cur_npts < MAX_SIMULT_POINTS);
 
 	bool is_tick = tespkt_is_tick (pkt);
 	if ( ! data->publishing && is_tick )
@@ -268,62 +363,51 @@ task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	{
 		if (is_tick || is_trace)
 			dbg_assert (e == 0);
-		uint16_t delay = tespkt_event_toff (pkt, e);
+		data->now += tespkt_event_toff (pkt, e);
 		struct tespkt_event_flags* ef = tespkt_evt_fl (pkt, e);
-		bool is_ref = (ef->CH == data->cur_conf.ref_ch && ! is_tick);
-		bool make_new = ( ! is_ref && ! is_tick );
-
-		if ( ! is_ref && data->cur_npts == 0)
-			return 0; /* waiting for first ref since wake-up */
-
-		for (uint8_t p = 0; p < data->cur_npts - 1; p++)
-			s_add_to_until (&data->points[p], delay);
-
-		/* Do this before printing debug info. */
-		if ( ! is_ref )
-			s_add_to_since (&data->points[data->cur_npts - 1], delay);
+		uint8_t ch = ef->CH;
 
 #if DEBUG_LEVEL >= ARE_YOU_NUTS
-		logmsg (0, LOG_DEBUG, "Channel %hhu frame%s, delay is %hu",
-			ef->CH, is_tick ? " (tick)" : "       ", delay);
-		for (uint8_t p = 0; p < data->cur_npts; p++)
-			logmsg (0, LOG_DEBUG, "Point %hhu delays: %hu, %hu",
-				p, data->points[p].delay_since,
-				data->points[p].delay_until);
+		logmsg (0, LOG_DEBUG, "Channel %hhu frame%s, time is %lu",
+			ch, is_tick ? " (tick)" : "       ", data->now);
 #endif
 
-		if (is_ref)
-			s_save_points (data);
-		// else
-		//	 s_add_to_since (&data->points[data->cur_npts - 1], delay);
-
-		dbg_assert (data->cur_npts > 0);
-		if (make_new)
+		for (uint8_t r = 0; r < data->nrefs; r++)
 		{
-			dbg_assert (ef->CH != data->cur_conf.ref_ch);
-			if (data->cur_npts < MAX_SIMULT_POINTS - 1)
-			{
-				struct s_point_t* new_entry = &data->points[data->cur_npts-1];
-				int hid = ef->CH;
-				if (ef->CH > data->cur_conf.ref_ch)
-					hid--;
-				new_entry->hid = hid;
-
-				struct s_point_t* new_ghost = new_entry + 1;
-				/* Last non-reference has the greatest delay_since,
-				 * use it as a start. */
-				new_ghost->delay_since = new_entry->delay_since;
-				new_ghost->delay_until = 0;
-				new_ghost->hid = -1;
-				data->cur_npts++;
-			}
-#if DEBUG_LEVEL >= VERBOSE
+			uint8_t ref_ch = data->refs[r];
+			if (data->has_ref[ref_ch])
+				s_resolve (data, ref_ch,
+					(ch == ref_ch && ! is_tick));
 			else
+				data->head[ref_ch] = data->tail;
+		}
+
+		if (is_tick)
+			continue;
+
+		if (data->is_ref[ch])
+		{
+			data->ref_time[ch] = data->now;
+			data->has_ref[ch] = 1;
+		}
+
+		if (data->is_target[ch])
+		{
+			for (uint8_t r = 0; r < data->nrefs; r++)
 			{
-				logmsg (0, LOG_WARNING,
-					"Too many non-reference frames since last reference");
+				uint8_t ref_ch = data->refs[r];
+				if (data->tail - data->head[ref_ch] == MAX_PENDING)
+				{ /* only with many simultaneous events */
+					logmsg (0, LOG_DEBUG,
+						"Too many pending points, dropping oldest");
+					data->head[ref_ch]++;
+				}
 			}
-#endif
+			struct s_point_t* pt =
+				&data->pending[data->tail & (MAX_PENDING - 1)];
+			pt->time = data->now;
+			pt->ch = ch;
+			data->tail++;
 		}
 	}
 
@@ -331,7 +415,7 @@ task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 	{ /* publish histogram */
 		int rc = zmq_send (
 			zsock_resolve (self->frontends[ENDP_PUB].sock),
-			(void*)&data->hist, TES_JITTER_SIZE, 0);
+			(void*)&data->msg, data->len, 0);
 		if (rc == -1)
 		{
 			logmsg (errno, LOG_ERR,
@@ -340,10 +424,10 @@ task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 		}
 
 #if DEBUG_LEVEL >= VERBOSE
-		if ((unsigned int)rc != TES_JITTER_SIZE)
+		if ((unsigned int)rc != data->len)
 			logmsg (errno, LOG_ERR,
 				"Histogram is %lu bytes long, sent %u",
-				TES_JITTER_SIZE, rc);
+				data->len, rc);
 
 		data->published++;
 		if (data->published % 50)
@@ -351,6 +435,9 @@ task_jitter_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
 				"Published 50 more histogtams");
 #endif
 
+		memcpy (&data->last, &data->msg, data->len);
+		data->last_len = data->len;
+		data->has_last = 1;
 		s_prep_next (data);
 	}
 
@@ -362,20 +449,31 @@ int
 task_jitter_init (task_t* self)
 {
 	assert (self != NULL);
-	assert (TES_JITTER_NHISTS == TES_NCHANNELS - 1);
+	assert (TES_NCHANNELS <= TES_JITTER_MAXCH);
+	assert (TES_JITTER_MAXHISTS <= INT8_MAX);
+	assert (TES_JITTER_MAXCH*TES_JITTER_MAXCH <= 64);
 	assert (sizeof (struct s_hist_hdr_t) == TES_JITTER_HDR_LEN);
-	assert (sizeof (struct s_hist_t) == TES_JITTER_SIZE);
-	assert (sizeof (struct s_subhist_t) == TES_JITTER_SUBSIZE);
+	assert (sizeof (struct s_subhist_hdr_t) == TES_JITTER_SUBHDR_LEN);
+	assert (offsetof (struct s_msg_t, hdr) == TES_TOPIC_LEN);
+	assert (offsetof (struct s_msg_t, hists) ==
+		TES_TOPIC_LEN + TES_JITTER_HDR_LEN);
 	assert (sizeof (struct s_conf_t) == CONF_LEN);
-	assert (BIN_OFFSET == (int)((TES_JITTER_NBINS) / 2));
 	assert (self->frontends[ENDP_REP].type == ZMQ_REP);
 	assert (self->frontends[ENDP_PUB].type == ZMQ_XPUB);
 
 	static struct s_data_t data;
 
-	/* Some defaults. */
+	/* Some defaults: all channels against channel 0. */
 	data.conf.ticks = 5;
-	data.conf.ref_ch = 0;
+	data.conf.nchannels = TES_NCHANNELS;
+	for (uint8_t ch = 1; ch < TES_NCHANNELS; ch++)
+		data.conf.pairs |= TES_JITTER_PAIR (0, ch);
+	data.conf.nbins = 1022;
+	data.conf.shift = 0;
+
+	data.msg.topic[0] = TES_TOPIC_JITTER;
+	data.msg.topic[1] = TES_TOPIC_RAW;
+	data.msg.topic[2] = TES_TOPIC_ALLCH;
 
 	self->data = &data;
 	return 0;
@@ -387,11 +485,47 @@ task_jitter_wakeup (task_t* self)
 	assert (self != NULL);
 	struct s_data_t* data = (struct s_data_t*) self->data;
 
-	memset (&data->points, 0, sizeof (data->points));
-	/* Wait for first tick and reference frame. */
+	/* Wait for first tick and reference frames. */
 	data->publishing = 0;
-	data->cur_npts = 0;
+	data->tail = 0;
+	memset (data->has_ref, 0, sizeof (data->has_ref));
+	memset (data->head, 0, sizeof (data->head));
 	s_prep_next (data);
+	/* Nothing was collected while sleeping, it is outdated. */
+	data->has_last = 0;
+	return 0;
+}
+
+/*
+ * Re-publishes the last histogram, if the subscription is to it, so
+ * that a new subscriber need not wait for the next one. Existing
+ * subscribers get it again, marked as a replay so they can drop it.
+ */
+int
+task_jitter_sub (task_t* self, task_endp_t* frontend,
+	const char* prefix, size_t len)
+{
+	assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	if (len > TES_TOPIC_LEN)
+		len = TES_TOPIC_LEN;
+	if ( ! data->has_last ||
+		memcmp (data->last.topic, prefix, len) != 0 )
+		return 0;
+
+	/* zmq_send copies it, so it can be reset right after. */
+	data->last.topic[3] = TES_TOPIC_REPLAY;
+	int rc = zmq_send (
+		zsock_resolve (self->frontends[ENDP_PUB].sock),
+		(void*)&data->last, data->last_len, 0);
+	data->last.topic[3] = 0;
+	if (rc == -1)
+	{
+		logmsg (errno, LOG_ERR,
+			"Cannot send the histogram");
+		return TASK_ERROR;
+	}
 	return 0;
 }
 
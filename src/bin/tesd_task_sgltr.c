@@ -0,0 +1,409 @@
+/*
+ * Averages single traces on the host, for more traces than the FPGA
+ * averages and for subsets of them: of one channel, with a pulse area
+ * within a window.
+ *
+ * A trace is reassembled from its frames into a scratch buffer and
+ * only added to the sums of its channel once it is complete, so that
+ * a lost frame does not spoil the average. Samples are summed into
+ * 64-bit integers, so there is no overflow or rounding however many
+ * traces are averaged. The baseline of each trace is the mean of its
+ * first samples; since it is the same for all of a trace's samples,
+ * only the sum of the baselines is kept and subtracted at the end.
+ *
+ * A channel's average is only built while someone is subscribed to
+ * it. It is published when it has the configured number of traces,
+ * and the next one is started with the current configuration.
+ */
+
+#include "tesd_tasks.h"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define ENDP_REP 0
+#define ENDP_PUB 1
+
+#define SMPL_LEN 2
+
+#define CONF_LEN 16
+struct s_conf_t
+{
+	uint32_t ntraces;  // to average over
+	uint32_t area_min; // lowest pulse area to accept
+	uint32_t area_max; // highest pulse area to accept
+	uint16_t nbase;    // samples the baseline is taken over, or 0
+	uint16_t : 16;     /* reserved */
+};
+
+struct s_hdr_t
+{
+	uint32_t ntraces;  // averaged over
+	uint16_t nsamples;
+	uint16_t nbase;    // samples the baseline was taken over
+	uint32_t skipped;  // traces lost or of a different length
+	uint32_t : 32;     /* reserved */
+};
+
+struct s_msg_t
+{
+	uint32_t : 32;     // so that avg is aligned
+	char     topic[TES_TOPIC_LEN];
+	struct s_hdr_t hdr;
+	double   avg[TES_SGLTR_MAXSAMPLES];
+};
+
+/*
+ * Average of one channel being built.
+ */
+struct s_chan_t
+{
+	struct s_conf_t conf;  // for current
+	bool     wanted;       // someone is subscribed to it
+	uint32_t ntraces;      // added so far, 0 before the first one
+	uint32_t skipped;
+	uint16_t nsamples;     // of the first trace
+	uint16_t nbase;        // at most nsamples
+	int64_t  base_sum;     // of the first nbase samples of each
+	int64_t  sums[TES_SGLTR_MAXSAMPLES]
+		__attribute__ ((aligned (16)));
+};
+
+/*
+ * Data for currently built averages and reassembled trace.
+ */
+struct s_data_t
+{
+	struct s_conf_t conf[TES_NCHANNELS]; // for next
+	struct s_chan_t chans[TES_NCHANNELS];
+	/* The trace being reassembled. */
+	bool     recording;    // discard all frames until next header
+	uint8_t  ch;
+	uint16_t size;         // of the trace including headers
+	uint16_t cur_size;     // number of received bytes so far
+	uint16_t off;          // of the first sample
+	int16_t  samples[TES_SGLTR_MAXSAMPLES]
+		__attribute__ ((aligned (16)));
+	struct s_msg_t msg;    // scratch space for publishing
+};
+
+static void s_add (int64_t* restrict sums,
+	const int16_t* restrict samples, uint16_t n);
+static int  s_start (task_t* self, tespkt* pkt);
+static int  s_publish (task_t* self, uint8_t ch);
+
+/* -------------------------------------------------------------- */
+/* --------------------------- HELPERS -------------------------- */
+/* -------------------------------------------------------------- */
+
+/*
+ * Adds n signed samples to the sums.
+ */
+static void
+s_add (int64_t* restrict sums, const int16_t* restrict samples,
+	uint16_t n)
+{
+	dbg_assert (sums != NULL);
+	dbg_assert (samples != NULL);
+
+	uint16_t i = 0;
+#ifdef __SSE2__
+	/* Eight samples at a time. Widen to 32 bits by interleaving each
+	 * with itself and shifting back, then to 64 bits by interleaving
+	 * with the sign. */
+	dbg_assert (((uintptr_t)sums & 15) == 0);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_loadu_si128 ((const __m128i*)(samples + i));
+		__m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+		__m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+		__m128i lo_sign = _mm_srai_epi32 (lo, 31);
+		__m128i hi_sign = _mm_srai_epi32 (hi, 31);
+		__m128i* s = (__m128i*)(sums + i);
+		s[0] = _mm_add_epi64 (s[0], _mm_unpacklo_epi32 (lo, lo_sign));
+		s[1] = _mm_add_epi64 (s[1], _mm_unpackhi_epi32 (lo, lo_sign));
+		s[2] = _mm_add_epi64 (s[2], _mm_unpacklo_epi32 (hi, hi_sign));
+		s[3] = _mm_add_epi64 (s[3], _mm_unpackhi_epi32 (hi, hi_sign));
+	}
+#endif
+	for (; i < n; i++)
+		sums[i] += samples[i];
+}
+
+/*
+ * Called on a header frame. Starts reassembling the trace if its
+ * channel's average is wanted and it passes the selection. Starts
+ * the channel's average if it has no traces yet.
+ * Returns 1 if the trace is to be recorded, 0 otherwise.
+ */
+static int
+s_start (task_t* self, tespkt* pkt)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	uint8_t ch = tespkt_evt_fl (pkt, 0)->CH;
+	if (ch >= TES_NCHANNELS)
+		return 0;
+
+	struct s_chan_t* chan = &data->chans[ch];
+	if (chan->ntraces == 0)
+	{ /* start the average */
+		char topic[TES_TOPIC_LEN] = {
+			TES_TOPIC_SGLTR, TES_TOPIC_RAW, ch};
+		chan->wanted = (task_endp_nsubs (
+			&self->frontends[ENDP_PUB], topic) > 0);
+		chan->conf = data->conf[ch];
+		chan->nsamples = 0;
+	}
+	if ( ! chan->wanted )
+		return 0;
+
+	uint32_t area = tespkt_trace_area (pkt);
+	if (area < chan->conf.area_min || area > chan->conf.area_max)
+		return 0;
+
+	uint16_t size = tespkt_trace_size (pkt);
+	uint16_t off = TESPKT_TRACE_FULL_HDR_LEN +
+		tespkt_peak_nums (pkt, 0) * TESPKT_PEAK_LEN;
+	if (size <= off || size > TES_AVGTR_MAXSIZE)
+		return 0; /* no samples or too long */
+	uint16_t nsamples = (size - off) / SMPL_LEN;
+	dbg_assert ((size_t)(size - off) <= sizeof (data->samples));
+
+	if (chan->ntraces == 0)
+	{
+		chan->nsamples = nsamples;
+		chan->nbase = (chan->conf.nbase < nsamples ?
+			chan->conf.nbase : nsamples);
+		chan->base_sum = 0;
+		memset (chan->sums, 0, nsamples * sizeof (int64_t));
+	}
+	else if (nsamples != chan->nsamples)
+	{
+		chan->skipped++;
+		return 0;
+	}
+
+	data->ch = ch;
+	data->size = size;
+	data->off = off;
+	return 1;
+}
+
+/*
+ * Publishes the average of the channel and starts the next one at its
+ * next trace.
+ * Returns 0 on success, TASK_ERROR on error.
+ */
+static int
+s_publish (task_t* self, uint8_t ch)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	struct s_chan_t* chan = &data->chans[ch];
+	struct s_msg_t* msg = &data->msg;
+	dbg_assert (chan->ntraces > 0);
+
+	msg->topic[2] = ch;
+	msg->hdr.ntraces = chan->ntraces;
+	msg->hdr.nsamples = chan->nsamples;
+	msg->hdr.nbase = chan->nbase;
+	msg->hdr.skipped = chan->skipped;
+
+	double base = (chan->nbase > 0 ?
+		(double)chan->base_sum / chan->nbase : 0);
+	for (uint16_t i = 0; i < chan->nsamples; i++)
+		msg->avg[i] = (chan->sums[i] - base) / chan->ntraces;
+
+	logmsg (0, LOG_DEBUG,
+		"Publishing average of %u traces of channel %hhu",
+		chan->ntraces, ch);
+	int rc = zmq_send (
+		zsock_resolve (self->frontends[ENDP_PUB].sock),
+		msg->topic, TES_TOPIC_LEN + TES_SGLTR_HDR_LEN +
+		chan->nsamples * sizeof (double), 0);
+	chan->ntraces = 0;
+	chan->skipped = 0;
+	if (rc == -1)
+	{
+		logmsg (errno, LOG_ERR,
+			"Cannot send the average trace");
+		return TASK_ERROR;
+	}
+	return 0;
+}
+
+/* -------------------------------------------------------------- */
+/* ----------------------------- API ---------------------------- */
+/* -------------------------------------------------------------- */
+
+/*
+ * Sets the number of traces, the pulse area window and the baseline
+ * of one channel's average. A request with 0 traces, an empty window
+ * or too many baseline samples does not change it. Replies with the
+ * configuration.
+ */
+int
+task_sgltr_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+
+	uint8_t ch;
+	struct s_conf_t conf = {0};
+	int rc = zsock_recv (frontend, TES_SGLTR_REQ_PIC, &ch,
+		&conf.ntraces, &conf.area_min, &conf.area_max, &conf.nbase);
+	/* We don't get interrupted, this should not happen. */
+	assert (rc != -1);
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	struct s_conf_t set = {0};
+	if (ch < TES_NCHANNELS)
+	{
+		if (conf.ntraces > 0 && conf.area_min <= conf.area_max &&
+			conf.nbase <= TES_SGLTR_MAXSAMPLES)
+		{
+			logmsg (0, LOG_INFO,
+				"Channel %hhu: averaging %u traces with area "
+				"%u to %u, baseline over %hu samples",
+				ch, conf.ntraces, conf.area_min, conf.area_max,
+				conf.nbase);
+			data->conf[ch] = conf;
+		}
+		set = data->conf[ch];
+	}
+
+	zsock_send (frontend, TES_SGLTR_REP_PIC, ch, set.ntraces,
+		set.area_min, set.area_max, set.nbase);
+
+	return 0;
+}
+
+/*
+ * Reassembles single traces of wanted channels and adds each one to
+ * its channel's sums once it is complete. Publishes a channel's
+ * average after the configured number of traces.
+ */
+int
+task_sgltr_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
+		uint16_t missed, int err, task_t* self)
+{
+	dbg_assert (self != NULL);
+
+	if ( ! tespkt_is_event (pkt) || ! tespkt_is_trace_sgl (pkt) )
+		return 0;
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	if (err)
+	{
+		if (data->recording)
+		{ /* we don't handle bad frames, drop trace */
+			data->chans[data->ch].skipped++;
+			data->recording = 0;
+		}
+		return 0;
+	}
+
+	if (tespkt_is_header (pkt))
+	{
+		if (data->recording)
+		{ /* missed the rest of the previous one */
+			data->chans[data->ch].skipped++;
+		}
+		data->recording = s_start (self, pkt);
+		data->cur_size = 0;
+	}
+	else if (data->recording &&
+		(uint16_t)(tespkt_pseq (pkt) - self->prev_pseq_tr) != 1)
+	{ /* missed frames */
+		data->chans[data->ch].skipped++;
+		data->recording = 0;
+	}
+
+	if ( ! data->recording )
+		return 0;
+
+	/* Copy the part of the payload which holds samples. */
+	uint16_t paylen = flen - TESPKT_HDR_LEN;
+	uint16_t start = data->cur_size;
+	uint16_t end = (paylen < data->size - start ?
+		start + paylen : data->size);
+	if (end > data->off)
+	{
+		uint16_t from = (start > data->off ? start : data->off);
+		memcpy ((char*)data->samples + (from - data->off),
+			(char*)pkt + TESPKT_HDR_LEN + (from - start),
+			end - from);
+	}
+	data->cur_size = end;
+	if (data->cur_size < data->size)
+		return 0;
+
+	/* Complete, add it. */
+	data->recording = 0;
+	struct s_chan_t* chan = &data->chans[data->ch];
+	s_add (chan->sums, data->samples, chan->nsamples);
+	for (uint16_t i = 0; i < chan->nbase; i++)
+		chan->base_sum += data->samples[i];
+	chan->ntraces++;
+	if (chan->ntraces == chan->conf.ntraces)
+		return s_publish (self, data->ch);
+
+	return 0;
+}
+
+int
+task_sgltr_init (task_t* self)
+{
+	assert (self != NULL);
+	assert (sizeof (struct s_conf_t) == CONF_LEN);
+	assert (sizeof (struct s_hdr_t) == TES_SGLTR_HDR_LEN);
+	assert (offsetof (struct s_msg_t, avg) -
+		offsetof (struct s_msg_t, topic) ==
+		TES_TOPIC_LEN + TES_SGLTR_HDR_LEN);
+	assert (self->frontends[ENDP_REP].type == ZMQ_REP);
+	assert (self->frontends[ENDP_PUB].type == ZMQ_XPUB);
+
+	static struct s_data_t data;
+
+	/* Some defaults: 1000 traces of any area, no baseline. */
+	for (int ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		data.conf[ch].ntraces = 1000;
+		data.conf[ch].area_max = UINT32_MAX;
+	}
+
+	data.msg.topic[0] = TES_TOPIC_SGLTR;
+	data.msg.topic[1] = TES_TOPIC_RAW;
+
+	self->data = &data;
+	return 0;
+}
+
+int
+task_sgltr_wakeup (task_t* self)
+{
+	assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	/* Nothing was collected while sleeping, start afresh. */
+	data->recording = 0;
+	for (int ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		data->chans[ch].ntraces = 0;
+		data->chans[ch].skipped = 0;
+	}
+	return 0;
+}
+
+int
+task_sgltr_fin (task_t* self)
+{
+	assert (self != NULL);
+
+	self->data = NULL;
+	return 0;
+}
@@ -0,0 +1,455 @@
+#include "tesd_tasks.h"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define ENDP_REP 0
+#define ENDP_PUB 1
+
+/* Quantities histogrammed, each from its own event type. */
+#define Q_HEIGHT 0 // peak frames
+#define Q_AREA   1 // area frames
+#define Q_PULSE  2 // pulse frames
+#define NQUANTS  3
+
+/* Most events a frame can hold, with the smallest event size. */
+#define MAX_EVENTS ((TESPKT_MTU - TESPKT_HDR_LEN) / 8)
+
+/* Bin 0 is underflow and the last bin is overflow. The rest are
+ * each 2^shift wide, starting at lowest. */
+#define BINNING_LEN 8
+struct s_binning_t
+{
+	uint32_t lowest;
+	uint16_t nbins;  // including under-/overflow
+	uint8_t  shift;  // log2 of bin width
+	uint8_t  : 8;    // reserved
+};
+
+struct s_hdr_t
+{
+	struct s_binning_t binning;
+	uint64_t ticks;  // accumulated over
+	uint64_t total;  // number of events, including under-/overflow
+};
+
+struct s_hist_t
+{
+	uint32_t : 32;   // so that hdr is aligned
+	char     topic[TES_TOPIC_LEN];
+	struct s_hdr_t hdr;
+	uint32_t bins[TES_SMCA_MAXBINS];
+};
+
+/*
+ * Data for currently built histograms. The task's thread is the only
+ * one to update them, so they are kept in place, no locking or
+ * merging is needed. Histograms for the next period are built in the
+ * other set while the last ones are kept for new subscribers.
+ */
+struct s_data_t
+{
+	struct s_binning_t conf[TES_NCHANNELS][NQUANTS]; // for next
+	uint64_t conf_ticks;   // publish after that many, for next
+	uint64_t cur_ticks;    // for current
+	uint64_t ticks;        // number of ticks so far
+	bool     publishing;   // discard all frames until first tick
+	bool     has_last;     // last is valid
+	bool     wanted[TES_NCHANNELS][NQUANTS]; // for current
+	bool     last_wanted[TES_NCHANNELS][NQUANTS];
+	uint8_t  cur;          // index of current set
+	struct s_hist_t hists[2][TES_NCHANNELS][NQUANTS];
+	/* Scratch space for one frame. */
+	uint32_t vals[TES_NCHANNELS][MAX_EVENTS];
+	uint32_t idx[MAX_EVENTS];
+};
+
+static const char s_products[NQUANTS] = {
+	TES_TOPIC_SMCA_HEIGHT,
+	TES_TOPIC_SMCA_AREA,
+	TES_TOPIC_SMCA_PULSE,
+};
+
+static int  s_quant (char product);
+static void s_bin_idx (uint32_t* restrict idx,
+	const uint32_t* restrict vals, uint16_t n,
+	const struct s_binning_t* binning);
+static void s_prep_next (task_t* self);
+static int  s_publish (task_t* self);
+
+/* -------------------------------------------------------------- */
+/* --------------------------- HELPERS -------------------------- */
+/* -------------------------------------------------------------- */
+
+/*
+ * Returns the quantity published as product, or -1 if none.
+ */
+static int
+s_quant (char product)
+{
+	for (int q = 0; q < NQUANTS; q++)
+		if (s_products[q] == product)
+			return q;
+	return -1;
+}
+
+/*
+ * Computes the bin index of each of n values.
+ */
+static void
+s_bin_idx (uint32_t* restrict idx, const uint32_t* restrict vals,
+	uint16_t n, const struct s_binning_t* binning)
+{
+	dbg_assert (idx != NULL);
+	dbg_assert (vals != NULL);
+	dbg_assert (binning->nbins >= TES_SMCA_MINBINS);
+
+	uint32_t lowest = binning->lowest;
+	uint32_t last = binning->nbins - 1;
+	uint16_t i = 0;
+#ifdef __SSE2__
+	/* Four at a time. There are no unsigned compares, so flip the
+	 * sign bit and compare signed. */
+	const __m128i sign  = _mm_set1_epi32 (INT32_MIN);
+	const __m128i lo    = _mm_set1_epi32 (lowest);
+	const __m128i lo_s  = _mm_xor_si128 (lo, sign);
+	const __m128i top_s = _mm_xor_si128 (
+		_mm_set1_epi32 (last - 2), sign);
+	const __m128i over  = _mm_set1_epi32 (last);
+	const __m128i one   = _mm_set1_epi32 (1);
+	const __m128i shift = _mm_cvtsi32_si128 (binning->shift);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_loadu_si128 ((const __m128i*)(vals + i));
+		__m128i is_under = _mm_cmplt_epi32 (
+			_mm_xor_si128 (v, sign), lo_s);
+		__m128i d = _mm_srl_epi32 (_mm_sub_epi32 (v, lo), shift);
+		__m128i is_over = _mm_cmpgt_epi32 (
+			_mm_xor_si128 (d, sign), top_s);
+		d = _mm_add_epi32 (d, one);
+		d = _mm_or_si128 (_mm_and_si128 (is_over, over),
+			_mm_andnot_si128 (is_over, d));
+		d = _mm_andnot_si128 (is_under, d);
+		_mm_storeu_si128 ((__m128i*)(idx + i), d);
+	}
+#endif
+	for (; i < n; i++)
+	{
+		if (vals[i] < lowest)
+		{
+			idx[i] = 0;
+			continue;
+		}
+		uint32_t d = (vals[i] - lowest) >> binning->shift;
+		idx[i] = (d > last - 2 ? last : d + 1);
+	}
+}
+
+/*
+ * Called on publishing or activation. Applies the configuration and
+ * clears the histograms which are wanted.
+ */
+static void
+s_prep_next (task_t* self)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	data->cur_ticks = data->conf_ticks;
+	data->ticks = 0;
+	for (uint8_t ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		for (int q = 0; q < NQUANTS; q++)
+		{
+			struct s_hist_t* hist = &data->hists[data->cur][ch][q];
+			hist->topic[0] = s_products[q];
+			hist->topic[1] = TES_TOPIC_RAW;
+			hist->topic[2] = ch;
+			hist->topic[3] = 0;
+
+			/* Products nobody is subscribed to now are not
+			 * computed until the next period. */
+			data->wanted[ch][q] = (task_endp_nsubs (
+				&self->frontends[ENDP_PUB], hist->topic) > 0);
+			if ( ! data->wanted[ch][q] )
+				continue;
+
+			hist->hdr.binning = data->conf[ch][q];
+			hist->hdr.ticks = 0;
+			hist->hdr.total = 0;
+			memset (hist->bins, 0,
+				hist->hdr.binning.nbins * sizeof (uint32_t));
+		}
+	}
+}
+
+/*
+ * Publishes the wanted histograms and starts the next ones.
+ * Returns 0 on success, TASK_ERROR on error.
+ */
+static int
+s_publish (task_t* self)
+{
+	dbg_assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	for (uint8_t ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		for (int q = 0; q < NQUANTS; q++)
+		{
+			if ( ! data->wanted[ch][q] )
+				continue;
+
+			struct s_hist_t* hist = &data->hists[data->cur][ch][q];
+			hist->hdr.ticks = data->ticks;
+			int rc = zmq_send (
+				zsock_resolve (self->frontends[ENDP_PUB].sock),
+				hist->topic, TES_TOPIC_LEN + TES_SMCA_HDR_LEN +
+				hist->hdr.binning.nbins * sizeof (uint32_t), 0);
+			if (rc == -1)
+			{
+				logmsg (errno, LOG_ERR,
+					"Cannot send the histogram");
+				return TASK_ERROR;
+			}
+		}
+	}
+
+	memcpy (data->last_wanted, data->wanted, sizeof (data->wanted));
+	data->has_last = 1;
+	data->cur ^= 1;
+	s_prep_next (self);
+	return 0;
+}
+
+/* -------------------------------------------------------------- */
+/* ----------------------------- API ---------------------------- */
+/* -------------------------------------------------------------- */
+
+/*
+ * Sets the binning of one channel's histogram of one quantity, and
+ * the number of ticks to accumulate over. Binnings with fewer than
+ * TES_SMCA_MINBINS or more than TES_SMCA_MAXBINS bins, or with a
+ * shift over 31, are not applied; neither is 0 ticks. Replies with
+ * the configuration.
+ */
+int
+task_smca_req_hn (zloop_t* loop, zsock_t* frontend, void* self_)
+{
+	dbg_assert (self_ != NULL);
+
+	task_t* self = (task_t*) self_;
+
+	uint8_t ch, product, shift;
+	uint32_t lowest;
+	uint16_t nbins;
+	uint64_t ticks;
+	int rc = zsock_recv (frontend, TES_SMCA_REQ_PIC,
+		&ch, &product, &lowest, &shift, &nbins, &ticks);
+	/* We don't get interrupted, this should not happen. */
+	assert (rc != -1);
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+	int q = s_quant (product);
+	struct s_binning_t binning = {0};
+	if (ch < TES_NCHANNELS && q != -1)
+	{
+		if (nbins >= TES_SMCA_MINBINS &&
+			nbins <= TES_SMCA_MAXBINS && shift < 32)
+		{
+			logmsg (0, LOG_INFO,
+				"Channel %hhu '%c': %hu bins of width 2^%hhu "
+				"from %u", ch, product, nbins, shift, lowest);
+			data->conf[ch][q].lowest = lowest;
+			data->conf[ch][q].nbins = nbins;
+			data->conf[ch][q].shift = shift;
+		}
+		binning = data->conf[ch][q];
+	}
+	if (ticks > 0)
+	{
+		logmsg (0, LOG_INFO,
+			"Publishing each %lu ticks", ticks);
+		data->conf_ticks = ticks;
+	}
+
+	zsock_send (frontend, TES_SMCA_REP_PIC, ch, product,
+		binning.lowest, binning.shift, binning.nbins,
+		data->conf_ticks);
+
+	return 0;
+}
+
+/*
+ * Collects the quantity of each event of wanted channels, computes
+ * their bin indices per channel and adds them to the histograms.
+ * Publishes after the configured number of ticks.
+ */
+int
+task_smca_pkt_hn (zloop_t* loop, tespkt* pkt, uint16_t flen,
+		uint16_t missed, int err, task_t* self)
+{
+	dbg_assert (self != NULL);
+
+	if (err || ! tespkt_is_event (pkt))
+		return 0;
+
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	if (tespkt_is_tick (pkt))
+	{
+		if ( ! data->publishing )
+		{ /* start accumulating */
+			data->publishing = 1;
+			return 0;
+		}
+		data->ticks++;
+		if (data->ticks == data->cur_ticks)
+			return s_publish (self);
+		return 0;
+	}
+
+	if ( ! data->publishing )
+		return 0;
+
+	int q;
+	if (tespkt_is_peak (pkt))
+		q = Q_HEIGHT;
+	else if (tespkt_is_area (pkt))
+		q = Q_AREA;
+	else if (tespkt_is_pulse (pkt))
+		q = Q_PULSE;
+	else
+		return 0;
+
+	uint16_t n[TES_NCHANNELS] = {0};
+	uint16_t nevents = tespkt_event_nums (pkt);
+	dbg_assert (nevents <= MAX_EVENTS);
+	for (uint16_t e = 0; e < nevents; e++)
+	{
+		uint8_t ch = tespkt_evt_fl (pkt, e)->CH;
+		if (ch >= TES_NCHANNELS || ! data->wanted[ch][q])
+			continue;
+
+		uint32_t v;
+		if (q == Q_HEIGHT)
+			v = tespkt_peak_height (pkt, e);
+		else if (q == Q_AREA)
+			v = tespkt_event_area (pkt, e);
+		else
+			v = tespkt_pulse_area (pkt, e);
+		data->vals[ch][n[ch]++] = v;
+	}
+
+	for (uint8_t ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		if (n[ch] == 0)
+			continue;
+
+		struct s_hist_t* hist = &data->hists[data->cur][ch][q];
+		s_bin_idx (data->idx, data->vals[ch], n[ch],
+			&hist->hdr.binning);
+		for (uint16_t i = 0; i < n[ch]; i++)
+			hist->bins[data->idx[i]]++;
+		hist->hdr.total += n[ch];
+	}
+
+	return 0;
+}
+
+int
+task_smca_init (task_t* self)
+{
+	assert (self != NULL);
+	assert (sizeof (struct s_binning_t) == BINNING_LEN);
+	assert (sizeof (struct s_hdr_t) == TES_SMCA_HDR_LEN);
+	assert (offsetof (struct s_hist_t, hdr) -
+		offsetof (struct s_hist_t, topic) == TES_TOPIC_LEN);
+	assert (self->frontends[ENDP_REP].type == ZMQ_REP);
+	assert (self->frontends[ENDP_PUB].type == ZMQ_XPUB);
+
+	static struct s_data_t data;
+
+	/* Some defaults. */
+	data.conf_ticks = 10;
+	for (int ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		for (int q = 0; q < NQUANTS; q++)
+		{
+			data.conf[ch][q].nbins = 1024;
+			data.conf[ch][q].shift = (q == Q_HEIGHT ? 6 : 8);
+		}
+	}
+
+	self->data = &data;
+	return 0;
+}
+
+int
+task_smca_wakeup (task_t* self)
+{
+	assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	/* Wait for first tick. */
+	data->publishing = 0;
+	s_prep_next (self);
+	/* Nothing was collected while sleeping, it is outdated. */
+	data->has_last = 0;
+	return 0;
+}
+
+/*
+ * Re-publishes the last histograms which the subscription is to, so
+ * that a new subscriber need not wait for the next ones. Existing
+ * subscribers get them again, marked as replays so they can drop
+ * them. Histograms a new subscription is to
+ * are only computed from the next period on.
+ */
+int
+task_smca_sub (task_t* self, task_endp_t* frontend,
+	const char* prefix, size_t len)
+{
+	assert (self != NULL);
+	struct s_data_t* data = (struct s_data_t*) self->data;
+
+	if ( ! data->has_last )
+		return 0;
+
+	if (len > TES_TOPIC_LEN)
+		len = TES_TOPIC_LEN;
+	for (uint8_t ch = 0; ch < TES_NCHANNELS; ch++)
+	{
+		for (int q = 0; q < NQUANTS; q++)
+		{
+			struct s_hist_t* hist =
+				&data->hists[data->cur ^ 1][ch][q];
+			if ( ! data->last_wanted[ch][q] ||
+				memcmp (hist->topic, prefix, len) != 0 )
+				continue;
+
+			/* zmq_send copies it, reset right after. */
+			hist->topic[3] = TES_TOPIC_REPLAY;
+			int rc = zmq_send (zsock_resolve (frontend->sock),
+				hist->topic, TES_TOPIC_LEN + TES_SMCA_HDR_LEN +
+				hist->hdr.binning.nbins * sizeof (uint32_t), 0);
+			hist->topic[3] = 0;
+			if (rc == -1)
+			{
+				logmsg (errno, LOG_ERR,
+					"Cannot send the histogram");
+				return TASK_ERROR;
+			}
+		}
+	}
+	return 0;
+}
+
+int
+task_smca_fin (task_t* self)
+{
+	assert (self != NULL);
+
+	self->data = NULL;
+	return 0;
+}
@@ -46,9 +46,16 @@
  * deregistered from the loop upon task activation, and registered
  * again upon deactivation.
  *
- * If any of the frontends is an XPUB and is defined with the
- * autosleep flag, the task will be deactivated when the socket has no
- * subscribers and reactivated at the first subscription.
+ * Subscriptions to XPUB frontends are counted. If any of them is
+ * defined with the autosleep flag, the task will be deactivated when
+ * the socket has no subscribers and reactivated at the first
+ * subscription. Tasks with a non-autosleep XPUB are active on their
+ * own (e.g. autoactivate).
+ * If the task defines a data_sub handler, it is called on every
+ * subscription to an XPUB frontend, after the task is activated, so
+ * it can re-publish the last message for clients which just joined
+ * (the socket is set to deliver all (un)subscriptions, not just the
+ * first one for a given prefix).
  *
  * Right after the loop terminates, s_task_shim will call the task
  * finalizer, so it can cleanup its data and possibly send final
@@ -140,6 +147,9 @@ static zloop_reader_fn s_die_hn;
 static zloop_reader_fn s_sub_hn;
 static zactor_fn       s_task_shim;
 
+static void s_count_sub (task_endp_t* frontend, bool sub,
+		const char* prefix, size_t len);
+
 static int  s_task_start (tes_ifdesc* ifd, task_t* self);
 static void s_task_stop (task_t* self);
 static int  s_task_next_ring (task_t* self, uint16_t* missed_p);
@@ -148,7 +158,7 @@ static int  s_task_dispatch (task_t* self, zloop_t* loop,
 
 /* ------------------------ THE TASK LIST ----------------------- */
 
-#define NUM_TASKS 5
+#define NUM_TASKS 8
 static task_t s_tasks[] = {
 	{ // PACKET INFO
 		.pkt_handler = task_info_pkt_hn,
@@ -175,6 +185,17 @@ static task_t s_tasks[] = {
 				.type      = ZMQ_REP,
 				.automute  = 1,
 			},
+			{
+				.handler   = task_cap_conv_hn,
+				.addresses = "tcp://*:" TES_CONV_LPORT,
+				.type      = ZMQ_REP,
+			},
+			{
+				.handler   = task_cap_stream_hn,
+				.addresses = "tcp://*:" TES_STREAM_LPORT,
+				.type      = ZMQ_ROUTER,
+				.automute  = 1,
+			},
 		},
 		.color       = ANSI_FG_BLUE,
 	},
@@ -186,8 +207,7 @@ static task_t s_tasks[] = {
 			{
 				.handler   = task_avgtr_req_hn,
 				.addresses = "tcp://*:" TES_AVGTR_LPORT,
-				.type      = ZMQ_REP,
-				.automute  = 1,
+				.type      = ZMQ_ROUTER,
 			},
 		},
 		.color       = ANSI_FG_GREEN,
@@ -196,6 +216,7 @@ static task_t s_tasks[] = {
 		.pkt_handler = task_hist_pkt_hn,
 		.data_init   = task_hist_init,
 		.data_wakeup = task_hist_wakeup,
+		.data_sub    = task_hist_sub,
 		.data_fin    = task_hist_fin,
 		.frontends   = {
 			{
@@ -203,6 +224,11 @@ static task_t s_tasks[] = {
 				.type      = ZMQ_XPUB,
 				.autosleep = 1,
 			},
+			{
+				.handler   = task_hist_acc_req_hn,
+				.addresses = "tcp://*:" TES_HIST_ACC_REP_LPORT,
+				.type      = ZMQ_REP,
+			},
 		},
 		.color       = ANSI_FG_CYAN,
 	},
@@ -210,6 +236,7 @@ static task_t s_tasks[] = {
 		.pkt_handler = task_jitter_pkt_hn,
 		.data_init   = task_jitter_init,
 		.data_wakeup = task_jitter_wakeup,
+		.data_sub    = task_jitter_sub,
 		.data_fin    = task_jitter_fin,
 		.frontends   = {
 			{
@@ -224,6 +251,64 @@ static task_t s_tasks[] = {
 			},
 		},
 		.color       = ANSI_FG_MAGENTA,
+	},
+	{ // PUBLISH SOFTWARE MCA HISTS
+		.pkt_handler = task_smca_pkt_hn,
+		.data_init   = task_smca_init,
+		.data_wakeup = task_smca_wakeup,
+		.data_sub    = task_smca_sub,
+		.data_fin    = task_smca_fin,
+		.frontends   = {
+			{
+				.handler   = task_smca_req_hn,
+				.addresses = "tcp://*:" TES_SMCA_REP_LPORT,
+				.type      = ZMQ_REP,
+			},
+			{
+				.addresses = "tcp://*:" TES_SMCA_PUB_LPORT,
+				.type      = ZMQ_XPUB,
+				.autosleep = 1,
+			},
+		},
+		.color       = ANSI_FG_RED,
+	},
+	{ // PUBLISH COINCIDENCES
+		.pkt_handler = task_coinc_pkt_hn,
+		.data_init   = task_coinc_init,
+		.data_wakeup = task_coinc_wakeup,
+		.data_fin    = task_coinc_fin,
+		.frontends   = {
+			{
+				.handler   = task_coinc_req_hn,
+				.addresses = "tcp://*:" TES_COINC_REP_LPORT,
+				.type      = ZMQ_REP,
+			},
+			{
+				.addresses = "tcp://*:" TES_COINC_PUB_LPORT,
+				.type      = ZMQ_XPUB,
+			},
+		},
+		.autoactivate = 1,
+		.color       = ANSI_FG_BLUE,
+	},
+	{ // PUBLISH AVERAGES OF SINGLE TRACES
+		.pkt_handler = task_sgltr_pkt_hn,
+		.data_init   = task_sgltr_init,
+		.data_wakeup = task_sgltr_wakeup,
+		.data_fin    = task_sgltr_fin,
+		.frontends   = {
+			{
+				.handler   = task_sgltr_req_hn,
+				.addresses = "tcp://*:" TES_SGLTR_REP_LPORT,
+				.type      = ZMQ_REP,
+			},
+			{
+				.addresses = "tcp://*:" TES_SGLTR_PUB_LPORT,
+				.type      = ZMQ_XPUB,
+				.autosleep = 1,
+			},
+		},
+		.color       = ANSI_FG_GREEN,
 	}
 };
 
@@ -434,6 +519,23 @@ task_deactivate (task_t* self)
 	return 0;
 }
 
+uint32_t
+task_endp_nsubs (task_endp_t* frontend, const char* topic)
+{
+	assert (frontend != NULL);
+	assert (topic != NULL);
+
+	uint32_t nsubs = frontend->nsubs_any;
+	for (int t = 0; t < MAX_TOPICS; t++)
+	{
+		struct _task_topic_t* sub = &frontend->topics[t];
+		if (sub->nsubs > 0 &&
+			memcmp (sub->prefix, topic, sub->len) == 0)
+			nsubs += sub->nsubs;
+	}
+	return nsubs;
+}
+
 /* -------------------------------------------------------------- */
 /* -------------------------- INTERNAL -------------------------- */
 /* -------------------------------------------------------------- */
@@ -659,10 +761,21 @@ s_task_shim (zsock_t* pipe, void* self_)
 			rc = zloop_reader (loop, frontend->sock,
 				frontend->handler, self);
 		
-		if (rc == 0 && frontend->autosleep)
+		assert ( ! frontend->autosleep ||
+			frontend->type == ZMQ_XPUB );
+		if (rc == 0 && frontend->type == ZMQ_XPUB)
 		{
-			assert (frontend->type == ZMQ_XPUB);
-			rc = zloop_reader (loop, frontend->sock, s_sub_hn, self);
+#ifdef ZMQ_XPUB_VERBOSER
+			if (self->data_sub != NULL)
+			{
+				int verboser = 1;
+				rc = zmq_setsockopt (zsock_resolve (frontend->sock),
+					ZMQ_XPUB_VERBOSER, &verboser, sizeof (verboser));
+			}
+#endif
+			if (rc == 0)
+				rc = zloop_reader (loop, frontend->sock,
+					s_sub_hn, self);
 		}
 		
 		if (rc == -1)
@@ -759,9 +872,10 @@ cleanup:
 }
 
 /*
- * Registered with a task's XPUB frontend (if autosleep is set).
- * Will deactivate task on last unsubscription and activate it on
- * first subscription.
+ * Registered with a task's XPUB frontends. Counts subscriptions, and
+ * if autosleep is set, will deactivate task on last unsubscription
+ * and activate it on first subscription. Calls the task's data_sub
+ * handler on each subscription.
  *
  * XPUB will receive a message of the form "\x01<prefix>" the first
  * time a client subscribes to the port with a prefix <prefix>, and
@@ -806,10 +920,9 @@ s_sub_hn (zloop_t* loop, zsock_t* reader, void* self_)
 		;
 	dbg_assert (frontend->sock == reader); /* couldn't find reader? */
 
-	char* msgstr = zmsg_popstr (msg);
-	zmsg_destroy (&msg);
-	char stat = msgstr[0];
-	zstr_free (&msgstr);
+	zframe_t* frame = zmsg_first (msg);
+	size_t len = zframe_size (frame);
+	char stat = (len > 0 ? zframe_data (frame)[0] : -1);
 	if (stat == 0)
 	{
 		dbg_assert (frontend->nsubs > 0);
@@ -823,17 +936,31 @@ s_sub_hn (zloop_t* loop, zsock_t* reader, void* self_)
 	{
 		logmsg (0, LOG_DEBUG,
 			"Got a spurious message");
+		zmsg_destroy (&msg);
 		return 0;
 	}
+	const char* prefix = (const char*)zframe_data (frame) + 1;
+	len--;
+	s_count_sub (frontend, stat, prefix, len);
+
+	/* The task sleeps only if none of its autosleep frontends have
+	 * subscribers. */
+	uint32_t nsubs = 0;
+	for (task_endp_t* f = &self->frontends[0];
+			f->addresses != NULL; f++)
+	{
+		if (f->autosleep)
+			nsubs += f->nsubs;
+	}
 
-	if (frontend->nsubs == 1)
+	if (frontend->autosleep && stat == 1 && nsubs == 1)
 	{
 		logmsg (0, LOG_DEBUG,
 			"First subscription, activating");
 		/* Wakeup packet handler. */
 		task_activate (self);
 	}
-	else if (frontend->nsubs == 0)
+	else if (frontend->autosleep && stat == 0 && nsubs == 0)
 	{
 		logmsg (0, LOG_DEBUG,
 			"Last unsubscription, deactivating");
@@ -841,7 +968,64 @@ s_sub_hn (zloop_t* loop, zsock_t* reader, void* self_)
 		task_deactivate (self);
 	}
 
-	return 0;
+	int rc = 0;
+	if (stat == 1 && self->data_sub != NULL)
+		rc = self->data_sub (self, frontend, prefix, len);
+
+	zmsg_destroy (&msg);
+	return rc;
+}
+
+/*
+ * Updates the number of subscriptions to a topic prefix.
+ */
+static void
+s_count_sub (task_endp_t* frontend, bool sub,
+		const char* prefix, size_t len)
+{
+	dbg_assert (frontend != NULL);
+
+	if (len > TES_TOPIC_LEN)
+		len = TES_TOPIC_LEN; /* a subset of that topic */
+
+	struct _task_topic_t* unused = NULL;
+	for (int t = 0; t < MAX_TOPICS; t++)
+	{
+		struct _task_topic_t* topic = &frontend->topics[t];
+		if (topic->nsubs == 0)
+		{
+			if (unused == NULL)
+				unused = topic;
+			continue;
+		}
+		if (topic->len == len &&
+			memcmp (topic->prefix, prefix, len) == 0)
+		{
+			if (sub)
+				topic->nsubs++;
+			else
+				topic->nsubs--;
+			return;
+		}
+	}
+
+	if ( ! sub )
+	{ /* it didn't fit when it was made */
+		dbg_assert (frontend->nsubs_any > 0);
+		frontend->nsubs_any--;
+	}
+	else if (unused == NULL)
+	{
+		logmsg (0, LOG_WARNING,
+			"Too many subscribed topics, counting as any");
+		frontend->nsubs_any++;
+	}
+	else
+	{
+		memcpy (unused->prefix, prefix, len);
+		unused->len = len;
+		unused->nsubs = 1;
+	}
 }
 
 
@@ -41,6 +41,19 @@ typedef struct _task_endpoint_t task_endp_t;
 typedef int (task_data_fn)(task_t*);
 typedef int (task_pkt_fn)(zloop_t*, tespkt*,
 		uint16_t, uint16_t, int, task_t*);
+typedef int (task_sub_fn)(task_t*, task_endp_t*,
+		const char*, size_t);
+
+/* Subscriptions to an XPUB frontend are counted per topic prefix,
+ * truncated to TES_TOPIC_LEN. Ones which don't fit are counted as
+ * subscriptions to everything. */
+#define MAX_TOPICS 32
+struct _task_topic_t
+{
+	char     prefix[TES_TOPIC_LEN];
+	uint8_t  len;
+	uint32_t nsubs;
+};
 
 struct _task_endpoint_t
 {
@@ -48,6 +61,8 @@ struct _task_endpoint_t
 	const char* addresses;      // comma-separated
 	zsock_t*    sock;
 	uint32_t    nsubs;          // used for XPUB sockets only
+	uint32_t    nsubs_any;      // not in topics
+	struct _task_topic_t topics[MAX_TOPICS];
 	const int   type;           // one of ZMQ_*
 	bool        automute;       // s_task_(de)activate will
 	                            // enable/disable handler
@@ -62,6 +77,9 @@ struct _task_t
 	task_data_fn* data_init;    // initialize data, perform checks
 	task_data_fn* data_wakeup;  // called on activation
 	task_data_fn* data_sleep;   // called on deactivation
+	task_sub_fn*  data_sub;     // called on subscription to an
+	                            // XPUB frontend, with the topic
+	                            // prefix
 	task_data_fn* data_fin;     // cleanup data
 	void*         data;         // task-specific
 	zactor_t*     shim;         // coordinator's end of the pipe,
@@ -115,6 +133,13 @@ int task_activate (task_t* self);
  */
 int  task_deactivate (task_t* self);
 
+/*
+ * Returns the number of subscriptions to an XPUB frontend which
+ * match a topic of TES_TOPIC_LEN bytes, so that tasks need not
+ * compute products nobody is subscribed to.
+ */
+uint32_t task_endp_nsubs (task_endp_t* frontend, const char* topic);
+
 /* ------------------------ TASK HANDLERS ----------------------- */
 
 /* Server info */
@@ -125,6 +150,8 @@ task_data_fn    task_info_fin;
 
 /* Capture to file */
 zloop_reader_fn task_cap_req_hn;
+zloop_reader_fn task_cap_conv_hn;
+zloop_reader_fn task_cap_stream_hn;
 task_pkt_fn     task_cap_pkt_hn;
 task_data_fn    task_cap_init;
 task_data_fn    task_cap_fin;
@@ -135,10 +162,12 @@ task_pkt_fn     task_avgtr_pkt_hn;
 task_data_fn    task_avgtr_init;
 task_data_fn    task_avgtr_fin;
 
-/* Publish MCA histogram */
+/* Publish MCA histogram and sums of them */
+zloop_reader_fn task_hist_acc_req_hn;
 task_pkt_fn     task_hist_pkt_hn;
 task_data_fn    task_hist_init;
 task_data_fn    task_hist_wakeup;
+task_sub_fn     task_hist_sub;
 task_data_fn    task_hist_fin;
 
 /* Publish jitter histogram */
@@ -146,6 +175,31 @@ zloop_reader_fn task_jitter_req_hn;
 task_pkt_fn     task_jitter_pkt_hn;
 task_data_fn    task_jitter_init;
 task_data_fn    task_jitter_wakeup;
+task_sub_fn     task_jitter_sub;
 task_data_fn    task_jitter_fin;
 
+/* Publish software MCA histograms */
+zloop_reader_fn task_smca_req_hn;
+task_pkt_fn     task_smca_pkt_hn;
+task_data_fn    task_smca_init;
+task_data_fn    task_smca_wakeup;
+task_sub_fn     task_smca_sub;
+task_data_fn    task_smca_fin;
+
+/* Publish N-fold coincidences */
+zloop_reader_fn task_coinc_req_hn;
+task_pkt_fn     task_coinc_pkt_hn;
+task_data_fn    task_coinc_init;
+task_data_fn    task_coinc_wakeup;
+task_data_fn    task_coinc_fin;
+/* Number of coincidences so far, safe to call from any task */
+uint64_t task_coinc_count (void);
+
+/* Publish averages of single traces */
+zloop_reader_fn task_sgltr_req_hn;
+task_pkt_fn     task_sgltr_pkt_hn;
+task_data_fn    task_sgltr_init;
+task_data_fn    task_sgltr_wakeup;
+task_data_fn    task_sgltr_fin;
+
 #endif
@@ -1,4 +1,5 @@
 #include "hdf5conv.h"
+#include "tescap.h"
 #include "api.h"
 #include "daemon_ng.h"
 
@@ -9,8 +10,12 @@
 #  include <hdf5.h>
 #endif
 
-#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -19,15 +24,21 @@
 #define OVRWT_GROUP "overwritten" /* relative to file */
 #define NODELETE_TMP /* don't delete data files */
 #define DATATYPE H5T_NATIVE_UINT_LEAST8
+#define WRITE_CHUNK 67108864 /* write at most that many bytes at a time,
+                              * progress is updated after each */
 /* #define DATATYPE H5T_NATIVE_UINT_FAST8 */
 /* #define DATATYPE H5T_NATIVE_UINT8 */
+#define POLL_INTERVAL 100 /* in ms, how often to check on workers */
 
 static hid_t s_get_grp (hid_t lid, const char* group, bool create);
 static hid_t s_crt_grp (hid_t lid, const char* group,
 	hid_t bkp_lid, const char* bkpgroup);
-static int s_map_file (struct hdf5_dset_desc_t* ddesc, hid_t gid);
+static int s_map_file (struct hdf5_dset_desc_t* ddesc, bool nomap);
 static int s_create_dset (const struct hdf5_dset_desc_t* ddesc,
-		hid_t gid);
+		hid_t gid, bool external, uint64_t* done);
+static int s_verify_blocks (const struct hdf5_dset_desc_t* ddesc,
+		const struct tescap_crc* crcs, size_t nblocks, size_t* b,
+		off_t end);
 static int s_hdf5_init   (void* creq_data_);
 static int s_hdf5_write  (void* creq_data_);
 
@@ -38,6 +49,49 @@ struct s_creq_data_t
 	hid_t file_id;
 };
 
+/*
+ * A job slot. Slots are in memory shared with the workers, so that
+ * they can update done and total. The copy of the request is in
+ * private memory, which workers inherit when forked. It is kept until
+ * the slot is reused, since hdf5_conv_find compares the filename and
+ * group of finished jobs too.
+ */
+struct s_job_t
+{
+	uint32_t id;     /* 0 if slot was never used */
+	uint8_t  state;  /* one of HDF5_CONV_* */
+	uint8_t  status; /* TES_CAP_REQ_*, set when done */
+	pid_t    pid;    /* worker's pid, when running */
+	uint64_t done;   /* updated by worker */
+	uint64_t total;  /* set by worker */
+	struct hdf5_conv_req_t creq; /* points to copy */
+	void*    copy;   /* request strings, datasets and buffers */
+};
+
+static struct
+{
+	struct s_job_t* jobs;
+	int       nslots;
+	int       nworkers;
+	int       nrunning;
+	uint32_t  last_id;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	bool      stop;
+	bool      started;
+} s_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void* s_dispatch (void* arg);
+static void  s_reap (void);
+static void  s_run_next (void);
+static struct s_job_t* s_next_job (void);
+static void* s_copy_req (const struct hdf5_conv_req_t* creq,
+	struct hdf5_conv_req_t* copy);
+
 /* -------------------------------------------------------------- */
 /* --------------------------- HELPERS -------------------------- */
 /* -------------------------------------------------------------- */
@@ -201,10 +255,12 @@ s_crt_grp (hid_t lid, const char* group, hid_t bkp_lid,
  * On success buffer may be NULL if dataset should be empty, in
  * which case length is ensured to be 0. Otherwise length is ensured
  * to be positive and offset---to be non-negative.
+ * If nomap is true, only offset and length are calculated and buffer
+ * is left NULL (for external datasets).
  * Returns TES_CAP_REQ_*
  */
 static int
-s_map_file (struct hdf5_dset_desc_t* ddesc, hid_t gid)
+s_map_file (struct hdf5_dset_desc_t* ddesc, bool nomap)
 {
 #if DEBUG_LEVEL >= TESTING
 	sleep (1);
@@ -254,6 +310,12 @@ s_map_file (struct hdf5_dset_desc_t* ddesc, hid_t gid)
 	if (ddesc->length < 0 || ddesc->length > maxlength)
 		ddesc->length = maxlength;
 
+	if (nomap)
+	{
+		close (fd);
+		return TES_CAP_REQ_OK;
+	}
+
 	/* mmap from BOF, since mmap requires the offset be a multiple
 	 * of page size. */
 	assert (ddesc->length > 0);
@@ -277,10 +339,15 @@ s_map_file (struct hdf5_dset_desc_t* ddesc, hid_t gid)
 
 /*
  * Write data given in ddesc as a dataset inside group gid.
+ * If external is true and the dataset is given as a file, the
+ * dataset will only refer to the file and nothing is copied.
+ * If done is not NULL, the number of bytes written is added to it
+ * as the write progresses.
  * Returns TES_CAP_REQ_*
  */
 static int
-s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid)
+s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid,
+	bool external, uint64_t* done)
 {
 #if DEBUG_LEVEL >= TESTING
 	sleep (1);
@@ -288,13 +355,39 @@ s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid)
 	assert (ddesc != NULL);
 	assert (ddesc->dsetname != NULL);
 	assert (ddesc->buffer != (void*)-1);
-	if (ddesc->buffer == NULL)
+	external = (external && ddesc->filename != NULL &&
+		ddesc->length > 0);
+	if (external)
+		assert (ddesc->buffer == NULL);
+	else if (ddesc->buffer == NULL)
 		assert (ddesc->length == 0);
 	else
 		assert (ddesc->length > 0);
 
 	logmsg (0, LOG_DEBUG,
-		"Creating dataset %s", ddesc->dsetname);
+		"Creating %sdataset %s",
+		external ? "external " : "", ddesc->dsetname);
+
+	/* Set the external file. */
+	hid_t dcpl = H5P_DEFAULT;
+	if (external)
+	{
+		assert (ddesc->offset >= 0);
+		dcpl = H5Pcreate (H5P_DATASET_CREATE);
+		herr_t err = -1;
+		if (dcpl >= 0)
+			err = H5Pset_external (dcpl, ddesc->filename,
+				ddesc->offset, ddesc->length);
+		if (err < 0)
+		{
+			logmsg (0, LOG_ERR,
+				"Could not set external file %s",
+				ddesc->filename);
+			if (dcpl >= 0)
+				H5Pclose (dcpl);
+			return TES_CAP_REQ_ECONV;
+		}
+	}
 
 	/* Create the datasets. */
 	hsize_t length[1] = {ddesc->length};
@@ -303,10 +396,22 @@ s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid)
 	{
 		logmsg (0, LOG_ERR,
 			"Could not create dataspace");
+		if (external)
+			H5Pclose (dcpl);
 		return TES_CAP_REQ_ECONV;
 	}
+	/* Dataset names may contain slashes, create missing groups. */
+	hid_t lcpl = H5Pcreate (H5P_LINK_CREATE);
+	if (lcpl >= 0)
+		H5Pset_create_intermediate_group (lcpl, 1);
+	else
+		lcpl = H5P_DEFAULT;
 	hid_t dset = H5Dcreate (gid, ddesc->dsetname, DATATYPE,
-		dspace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		dspace, lcpl, dcpl, H5P_DEFAULT);
+	if (lcpl != H5P_DEFAULT)
+		H5Pclose (lcpl);
+	if (external)
+		H5Pclose (dcpl);
 	if (dset < 0)
 	{
 		logmsg (0, LOG_ERR,
@@ -316,19 +421,65 @@ s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid)
 		return TES_CAP_REQ_ECONV;
 	}
 
-	/* Check if dataset is empty. */
-	if (ddesc->length == 0)
+	/* Check if dataset is empty or external. */
+	if (ddesc->length == 0 || external)
 	{
 		H5Dclose (dset);
 		H5Sclose (dspace);
+		if (done != NULL)
+			__atomic_add_fetch (done, ddesc->length,
+				__ATOMIC_RELAXED);
 		return TES_CAP_REQ_OK;
 	}
 
-	/* Write the data. */
+	/* Map the checksums, skip the blocks before the dataset. */
 	assert (ddesc->buffer != NULL);
 	assert (ddesc->offset >= 0);
-	herr_t err = H5Dwrite (dset, DATATYPE, H5S_ALL,
-		H5S_ALL, H5P_DEFAULT, ddesc->buffer + ddesc->offset);
+	struct tescap_crc* crcs = NULL;
+	size_t nblocks = 0;
+	size_t b = 0;
+	if (ddesc->verify && ddesc->filename != NULL)
+	{
+		crcs = tescap_crc_map (ddesc->filename, &nblocks);
+		if (crcs == NULL && errno != ENOENT)
+			logmsg (errno, LOG_WARNING,
+				"Could not map checksums of %s",
+				ddesc->filename);
+		while (b < nblocks &&
+			crcs[b].offset + crcs[b].length <= (uint64_t)ddesc->offset)
+			b++;
+	}
+
+	/* Write the data in chunks. */
+	herr_t err = 0;
+	int rc = TES_CAP_REQ_OK;
+	for (hsize_t start = 0; start < length[0] && err >= 0;
+		start += WRITE_CHUNK)
+	{
+		hsize_t count[1] = {length[0] - start};
+		if (count[0] > WRITE_CHUNK)
+			count[0] = WRITE_CHUNK;
+		if (crcs != NULL && s_verify_blocks (ddesc, crcs, nblocks,
+			&b, ddesc->offset + start + count[0]) == -1)
+		{
+			rc = TES_CAP_REQ_ECONV;
+			break;
+		}
+		hsize_t offset[1] = {start};
+		hid_t mspace = H5Screate_simple (1, count, NULL);
+		err = H5Sselect_hyperslab (dspace, H5S_SELECT_SET,
+			offset, NULL, count, NULL);
+		if (mspace < 0)
+			err = -1;
+		if (err >= 0)
+			err = H5Dwrite (dset, DATATYPE, mspace, dspace,
+				H5P_DEFAULT,
+				(char*)ddesc->buffer + ddesc->offset + start);
+		if (mspace >= 0)
+			H5Sclose (mspace);
+		if (err >= 0 && done != NULL)
+			__atomic_add_fetch (done, count[0], __ATOMIC_RELAXED);
+	}
 	if (err < 0)
 	{
 		logmsg (0, LOG_ERR,
@@ -336,10 +487,43 @@ s_create_dset (const struct hdf5_dset_desc_t* ddesc, hid_t gid)
 			ddesc->dsetname);
 	}
 
+	tescap_crc_unmap (crcs, nblocks);
 	H5Dclose (dset);
 	H5Sclose (dspace);
 
-	return (err < 0 ? TES_CAP_REQ_ECONV : TES_CAP_REQ_OK);
+	return (err < 0 ? TES_CAP_REQ_ECONV : rc);
+}
+
+/*
+ * Check the blocks of the mapped file, starting at *b, which end
+ * before end. Advances b past them. Blocks which extend beyond the
+ * mapping (the dataset is only a part of the file) are not checked.
+ * Returns 0 if all match, -1 otherwise.
+ */
+static int
+s_verify_blocks (const struct hdf5_dset_desc_t* ddesc,
+	const struct tescap_crc* crcs, size_t nblocks, size_t* b,
+	off_t end)
+{
+	assert (ddesc != NULL);
+	assert (ddesc->buffer != NULL);
+	assert (crcs != NULL);
+	assert (b != NULL);
+
+	for (; *b < nblocks &&
+		crcs[*b].offset + crcs[*b].length <= (uint64_t)end; (*b)++)
+	{
+		const struct tescap_crc* crc = &crcs[*b];
+		if (tescap_crc32c (0, (char*)ddesc->buffer + crc->offset,
+			crc->length) != crc->crc)
+		{
+			logmsg (0, LOG_ERR,
+				"Checksum mismatch in %s at offset %lu",
+				ddesc->filename, crc->offset);
+			return -1;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -469,7 +653,7 @@ s_hdf5_init (void* creq_data_)
 		if (ddesc->filename == NULL)
 			continue;
 
-		int rc = s_map_file (ddesc, client_gid);
+		int rc = s_map_file (ddesc, creq->external);
 		if (rc != TES_CAP_REQ_OK)
 		{
 			H5Gclose (client_gid);
@@ -478,6 +662,15 @@ s_hdf5_init (void* creq_data_)
 		}
 	}
 
+	/* Report the total size. */
+	if (creq->total != NULL)
+	{
+		uint64_t total = 0;
+		for (int d = 0; d < creq->num_dsets; d++)
+			total += creq->dsets[d].length;
+		__atomic_store_n (creq->total, total, __ATOMIC_RELAXED);
+	}
+
 	/* Save the file and group id. */
 	creq_data->file_id = fid;
 	creq_data->group_id = client_gid;
@@ -502,7 +695,8 @@ s_hdf5_write (void* creq_data_)
 	{
 		struct hdf5_dset_desc_t* ddesc =
 			&creq_data->creq->dsets[d];
-		int rc = s_create_dset (ddesc, creq_data->group_id);
+		rc = s_create_dset (ddesc, creq_data->group_id,
+			creq_data->creq->external, creq_data->creq->done);
 		if (rc != TES_CAP_REQ_OK)
 			break;
 	}
@@ -514,6 +708,204 @@ s_hdf5_write (void* creq_data_)
 	return rc;
 }
 
+/*
+ * The dispatcher thread. Checks on workers every POLL_INTERVAL ms or
+ * when a job is queued.
+ */
+static void*
+s_dispatch (void* arg)
+{
+	set_logid ("[Conversions]     ");
+
+	pthread_mutex_lock (&s_queue.lock);
+	while ( ! s_queue.stop )
+	{
+		s_reap ();
+		s_run_next ();
+
+		struct timespec ts;
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_nsec += POLL_INTERVAL * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait (&s_queue.cond, &s_queue.lock, &ts);
+	}
+	pthread_mutex_unlock (&s_queue.lock);
+
+	return NULL;
+}
+
+/*
+ * Collects the exit status of finished workers. Only waits for the
+ * workers' pids, other children of the process are not touched.
+ * Call with the lock held.
+ */
+static void
+s_reap (void)
+{
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->state != HDF5_CONV_RUNNING)
+			continue;
+
+		int wstatus;
+		pid_t pid = waitpid (job->pid, &wstatus, WNOHANG);
+		if (pid == 0)
+			continue; /* still running */
+
+		if (pid == -1)
+		{
+			logmsg (errno, LOG_ERR,
+				"Could not get status of conversion %u", job->id);
+			job->status = TES_CAP_REQ_ECONV;
+		}
+		else if (WIFEXITED (wstatus))
+			job->status = WEXITSTATUS (wstatus);
+		else
+			job->status = TES_CAP_REQ_ECONV;
+
+		logmsg (0, LOG_INFO, "Conversion %u finished with status %hhu",
+			job->id, job->status);
+		job->state = HDF5_CONV_DONE;
+		s_queue.nrunning--;
+	}
+}
+
+/*
+ * Starts queued jobs while there are free workers. Call with the
+ * lock held.
+ */
+static void
+s_run_next (void)
+{
+	while (s_queue.nrunning < s_queue.nworkers)
+	{
+		struct s_job_t* job = s_next_job ();
+		if (job == NULL)
+			return;
+
+		job->creq.done = &job->done;
+		job->creq.total = &job->total;
+
+		pid_t pid = fork ();
+		if (pid == 0)
+		{ /* worker */
+			/* Only this thread is running in the child, don't
+			 * touch the lock. */
+			int status = hdf5_conv (&job->creq);
+			_exit (status);
+		}
+
+		if (pid == -1)
+		{
+			logmsg (errno, LOG_ERR,
+				"Could not fork for conversion %u", job->id);
+			job->status = TES_CAP_REQ_EFAIL;
+			job->state = HDF5_CONV_DONE;
+			continue;
+		}
+
+		logmsg (0, LOG_INFO, "Started conversion %u into %s",
+			job->id, job->creq.filename);
+		job->pid = pid;
+		job->state = HDF5_CONV_RUNNING;
+		s_queue.nrunning++;
+	}
+}
+
+/*
+ * Returns the earliest queued job which does not write to the same
+ * file as a running one, or NULL. Call with the lock held.
+ */
+static struct s_job_t*
+s_next_job (void)
+{
+	struct s_job_t* next = NULL;
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->state != HDF5_CONV_QUEUED ||
+			(next != NULL && next->id < job->id))
+			continue;
+
+		bool busy = 0;
+		for (int k = 0; k < s_queue.nslots && ! busy; k++)
+		{
+			struct s_job_t* other = &s_queue.jobs[k];
+			busy = (other->state == HDF5_CONV_RUNNING &&
+				strcmp (other->creq.filename,
+					job->creq.filename) == 0);
+		}
+		if ( ! busy )
+			next = job;
+	}
+	return next;
+}
+
+/*
+ * Copies the request, with all strings and buffers, into a single
+ * allocated block, which the caller must free.
+ * Returns the block or NULL on error.
+ */
+static void*
+s_copy_req (const struct hdf5_conv_req_t* creq,
+	struct hdf5_conv_req_t* copy)
+{
+	size_t dsize = creq->num_dsets * sizeof (struct hdf5_dset_desc_t);
+	size_t size = dsize + strlen (creq->filename) + 1 +
+		strlen (creq->group) + 1;
+	for (int d = 0; d < creq->num_dsets; d++)
+	{
+		const struct hdf5_dset_desc_t* ddesc = &creq->dsets[d];
+		size += strlen (ddesc->dsetname) + 1;
+		if (ddesc->filename != NULL)
+			size += strlen (ddesc->filename) + 1;
+		else
+			size += ddesc->length;
+	}
+
+	char* block = (char*) malloc (size);
+	if (block == NULL)
+		return NULL;
+
+	*copy = *creq;
+	copy->dsets = (struct hdf5_dset_desc_t*) block;
+	char* cur = block + dsize;
+
+	copy->filename = strcpy (cur, creq->filename);
+	cur += strlen (cur) + 1;
+	copy->group = strcpy (cur, creq->group);
+	cur += strlen (cur) + 1;
+	for (int d = 0; d < creq->num_dsets; d++)
+	{
+		const struct hdf5_dset_desc_t* ddesc = &creq->dsets[d];
+		struct hdf5_dset_desc_t* dcopy = &copy->dsets[d];
+		*dcopy = *ddesc;
+		dcopy->dsetname = strcpy (cur, ddesc->dsetname);
+		cur += strlen (cur) + 1;
+		if (ddesc->filename != NULL)
+		{
+			dcopy->filename = strcpy (cur, ddesc->filename);
+			cur += strlen (cur) + 1;
+		}
+		else
+		{
+			memcpy (cur, (char*)ddesc->buffer + ddesc->offset,
+				ddesc->length);
+			dcopy->buffer = cur;
+			dcopy->offset = 0;
+			cur += ddesc->length;
+		}
+	}
+	assert (cur == block + size);
+
+	return block;
+}
+
 /* -------------------------------------------------------------- */
 /* ----------------------------- API ---------------------------- */
 /* -------------------------------------------------------------- */
@@ -590,9 +982,10 @@ hdf5_conv (struct hdf5_conv_req_t* creq)
 			ddesc->buffer = NULL;
 		}
 #ifndef NODELETE_TMP
-		if (status == TES_CAP_REQ_OK)
+		/* External datasets refer to the data files. */
+		if (status == TES_CAP_REQ_OK && ! creq->external)
 		{
-			int rc = unlink (ddesc->filename)
+			int rc = unlink (ddesc->filename);
 			if (rc == -1)
 				status = TES_CAP_REQ_EFIN;
 		}
@@ -602,3 +995,193 @@ hdf5_conv (struct hdf5_conv_req_t* creq)
 	/* Unlink files. */
 	return status;
 }
+
+int
+hdf5_conv_queue_start (int nworkers, int nslots)
+{
+	assert (nworkers > 0);
+	assert (nslots >= nworkers);
+	assert ( ! s_queue.started );
+
+	s_queue.jobs = (struct s_job_t*) mmap (NULL,
+		nslots * sizeof (struct s_job_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s_queue.jobs == MAP_FAILED)
+	{
+		logmsg (errno, LOG_ERR, "Cannot mmap the job queue");
+		return -1;
+	}
+	memset (s_queue.jobs, 0, nslots * sizeof (struct s_job_t));
+
+	s_queue.nslots = nslots;
+	s_queue.nworkers = nworkers;
+	s_queue.nrunning = 0;
+	s_queue.stop = 0;
+
+	int rc = pthread_create (&s_queue.thread, NULL, s_dispatch, NULL);
+	if (rc != 0)
+	{
+		logmsg (rc, LOG_ERR, "Cannot start the conversion thread");
+		munmap (s_queue.jobs, nslots * sizeof (struct s_job_t));
+		return -1;
+	}
+
+	s_queue.started = 1;
+	return 0;
+}
+
+void
+hdf5_conv_queue_stop (void)
+{
+	if ( ! s_queue.started )
+		return;
+
+	pthread_mutex_lock (&s_queue.lock);
+	s_queue.stop = 1;
+	pthread_cond_signal (&s_queue.cond);
+	pthread_mutex_unlock (&s_queue.lock);
+	pthread_join (s_queue.thread, NULL);
+
+	s_reap ();
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->state == HDF5_CONV_QUEUED)
+			logmsg (0, LOG_WARNING, "Discarding conversion into %s",
+				job->creq.filename);
+		else if (job->state == HDF5_CONV_RUNNING)
+			logmsg (0, LOG_WARNING,
+				"Conversion into %s is still running",
+				job->creq.filename);
+		free (job->copy);
+	}
+
+	munmap (s_queue.jobs, s_queue.nslots * sizeof (struct s_job_t));
+	s_queue.jobs = NULL;
+	s_queue.started = 0;
+}
+
+int
+hdf5_conv_queue (const struct hdf5_conv_req_t* creq, uint32_t* id)
+{
+	assert (s_queue.started);
+	assert (id != NULL);
+
+	if (creq == NULL ||
+		creq->filename == NULL ||
+		creq->group == NULL ||
+		creq->dsets == NULL ||
+		creq->num_dsets == 0)
+	{
+		logmsg (0, LOG_ERR, "Invalid request");
+		return TES_CAP_REQ_EINV;
+	}
+
+	pthread_mutex_lock (&s_queue.lock);
+
+	/* Use a free slot or the oldest finished job. */
+	struct s_job_t* slot = NULL;
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->id == 0)
+		{
+			slot = job;
+			break;
+		}
+		if (job->state == HDF5_CONV_DONE &&
+			(slot == NULL || job->id < slot->id))
+			slot = job;
+	}
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock (&s_queue.lock);
+		logmsg (0, LOG_ERR, "Conversion queue is full");
+		return TES_CAP_REQ_EFAIL;
+	}
+
+	struct hdf5_conv_req_t copy;
+	void* block = s_copy_req (creq, &copy);
+	if (block == NULL)
+	{
+		pthread_mutex_unlock (&s_queue.lock);
+		logmsg (errno, LOG_ERR, "Cannot copy the request");
+		return TES_CAP_REQ_EFAIL;
+	}
+	copy.async = 0;
+
+	free (slot->copy); /* of the finished job, if any */
+	memset (slot, 0, sizeof (*slot));
+	slot->creq = copy;
+	slot->copy = block;
+	if (++s_queue.last_id == 0)
+		s_queue.last_id++;
+	slot->id = s_queue.last_id;
+	slot->state = HDF5_CONV_QUEUED;
+	*id = slot->id;
+
+	pthread_cond_signal (&s_queue.cond);
+	pthread_mutex_unlock (&s_queue.lock);
+
+	return TES_CAP_REQ_OK;
+}
+
+int
+hdf5_conv_stat (uint32_t id, struct hdf5_conv_stat_t* st)
+{
+	assert (s_queue.started);
+	assert (st != NULL);
+
+	if (id == 0)
+		return -1;
+
+	int rc = -1;
+	pthread_mutex_lock (&s_queue.lock);
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->id != id)
+			continue;
+
+		st->state = job->state;
+		st->status = job->status;
+		st->done = __atomic_load_n (&job->done, __ATOMIC_RELAXED);
+		st->total = __atomic_load_n (&job->total, __ATOMIC_RELAXED);
+		st->ahead = 0;
+		for (int k = 0; k < s_queue.nslots; k++)
+		{
+			if (s_queue.jobs[k].state == HDF5_CONV_QUEUED &&
+				s_queue.jobs[k].id < id)
+				st->ahead++;
+		}
+		rc = 0;
+		break;
+	}
+	pthread_mutex_unlock (&s_queue.lock);
+
+	return rc;
+}
+
+int
+hdf5_conv_find (const char* filename, const char* group,
+	uint32_t* id)
+{
+	assert (s_queue.started);
+	assert (filename != NULL);
+	assert (group != NULL);
+	assert (id != NULL);
+
+	*id = 0;
+	pthread_mutex_lock (&s_queue.lock);
+	for (int j = 0; j < s_queue.nslots; j++)
+	{
+		struct s_job_t* job = &s_queue.jobs[j];
+		if (job->id > *id &&
+			strcmp (job->creq.filename, filename) == 0 &&
+			strcmp (job->creq.group, group) == 0)
+			*id = job->id;
+	}
+	pthread_mutex_unlock (&s_queue.lock);
+
+	return (*id == 0 ? -1 : 0);
+}
@@ -0,0 +1,336 @@
+#include "tescap.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+
+/*
+ * Reads a varint at *pos, advancing it.
+ * Returns 0 on success, -1 if it runs past len or is too long.
+ */
+static int
+s_varint (const uint8_t* buf, size_t len, size_t* pos, uint64_t* val)
+{
+	*val = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (*pos == len)
+			return -1;
+		uint8_t b = buf[(*pos)++];
+		*val |= (uint64_t)(b & 0x7F) << shift;
+		if ( ! (b & 0x80) )
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Returns the data file frames of type ftype are saved to, as for
+ * the offsets in the tick index.
+ */
+static int
+s_ftype_dat (uint8_t ftype)
+{
+	switch (TESCAP_FTYPE_PT (ftype))
+	{
+		case TESCAP_FTYPE_TICK:
+			return TESCAP_TDAT;
+		case TESCAP_FTYPE_MCA:
+			return TESCAP_MDAT;
+		case TESCAP_FTYPE_BAD:
+			return TESCAP_BDAT;
+		default:
+			return TESCAP_EDAT;
+	}
+}
+
+ssize_t
+tescap_cidx_decode (const uint8_t* buf, size_t len,
+	struct tescap_fidx* fidx, size_t nframes)
+{
+	assert (buf != NULL || len == 0);
+	assert (sizeof (struct tescap_fidx) == TESCAP_FIDX_LEN);
+
+	struct tescap_fidx prev = {0};
+	uint64_t next[TESCAP_NDATS] = {0};
+	size_t n = 0;
+	size_t pos = 0;
+	while (pos < len)
+	{
+		uint8_t hdr = buf[pos++];
+		uint64_t count = 1;
+		if (hdr == TESCAP_CIDX_RUN)
+		{
+			if (n == 0 || s_varint (buf, len, &pos, &count) == -1)
+				goto corrupt;
+			prev.changed = 0;
+		}
+		else
+		{
+			uint64_t length, esize, delta;
+			if (s_varint (buf, len, &pos, &length) == -1)
+				goto corrupt;
+			if (hdr & TESCAP_CIDX_ESIZE)
+			{
+				if (s_varint (buf, len, &pos, &esize) == -1)
+					goto corrupt;
+				prev.esize = esize;
+			}
+			else if (n == 0)
+				goto corrupt;
+			if (s_varint (buf, len, &pos, &delta) == -1)
+				goto corrupt;
+
+			prev.length = length;
+			prev.changed = ( (hdr & TESCAP_CIDX_CHANGED) != 0 );
+			prev.ftype = hdr & ~(TESCAP_CIDX_CHANGED | TESCAP_CIDX_ESIZE);
+			/* undo zigzag */
+			prev.start = next[s_ftype_dat (prev.ftype)] +
+				( (delta >> 1) ^ -(delta & 1) );
+		}
+
+		int dat = s_ftype_dat (prev.ftype);
+		for (; count > 0; count--, n++)
+		{
+			if (hdr == TESCAP_CIDX_RUN)
+				prev.start = next[dat];
+			next[dat] = prev.start + prev.length;
+			if (fidx != NULL && n < nframes)
+				fidx[n] = prev;
+		}
+	}
+	return n;
+
+corrupt:
+	errno = EINVAL;
+	return -1;
+}
+
+struct tescap_fidx*
+tescap_cidx_load (const char* filename, size_t* nframes)
+{
+	assert (filename != NULL);
+	assert (nframes != NULL);
+
+	int fd = open (filename, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat fstats;
+	int rc = fstat (fd, &fstats);
+	if (rc == -1)
+	{
+		close (fd);
+		return NULL;
+	}
+	if (fstats.st_size == 0)
+	{ /* cannot map an empty file */
+		close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	uint8_t* map = mmap (NULL, fstats.st_size, PROT_READ,
+		MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	struct tescap_fidx* fidx = NULL;
+	ssize_t n = tescap_cidx_decode (map, fstats.st_size, NULL, 0);
+	if (n > 0)
+		fidx = malloc (n * TESCAP_FIDX_LEN);
+	if (fidx != NULL)
+	{
+		tescap_cidx_decode (map, fstats.st_size, fidx, n);
+		*nframes = n;
+	}
+	else if (n == 0)
+		errno = EINVAL;
+
+	munmap (map, fstats.st_size);
+	return fidx;
+}
+
+/*
+ * mmap a file of fixed-length entries read-only. Sets nentries to
+ * the number of entries in it.
+ * Returns the mapped address or NULL on error (errno is set).
+ */
+static void*
+s_map_entries (const char* filename, size_t len, size_t* nentries)
+{
+	int fd = open (filename, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat fstats;
+	int rc = fstat (fd, &fstats);
+	if (rc == -1)
+	{
+		close (fd);
+		return NULL;
+	}
+	if (fstats.st_size == 0 || fstats.st_size % len != 0)
+	{ /* cannot map an empty file; or it is corrupt */
+		close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void* map = mmap (NULL, fstats.st_size, PROT_READ,
+		MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*nentries = fstats.st_size / len;
+	return map;
+}
+
+/* CRC32C (Castagnoli), reflected polynomial. */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t
+s_crc32c_sw (uint32_t crc, const uint8_t* buf, size_t len)
+{
+	static uint32_t table[256];
+	if (table[1] == 0)
+	{ /* benign race, all threads compute the same table */
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			uint32_t c = b;
+			for (int k = 0; k < 8; k++)
+				c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+			table[b] = c;
+		}
+	}
+
+	for (size_t i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef __x86_64__
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+s_crc32c_hw (uint32_t crc, const uint8_t* buf, size_t len)
+{
+	uint64_t c = crc;
+	for (; len > 0 && ((uintptr_t)buf & 7) != 0; len--, buf++)
+		c = __builtin_ia32_crc32qi (c, *buf);
+	for (; len >= 8; len -= 8, buf += 8)
+		c = __builtin_ia32_crc32di (c, *(const uint64_t*)buf);
+	for (; len > 0; len--, buf++)
+		c = __builtin_ia32_crc32qi (c, *buf);
+	return (uint32_t)c;
+}
+#endif
+
+uint32_t
+tescap_crc32c (uint32_t crc, const void* buf, size_t len)
+{
+	assert (buf != NULL || len == 0);
+
+	crc = ~crc;
+#ifdef __x86_64__
+	if (__builtin_cpu_supports ("sse4.2"))
+		return ~s_crc32c_hw (crc, buf, len);
+#endif
+	return ~s_crc32c_sw (crc, buf, len);
+}
+
+struct tescap_crc*
+tescap_crc_map (const char* filename, size_t* nblocks)
+{
+	assert (sizeof (struct tescap_crc) == TESCAP_CRC_LEN);
+	assert (filename != NULL);
+	assert (nblocks != NULL);
+
+	char crcfname[PATH_MAX];
+	int rc = snprintf (crcfname, PATH_MAX, "%s" TESCAP_CRC_EXT,
+		filename);
+	if (rc < 0 || rc >= PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return (struct tescap_crc*) s_map_entries (
+		crcfname, TESCAP_CRC_LEN, nblocks);
+}
+
+void
+tescap_crc_unmap (struct tescap_crc* crcs, size_t nblocks)
+{
+	if (crcs == NULL)
+		return;
+
+	munmap (crcs, nblocks * TESCAP_CRC_LEN);
+}
+
+struct tescap_tidx*
+tescap_tidx_map (const char* filename, size_t* nticks)
+{
+	assert (sizeof (struct tescap_tidx) == TESCAP_TIDX_LEN);
+	assert (filename != NULL);
+	assert (nticks != NULL);
+
+	return (struct tescap_tidx*) s_map_entries (
+		filename, TESCAP_TIDX_LEN, nticks);
+}
+
+void
+tescap_tidx_unmap (struct tescap_tidx* tidx, size_t nticks)
+{
+	if (tidx == NULL)
+		return;
+
+	munmap (tidx, nticks * TESCAP_TIDX_LEN);
+}
+
+size_t
+tescap_tidx_find (const struct tescap_tidx* tidx,
+	size_t nticks, uint64_t ts)
+{
+	assert (tidx != NULL || nticks == 0);
+
+	size_t lo = 0, hi = nticks;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (tidx[mid].ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int
+tescap_tidx_range (const struct tescap_tidx* tidx,
+	size_t nticks, size_t first, size_t last, int dat,
+	off_t* start, off_t* end)
+{
+	assert (tidx != NULL);
+	assert (dat >= 0 && dat < TESCAP_NDATS);
+	assert (start != NULL);
+	assert (end != NULL);
+
+	if (first > last || last >= nticks)
+		return -1;
+
+	*start = tidx[first].offsets[dat];
+	if (last + 1 == nticks)
+		*end = -1;
+	else
+		*end = tidx[last + 1].offsets[dat];
+
+	return 0;
+}
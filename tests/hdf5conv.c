@@ -19,6 +19,7 @@
 #define OVRWTMODE TES_H5_OVRWT_RELINK
 // #define OVRWTMODE TES_H5_OVRWT_FILE
 #define ASYNC 0
+#define EXTERNAL 0
 #define DAEMONIZE 0
 
 int main (void)
@@ -122,6 +123,7 @@ int main (void)
 		.num_dsets = num_dsets,
 		.ovrwtmode = OVRWTMODE,
 		.async = ASYNC,
+		.external = EXTERNAL,
 	};
 
 	int rc = 0;
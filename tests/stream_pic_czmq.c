@@ -0,0 +1,102 @@
+/*
+ * Round-trip of the stream request and credit messages: sends them
+ * from a DEALER as tesc remote_stream does and decodes them on a
+ * ROUTER as tesd does (one binary frame per number, of the size
+ * given in the picture).
+ */
+
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "api.h"
+
+#define ADDR "inproc://stream_pic_czmq"
+
+static int
+pop_uint (zmsg_t* msg, void* val, size_t size)
+{
+	zframe_t* frame = zmsg_pop (msg);
+	int rc = -1;
+	if (frame != NULL && zframe_size (frame) == size)
+	{
+		memcpy (val, zframe_data (frame), size);
+		rc = 0;
+	}
+	zframe_destroy (&frame);
+	return rc;
+}
+
+int
+main (void)
+{
+	zsock_t* router = zsock_new_router ("@" ADDR);
+	zsock_t* dealer = zsock_new_dealer (">" ADDR);
+	assert (router != NULL);
+	assert (dealer != NULL);
+
+	/* Request, as tesc sends it. */
+	uint64_t min_ticks = 5, min_events = 1000;
+	uint8_t columns = 1;
+	uint32_t credit = 4;
+	zsock_send (dealer, TES_STREAM_REQ_PIC,
+		min_ticks, min_events, columns, credit);
+
+	zframe_t* client = NULL;
+	zmsg_t* msg = NULL;
+	int rc = zsock_recv (router, "fm", &client, &msg);
+	assert (rc != -1);
+	assert (zmsg_size (msg) == 4);
+
+	uint64_t r_ticks = 0, r_events = 0;
+	uint8_t r_columns = 0;
+	uint32_t r_credit = 0;
+	rc  = pop_uint (msg, &r_ticks, sizeof (r_ticks));
+	rc |= pop_uint (msg, &r_events, sizeof (r_events));
+	rc |= pop_uint (msg, &r_columns, sizeof (r_columns));
+	rc |= pop_uint (msg, &r_credit, sizeof (r_credit));
+	zmsg_destroy (&msg);
+	assert (rc == 0);
+	assert (r_ticks == min_ticks);
+	assert (r_events == min_events);
+	assert (r_columns == columns);
+	assert (r_credit == credit);
+
+	/* Credit, as tesc sends it. */
+	zsock_send (dealer, TES_STREAM_CREDIT_PIC, (uint32_t)1);
+	zframe_t* client2 = NULL;
+	rc = zsock_recv (router, "fm", &client2, &msg);
+	assert (rc != -1);
+	assert (zframe_eq (client, client2));
+	assert (zmsg_size (msg) == 1);
+	r_credit = 0;
+	rc = pop_uint (msg, &r_credit, sizeof (r_credit));
+	zmsg_destroy (&msg);
+	assert (rc == 0);
+	assert (r_credit == 1);
+
+	/* Reply, as tesd sends it. */
+	zsock_send (router, "f" TES_STREAM_REP_PIC, client,
+		TES_STREAM_END, TES_CAP_REQ_EINV,
+		"", (uint64_t)0, NULL, (size_t)0);
+	uint8_t type, status;
+	char* ext = NULL;
+	uint64_t offset;
+	byte* data = NULL;
+	size_t len;
+	rc = zsock_recv (dealer, TES_STREAM_REP_PIC,
+		&type, &status, &ext, &offset, &data, &len);
+	assert (rc != -1);
+	assert (type == TES_STREAM_END);
+	assert (status == TES_CAP_REQ_EINV);
+	zstr_free (&ext);
+	free (data);
+
+	zframe_destroy (&client);
+	zframe_destroy (&client2);
+	zsock_destroy (&dealer);
+	zsock_destroy (&router);
+	puts ("OK");
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Print the range of bytes in the event data file for the ticks
+ * between two timestamps.
+ */
+
+#include "tescap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define TIDXFILE "/media/data/captures/test.tidx"
+
+int
+main (int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		fprintf (stderr, "Usage: %s <from ts> <to ts>\n", argv[0]);
+		return -1;
+	}
+	uint64_t from_ts = strtoul (argv[1], NULL, 10);
+	uint64_t to_ts = strtoul (argv[2], NULL, 10);
+
+	size_t nticks;
+	struct tescap_tidx* tidx = tescap_tidx_map (TIDXFILE, &nticks);
+	if (tidx == NULL)
+	{
+		perror ("Could not map the tick index");
+		return -1;
+	}
+	printf ("%lu ticks, timestamps %lu to %lu\n", nticks,
+		tidx[0].ts, tidx[nticks - 1].ts);
+
+	size_t first = tescap_tidx_find (tidx, nticks, from_ts);
+	size_t last = tescap_tidx_find (tidx, nticks, to_ts);
+	if (last == nticks || tidx[last].ts > to_ts)
+		last--; /* last one before to_ts */
+
+	off_t start, end;
+	int rc = tescap_tidx_range (tidx, nticks, first, last,
+		TESCAP_EDAT, &start, &end);
+	if (rc == -1)
+	{
+		printf ("No ticks in range\n");
+	}
+	else
+	{
+		printf ("Ticks %lu to %lu: frames %u to %u\n",
+			first, last,
+			tidx[first].tick_frame, tidx[last].stop_frame);
+		if (end == -1)
+			printf ("Events from byte %ld until EOF\n", start);
+		else
+			printf ("Events from byte %ld to %ld\n", start, end);
+	}
+
+	tescap_tidx_unmap (tidx, nticks);
+	return 0;
+}
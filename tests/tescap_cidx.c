@@ -0,0 +1,77 @@
+/*
+ * Decode a compact frame index and print its entries, or compare
+ * them to those in a frame index of the same capture.
+ */
+
+#include "tescap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+int
+main (int argc, char* argv[])
+{
+	if (argc != 2 && argc != 3)
+	{
+		fprintf (stderr, "Usage: %s <cidx file> [<fidx file>]\n",
+			argv[0]);
+		return -1;
+	}
+
+	size_t nframes;
+	struct tescap_fidx* fidx = tescap_cidx_load (argv[1], &nframes);
+	if (fidx == NULL)
+	{
+		perror ("Could not decode the compact index");
+		return -1;
+	}
+
+	if (argc == 2)
+	{
+		for (size_t f = 0; f < nframes; f++)
+			printf ("%8lu: start %10lu, length %5u, esize %5hu, "
+				"type %2u%s%s%s\n", f,
+				fidx[f].start, fidx[f].length, fidx[f].esize,
+				TESCAP_FTYPE_PT (fidx[f].ftype),
+				fidx[f].changed ? ", changed" : "",
+				(fidx[f].ftype & TESCAP_FTYPE_HDR) ? ", header" : "",
+				(fidx[f].ftype & TESCAP_FTYPE_SEQ) ? ", seq error" : "");
+		free (fidx);
+		return 0;
+	}
+
+	FILE* fp = fopen (argv[2], "r");
+	if (fp == NULL)
+	{
+		perror ("Could not open the frame index");
+		free (fidx);
+		return -1;
+	}
+	size_t f = 0;
+	struct tescap_fidx entry;
+	int rc = 0;
+	while (fread (&entry, TESCAP_FIDX_LEN, 1, fp) == 1)
+	{
+		if (f == nframes ||
+			memcmp (&entry, &fidx[f], TESCAP_FIDX_LEN) != 0)
+		{
+			printf ("Entry %lu differs\n", f);
+			rc = -1;
+			break;
+		}
+		f++;
+	}
+	if (rc == 0 && f != nframes)
+	{
+		printf ("Frame index has %lu entries, compact one %lu\n",
+			f, nframes);
+		rc = -1;
+	}
+	if (rc == 0)
+		printf ("All %lu entries match\n", nframes);
+
+	fclose (fp);
+	free (fidx);
+	return rc;
+}
@@ -0,0 +1,74 @@
+/*
+ * Check a capture file against its checksum file, block by block.
+ */
+
+#include "tescap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+int
+main (int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf (stderr, "Usage: %s <data file>\n", argv[0]);
+		return -1;
+	}
+
+	size_t nblocks;
+	struct tescap_crc* crcs = tescap_crc_map (argv[1], &nblocks);
+	if (crcs == NULL)
+	{
+		perror ("Could not map the checksums");
+		return -1;
+	}
+
+	int fd = open (argv[1], O_RDONLY);
+	if (fd == -1)
+	{
+		perror ("Could not open the data file");
+		tescap_crc_unmap (crcs, nblocks);
+		return -1;
+	}
+
+	size_t nbad = 0;
+	char* buf = NULL;
+	size_t buflen = 0;
+	for (size_t b = 0; b < nblocks; b++)
+	{
+		if (crcs[b].length > buflen)
+		{
+			buflen = crcs[b].length;
+			free (buf);
+			buf = malloc (buflen);
+			if (buf == NULL)
+			{
+				perror ("Could not allocate memory");
+				break;
+			}
+		}
+		ssize_t rc = pread (fd, buf, crcs[b].length, crcs[b].offset);
+		if (rc != (ssize_t)crcs[b].length)
+		{
+			printf ("Block %lu at %lu: short read\n",
+				b, crcs[b].offset);
+			nbad++;
+			continue;
+		}
+		if (tescap_crc32c (0, buf, crcs[b].length) != crcs[b].crc)
+		{
+			printf ("Block %lu at %lu: mismatch\n",
+				b, crcs[b].offset);
+			nbad++;
+		}
+	}
+	printf ("%lu blocks, %lu bad\n", nblocks, nbad);
+
+	free (buf);
+	close (fd);
+	tescap_crc_unmap (crcs, nblocks);
+	return (nbad == 0 ? 0 : -1);
+}